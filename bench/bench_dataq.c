@@ -0,0 +1,198 @@
+/*
+ * bench_dataq.c - publish queue contention benchmark, the "bench_dataq"
+ * target.
+ *
+ *  - 1 to 64 producer threads push messages through
+ *    data_queue_enqueue_msg() while one consumer drains them with
+ *    data_queue_dequeue_batch(), as the pollers and the mqtt thread do
+ *  - the queue blocks when full, so every message arrives and the rate is
+ *    what the consumer sees end to end
+ *  - each producer re-queues one message of its own (msg_get() per
+ *    push), so the numbers are the queue's and not the pool allocator's
+ *  - the same runs go through a ring behind one mutex and two condition
+ *    variables, the queue's design before it went lock-free, as the
+ *    reference
+ *
+ * usage: bench_dataq [messages per run]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "dataq.h"
+#include "msgpool.h"
+
+#define BENCH_QUEUE_CAP		1024	/* as the mqtt thread sets it up */
+#define BENCH_MAX_PRODUCERS	64
+#define BENCH_BATCH		32
+#define BENCH_DEFAULT_MSGS	2000000
+
+/* the reference: one lock around a ring, as dataq.c used to be */
+struct mutex_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct msg_buf *buf[BENCH_QUEUE_CAP];
+	size_t head;
+	size_t tail;
+};
+
+struct bench_run {
+	int lockfree;
+	long per_producer;
+	pthread_barrier_t go;
+	struct mutex_ring ring;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ring_push(struct mutex_ring *r, struct msg_buf *m)
+{
+	pthread_mutex_lock(&r->lock);
+	while ((r->tail + 1) % BENCH_QUEUE_CAP == r->head)
+		pthread_cond_wait(&r->not_full, &r->lock);
+	r->buf[r->tail] = m;
+	r->tail = (r->tail + 1) % BENCH_QUEUE_CAP;
+	pthread_cond_signal(&r->not_empty);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static struct msg_buf *ring_pop(struct mutex_ring *r)
+{
+	struct msg_buf *m;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->head == r->tail)
+		pthread_cond_wait(&r->not_empty, &r->lock);
+	m = r->buf[r->head];
+	r->head = (r->head + 1) % BENCH_QUEUE_CAP;
+	pthread_cond_signal(&r->not_full);
+	pthread_mutex_unlock(&r->lock);
+	return m;
+}
+
+static void *producer(void *arg)
+{
+	struct bench_run *run = arg;
+	struct msg_buf *m = msg_alloc(64);
+	long i;
+
+	if (!m) {
+		fprintf(stderr, "[BENCH] out of messages\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(m->topic, sizeof(m->topic), "forgeedge/bench/dev/data");
+	m->len = (size_t)snprintf(m->data, m->cap, "{\"v\":1}");
+
+	pthread_barrier_wait(&run->go);
+	for (i = 0; i < run->per_producer; i++) {
+		msg_get(m);
+		if (run->lockfree)
+			data_queue_enqueue_msg(m, Q_PRIO_TELEMETRY);
+		else
+			ring_push(&run->ring, m);
+	}
+	msg_put(m);
+	return NULL;
+}
+
+/* bench - ns per message through the queue with n producers */
+static double bench(int lockfree, int n, long msgs)
+{
+	pthread_t threads[BENCH_MAX_PRODUCERS];
+	struct msg_buf *v[BENCH_BATCH];
+	struct bench_run *run;
+	long total, got = 0;
+	uint64_t t0;
+	int i, k, rc;
+
+	run = calloc(1, sizeof(*run));
+	if (!run)
+		return -1;
+	run->lockfree = lockfree;
+	run->per_producer = msgs / n;
+	total = run->per_producer * n;
+	pthread_mutex_init(&run->ring.lock, NULL);
+	pthread_cond_init(&run->ring.not_empty, NULL);
+	pthread_cond_init(&run->ring.not_full, NULL);
+	if (lockfree &&
+	    data_queue_init(BENCH_QUEUE_CAP, Q_OVERFLOW_BLOCK)) {
+		free(run);
+		return -1;
+	}
+
+	pthread_barrier_init(&run->go, NULL, n + 1);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, producer, run)) {
+			fprintf(stderr, "[BENCH] failed create producer %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&run->go);
+	t0 = now_ns();
+	while (got < total) {
+		if (!lockfree) {
+			msg_put(ring_pop(&run->ring));
+			got++;
+			continue;
+		}
+		rc = data_queue_dequeue_batch(v, BENCH_BATCH, -1);
+		for (k = 0; k < rc; k++)
+			msg_put(v[k]);
+		if (rc > 0)
+			got += rc;
+	}
+	t0 = now_ns() - t0;
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	if (lockfree)
+		data_queue_destroy();
+	pthread_barrier_destroy(&run->go);
+	pthread_mutex_destroy(&run->ring.lock);
+	pthread_cond_destroy(&run->ring.not_empty);
+	pthread_cond_destroy(&run->ring.not_full);
+	free(run);
+	return total ? (double)t0 / total : 0;
+}
+
+int main(int argc, char **argv)
+{
+	long msgs = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_MSGS;
+	int n;
+
+	if (msgs < BENCH_MAX_PRODUCERS) {
+		fprintf(stderr, "usage: %s [messages per run, >= %d]\n",
+			argv[0], BENCH_MAX_PRODUCERS);
+		return EXIT_FAILURE;
+	}
+	if (msg_pool_init(BENCH_MAX_PRODUCERS)) {
+		fprintf(stderr, "[BENCH] failed create message pool\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%ld messages per run, queue of %d\n", msgs, BENCH_QUEUE_CAP);
+	printf("%9s %14s %12s %14s %12s\n", "producers", "lock-free ns",
+	       "msg/s", "mutex ns", "msg/s");
+	for (n = 1; n <= BENCH_MAX_PRODUCERS; n *= 2) {
+		double lf = bench(1, n, msgs);
+		double mx = bench(0, n, msgs);
+
+		printf("%9d %14.1f %12.0f %14.1f %12.0f\n", n, lf,
+		       lf > 0 ? 1e9 / lf : 0, mx, mx > 0 ? 1e9 / mx : 0);
+	}
+
+	msg_pool_destroy();
+	return EXIT_SUCCESS;
+}
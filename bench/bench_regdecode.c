@@ -0,0 +1,138 @@
+/*
+ * bench_regdecode.c - register decoding benchmark, the "bench_regdecode"
+ * target.
+ *
+ *  - a register image of float32 values is decoded in each word order,
+ *    scaled and offset, the way json_values() does for a parameter:
+ *    regs_decode() on REGS_DECODE_BATCH values at a time
+ *  - the reference is libmodbus' modbus_get_float_abcd() and friends,
+ *    one value per call, times scale plus offset; both have to come to
+ *    the same doubles
+ *  - libmodbus has no getters for the other types, so float32 is the
+ *    type compared
+ *
+ * usage: bench_regdecode [values per word order]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <modbus.h>
+
+#include "regdecode.h"
+
+#define BENCH_IMAGE_VALUES	1024	/* 2048 registers, stays in cache */
+#define BENCH_DEFAULT_VALUES	20000000L
+#define BENCH_SCALE		0.1
+#define BENCH_OFFSET		-40.0
+
+typedef float (*mb_get_float)(const uint16_t *src);
+
+static const struct {
+	const char *name;
+	int order;
+	mb_get_float get;
+} orders[] = {
+	{ "ABCD", WO_ABCD, modbus_get_float_abcd },
+	{ "CDAB", WO_CDAB, modbus_get_float_cdab },
+	{ "BADC", WO_BADC, modbus_get_float_badc },
+	{ "DCBA", WO_DCBA, modbus_get_float_dcba },
+};
+
+static uint16_t image[2 * BENCH_IMAGE_VALUES];
+static double out[BENCH_IMAGE_VALUES];
+static double ref[BENCH_IMAGE_VALUES];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* fill_image - finite float32 values, stored in the given word order */
+static void fill_image(int order)
+{
+	int i;
+
+	srand(1);
+	for (i = 0; i < BENCH_IMAGE_VALUES; i++) {
+		float f = (float)rand() / RAND_MAX * 2000.0f - 1000.0f;
+		uint32_t u;
+		uint16_t hi, lo;
+
+		memcpy(&u, &f, sizeof(u));
+		hi = (uint16_t)(u >> 16);
+		lo = (uint16_t)u;
+		if (order & WO_BYTE_SWAP) {
+			hi = (uint16_t)(hi << 8 | hi >> 8);
+			lo = (uint16_t)(lo << 8 | lo >> 8);
+		}
+		image[2 * i] = order & WO_WORD_SWAP ? lo : hi;
+		image[2 * i + 1] = order & WO_WORD_SWAP ? hi : lo;
+	}
+}
+
+/* bench_libmodbus - ns per value through one getter call each */
+static double bench_libmodbus(mb_get_float get, long rounds)
+{
+	uint64_t t0 = now_ns();
+	long r;
+	int i;
+
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < BENCH_IMAGE_VALUES; i++)
+			ref[i] = get(image + 2 * i) * BENCH_SCALE +
+				 BENCH_OFFSET;
+	return (double)(now_ns() - t0) / (rounds * BENCH_IMAGE_VALUES);
+}
+
+/* bench_regs_decode - ns per value through regs_decode() batches */
+static double bench_regs_decode(int order, long rounds)
+{
+	uint64_t t0 = now_ns();
+	long r;
+	int i;
+
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < BENCH_IMAGE_VALUES; i += REGS_DECODE_BATCH)
+			regs_decode(out + i, image + 2 * i, REGS_DECODE_BATCH,
+				    DTYPE_FLOAT32, order, BENCH_SCALE,
+				    BENCH_OFFSET);
+	return (double)(now_ns() - t0) / (rounds * BENCH_IMAGE_VALUES);
+}
+
+int main(int argc, char **argv)
+{
+	long values = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_VALUES;
+	long rounds = values / BENCH_IMAGE_VALUES;
+	int k;
+
+	if (rounds < 1) {
+		fprintf(stderr, "usage: %s [values per word order, >= %d]\n",
+			argv[0], BENCH_IMAGE_VALUES);
+		return EXIT_FAILURE;
+	}
+
+	printf("%ld float32 values per word order\n",
+	       rounds * BENCH_IMAGE_VALUES);
+	printf("%-6s %14s %14s %8s\n", "order", "libmodbus ns",
+	       "regs_decode ns", "speedup");
+	for (k = 0; k < (int)(sizeof(orders) / sizeof(orders[0])); k++) {
+		double mb, rd;
+
+		fill_image(orders[k].order);
+		mb = bench_libmodbus(orders[k].get, rounds);
+		rd = bench_regs_decode(orders[k].order, rounds);
+		if (memcmp(out, ref, sizeof(out)))
+			fprintf(stderr, "[BENCH] %s: regs_decode() and "
+				"libmodbus disagree\n", orders[k].name);
+		printf("%-6s %14.2f %14.2f %7.1fx\n", orders[k].name, mb, rd,
+		       rd > 0 ? mb / rd : 0);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ * bench_telemetry.c - telemetry encoding benchmark, the "bench_telemetry"
+ * target.
+ *
+ *  - one device with 32 holding registers, half of them scaled, is
+ *    published over and over through telemetry_publish() in each
+ *    data_mode with its own encoding (JSON, CBOR, MessagePack), one
+ *    register changing per message so the values are not all the same
+ *  - mqtt_publish_buf() is replaced by a stub that keeps the payload
+ *    size and releases the message, so the numbers cover decoding,
+ *    encoding and the pool buffer, not MQTT
+ *  - the reference is the per-cycle cJSON object tree the telemetry
+ *    message was built with before it was streamed, printed with
+ *    cJSON_PrintUnformatted() and copied into a pool buffer; both
+ *    payloads have to be the same byte for byte
+ *
+ * usage: bench_telemetry [messages per encoding]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "readplan.h"
+#include "telemetry.h"
+#include "mqtt.h"
+#include "msgpool.h"
+#include "dtoa.h"
+#include "cJSON.h"
+
+#define BENCH_PARAMS		32
+#define BENCH_DEFAULT_MSGS	200000
+
+/* the encodings telemetry.c streams, by data_mode */
+static const struct {
+	const char *name;
+	const char *mode;
+} encodings[] = {
+	{ "json", "processed" },
+	{ "cbor", "cbor" },
+	{ "msgpack", "msgpack" },
+};
+
+static struct config cfg;
+static size_t last_len;
+static char last_payload[MSG_BUF_SIZE];
+
+/* the stub the telemetry messages end up in */
+int mqtt_publish_buf(struct msg_buf *m, int prio)
+{
+	(void)prio;
+	last_len = m->len;
+	if (m->len < sizeof(last_payload))
+		memcpy(last_payload, m->data, m->len);
+	msg_put(m);
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * tree_publish - the reference: build the message as a cJSON tree, print
+ * it and copy it into a pool buffer
+ */
+static void tree_publish(const struct io_device *dev,
+			 const struct read_plan *plan)
+{
+	cJSON *root, *data_arr;
+	struct msg_buf *m;
+	char *s;
+
+	root = cJSON_CreateObject();
+	if (!root)
+		return;
+
+	cJSON_AddStringToObject(root, "edge_id", cfg.forge_edge_id);
+	cJSON_AddStringToObject(root, "io_device_id", dev->io_device_id);
+	cJSON_AddNumberToObject(root, "timestamp", (double)time(NULL));
+	data_arr = cJSON_CreateArray();
+	cJSON_AddItemToObject(root, "data", data_arr);
+
+	for (int i = 0; i < dev->parameter_count; i++) {
+		const struct parameter *p = &dev->parameters[i];
+		cJSON *entry = cJSON_CreateObject();
+
+		cJSON_AddStringToObject(entry, "name", p->name);
+		cJSON_AddStringToObject(entry, "type", p->type);
+		cJSON_AddNumberToObject(entry, "value",
+					plan->regs[plan->slots[i].offset] *
+					p->scale + p->offset);
+		cJSON_AddItemToArray(data_arr, entry);
+	}
+
+	s = cJSON_PrintUnformatted(root);
+	cJSON_Delete(root);
+	if (!s)
+		return;
+	m = msg_alloc(strlen(s) + 1);
+	if (m) {
+		m->len = strlen(s);
+		memcpy(m->data, s, m->len + 1);
+		mqtt_publish_buf(m, Q_PRIO_TELEMETRY);
+	}
+	free(s);
+}
+
+/* bench - ns per message in data_mode, or through the tree with NULL */
+static double bench(const char *mode, struct io_device *dev,
+		    struct read_plan *plan, long msgs)
+{
+	uint64_t t0;
+	long i;
+
+	if (mode) {
+		snprintf(cfg.data_mode, sizeof(cfg.data_mode), "%s", mode);
+		if (telemetry_init(&cfg)) {
+			fprintf(stderr, "[BENCH] failed to prepare telemetry\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < msgs; i++) {
+		plan->regs[i % plan->reg_count]++;
+		if (mode)
+			telemetry_publish(&cfg, dev, plan);
+		else
+			tree_publish(dev, plan);
+	}
+	return (double)(now_ns() - t0) / msgs;
+}
+
+int main(int argc, char **argv)
+{
+	long msgs = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_MSGS;
+	struct io_device *dev = &cfg.io_devices[0];
+	struct plan_cache pc;
+	struct read_plan *plan;
+	char ref[MSG_BUF_SIZE];
+	size_t ref_len;
+	double ns;
+	int i;
+
+	if (msgs < 1) {
+		fprintf(stderr, "usage: %s [messages per encoding]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (msg_pool_init(16)) {
+		fprintf(stderr, "[BENCH] failed create message pool\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(cfg.forge_edge_id, sizeof(cfg.forge_edge_id), "FE-0001");
+	cfg.io_device_count = 1;
+	snprintf(dev->io_device_id, sizeof(dev->io_device_id), "plc-line-1");
+	dev->poll_interval_ms = 1000;
+	dev->parameter_count = BENCH_PARAMS;
+	for (i = 0; i < BENCH_PARAMS; i++) {
+		struct parameter *p = &dev->parameters[i];
+
+		snprintf(p->name, sizeof(p->name), "sensor_%02d", i);
+		snprintf(p->type, sizeof(p->type), "holding");
+		p->address = i;
+		p->count = 1;
+		p->scale = i % 2 ? 0.1 : 1.0;
+		p->decimals = DTOA_CJSON;
+	}
+
+	memset(&pc, 0, sizeof(pc));
+	plan = plan_cache_get(&pc, dev, read_plan_all_mask(dev));
+	if (!plan) {
+		fprintf(stderr, "[BENCH] failed to build the read plan\n");
+		return EXIT_FAILURE;
+	}
+	/* as if every block was just read */
+	srand(1);
+	for (i = 0; i < plan->reg_count; i++)
+		plan->regs[i] = (uint16_t)rand();
+	for (i = 0; i < plan->block_count; i++)
+		plan->blocks[i].status = 0;
+
+	/* the streamed JSON has to say what the tree printed */
+	snprintf(cfg.data_mode, sizeof(cfg.data_mode), "%s",
+		 encodings[0].mode);
+	telemetry_init(&cfg);
+	tree_publish(dev, plan);
+	ref_len = last_len;
+	memcpy(ref, last_payload, ref_len);
+	telemetry_publish(&cfg, dev, plan);
+	if (ref_len != last_len || memcmp(ref, last_payload, ref_len))
+		fprintf(stderr, "[BENCH] streamed JSON differs from cJSON\n");
+
+	printf("%ld messages per encoding, %d parameters\n", msgs, BENCH_PARAMS);
+	printf("%-12s %8s %10s %12s\n", "encoding", "bytes", "ns/msg", "msg/s");
+
+	ns = bench(NULL, dev, plan, msgs);
+	printf("%-12s %8zu %10.0f %12.0f\n", "cJSON tree", last_len, ns, 1e9 / ns);
+	for (i = 0; i < (int)(sizeof(encodings) / sizeof(encodings[0])); i++) {
+		ns = bench(encodings[i].mode, dev, plan, msgs);
+		printf("%-12s %8zu %10.0f %12.0f\n", encodings[i].name,
+		       last_len, ns, 1e9 / ns);
+	}
+
+	telemetry_cleanup();
+	plan_cache_free(&pc);
+	msg_pool_destroy();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+#ifndef BINW_H
+#define BINW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgpool.h"
+
+/*
+ * Append-only CBOR (RFC 8949) or MessagePack writer over a caller supplied
+ * buffer, chosen by fmt. Like struct jw, len keeps counting past cap and
+ * nothing is written beyond it. Containers are definite length, so the
+ * caller states the element count up front.
+ */
+struct bw {
+	uint8_t *buf;
+	size_t cap;
+	size_t len;
+	int fmt;		/* MSG_FMT_CBOR or MSG_FMT_MSGPACK */
+};
+
+void bw_init(struct bw *w, void *buf, size_t cap, int fmt);
+void bw_raw(struct bw *w, const void *p, size_t n);
+void bw_map(struct bw *w, uint32_t n);
+void bw_array(struct bw *w, uint32_t n);
+void bw_str(struct bw *w, const char *s);
+void bw_uint(struct bw *w, uint64_t v);
+void bw_int(struct bw *w, int64_t v);
+void bw_number(struct bw *w, double d);
+void bw_null(struct bw *w);
+uint8_t *bw_bin(struct bw *w, size_t n);
+
+#endif /* BINW_H */
@@ -0,0 +1,29 @@
+#ifndef BITPACK_H
+#define BITPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bit strings are kept the way Modbus puts them on the wire: bit i is
+ * bit i % 8 of byte i / 8, unused high bits of the last byte are zero.
+ */
+#define BITS_BYTES(n)		(((size_t)(n) + 7) / 8)
+#define BITS_TEST(p, i)		(((p)[(i) >> 3] >> ((i) & 7)) & 1)
+
+enum bit_fmt {
+	BIT_FMT_HEX,		/* two lower case hex digits per byte */
+	BIT_FMT_BASE64,		/* RFC 4648, padded */
+	BIT_FMT_ARRAY,		/* one 0/1 number per bit */
+};
+
+int bit_fmt_from_str(const char *s);
+size_t bits_text_len(int fmt, int count);
+
+void bits_extract(uint8_t *dst, const uint8_t *src, int off, int count);
+void bits_put(uint8_t *p, int off, unsigned int v, int n);
+int bits_differ(const uint8_t *packed, const uint8_t *src, int off,
+		int count);
+void bits_text(char *dst, int fmt, const uint8_t *src, int off, int count);
+
+#endif /* BITPACK_H */
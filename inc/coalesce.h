@@ -0,0 +1,38 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgpool.h"
+
+#define COALESCE_MAX_OPEN	8	/* topic prefixes batched at once */
+
+struct co_batch {
+	char key[MSG_TOPIC_LEN];	/* topic prefix, batch goes to key/batch */
+	size_t key_len;
+	struct msg_buf *out;
+	int entries;
+	uint64_t deadline_ns;
+};
+
+/*
+ * Packs JSON messages sharing a topic prefix into one
+ * {"batch":[{"topic":...,"msg":...},...]} payload, sent when it reaches
+ * max_bytes or delay_ns after its first message, whichever comes first.
+ */
+struct coalescer {
+	size_t max_bytes;
+	uint64_t delay_ns;
+	int levels;		/* topic levels forming the prefix */
+	void (*emit)(struct msg_buf *m);
+	struct co_batch open[COALESCE_MAX_OPEN];
+};
+
+void coalesce_init(struct coalescer *c, size_t max_bytes, int delay_ms,
+		   int levels, void (*emit)(struct msg_buf *m));
+int coalesce_add(struct coalescer *c, const struct msg_buf *m, uint64_t now);
+void coalesce_flush(struct coalescer *c, uint64_t now, int all);
+uint64_t coalesce_next_deadline(const struct coalescer *c);
+
+#endif /* COALESCE_H */
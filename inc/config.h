@@ -4,27 +4,83 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#ifndef MAX_IO_DEVICES
 #define MAX_IO_DEVICES	5u
+#endif
 #define MAX_PARAMETERS	32u
 #define MAX_STR_LEN	128u
+#define MAX_OUTSTANDING	16u
+#define MAX_BIT_NAMES_LEN	512u
 
 #define DEFAULT_CONFIG_PATH	"/etc/forgeedge/config.json"
 #define SERIAL_FILE_PATH	"/etc/forgeedge/serial.txt"
 
+#define DEFAULT_STATS_INTERVAL_MS	60000
+
+#define DEFAULT_SPOOL_DIR		"/var/lib/forgeedge/spool"
+#define DEFAULT_SPOOL_MAX_MB		1024
+#define DEFAULT_SPOOL_DRAIN_RATE	500	/* backlog records per second */
+#define DEFAULT_COALESCE_DELAY_MS	50
+#define DEFAULT_COALESCE_LEVELS		2	/* forgeedge/<edge> */
+#define DEFAULT_SPARKPLUG_GROUP		"forgeedge"
+#define DEFAULT_FULL_REFRESH_S		300
+#define DEFAULT_RESPONSE_TIMEOUT_MIN_MS	50
+#define DEFAULT_RESPONSE_TIMEOUT_MAX_MS	2000
+#define DEFAULT_BREAKER_FAILURES	3
+#define DEFAULT_QUARANTINE_MAX_MS	60000
+#define DEFAULT_SERIAL_BAUD		19200
+#define DEFAULT_SERIAL_PARITY		'E'	/* Modbus over serial line default */
+
 struct parameter {
 	char name[MAX_STR_LEN];
-	char type[16];		/* \"coil\", \"holding\", \"input\" */
+	char type[16];		/* \"coil\", \"holding\", \"input\", \"input_bits\",
+				   \"bits\" */
 	int address;
+	int bit;		/* \"bits\": first bit of the register, 0-15 */
 	int count;
+	char data_type[12];	/* \"uint16\" (\"\"), \"int16\", \"uint32\", \"int32\",
+				   \"float32\", \"uint64\", \"int64\", \"float64\" */
+	char word_order[8];	/* \"ABCD\" (\"\"), \"CDAB\", \"BADC\", \"DCBA\" */
 	double scale;
+	double offset;		/* added after scaling */
+	int decimals;		/* rounding of scaled values, DTOA_CJSON or
+				   DTOA_SHORTEST when unrounded */
+	double deadband;	/* report by exception: absolute, scaled units */
+	double deadband_pct;	/* ... or percent of the last reported value */
+	int poll_interval_ms;	/* 0 = device poll_interval_ms */
+	char bit_names[MAX_BIT_NAMES_LEN];	/* bit strings: comma separated,
+						   bit 0 first, \"\" = unnamed */
+};
+
+/* Modbus RTU line settings, see modbus_new_rtu() */
+struct serial_line {
+	char port[MAX_STR_LEN];	/* e.g. /dev/ttyS1, "" = Modbus TCP */
+	int baud;
+	char parity;		/* 'N', 'E' or 'O' */
+	int data_bits;
+	int stop_bits;
 };
 
 struct io_device {
 	char io_device_id[MAX_STR_LEN];
 	char ip[MAX_STR_LEN];
 	int port;
-	int unit_id;
+	struct serial_line serial;	/* devices on one port share the bus */
+	int unit_id;		/* 1-247, 0 = none (0xff); devices sharing ip:port
+				   share one connection */
 	int poll_interval_ms;
+	int max_gap;		/* unused addresses a merged read may span */
+	int max_outstanding;	/* pipelined requests in flight, 1 = strict */
+	char overrun_policy[16];	/* \"skip\", \"catchup\" or \"coalesce\" */
+	bool report_by_exception;	/* publish changed parameters only */
+	int full_refresh_s;	/* publish everything this often, 0 = never */
+	int reconnect_max_ms;	/* longest reconnect backoff, 0 = poll interval */
+	int request_gap_ms;	/* idle time the connection needs between a
+				   response and the next request */
+	int response_timeout_min_ms;	/* bounds of the adaptive response */
+	int response_timeout_max_ms;	/* timeout, see struct rtt_est */
+	int breaker_failures;	/* unanswered cycles before quarantine, 0 = never */
+	int quarantine_max_ms;	/* longest wait between quarantine probes */
 	int parameter_count;
 	struct parameter parameters[MAX_PARAMETERS];
 };
@@ -44,12 +100,25 @@ struct mqtt_config {
 	char client_id[MAX_STR_LEN];
 	char username[MAX_STR_LEN];
 	char password[MAX_STR_LEN];
+	char queue_overflow[16];	/* \"block\", \"drop_oldest\", \"drop_newest\", \"conflate\" */
+	char spool_dir[MAX_STR_LEN];	/* store-and-forward log, \"\" = off */
+	int spool_max_mb;
+	int spool_drain_rate;
+	int coalesce_bytes;	/* batch payload limit, 0 = no batching */
+	int coalesce_delay_ms;
+	int coalesce_levels;
+	int protocol_version;	/* 4 = 3.1.1, 5 = MQTT 5, 0 = 5 for cbor/msgpack */
+	char sparkplug_group[MAX_STR_LEN];	/* Sparkplug B group_id */
 	struct tls_config tls;
 };
 
 struct config {
 	char forge_edge_id[MAX_STR_LEN];
-	char data_mode[16];	/* \"processed\" or \"raw\" */
+	char data_mode[16];	/* \"processed\", \"raw\", \"cbor\", \"msgpack\", \"sparkplug\" */
+	char bit_format[16];	/* bit strings in JSON: \"hex\", \"base64\", \"array\" */
+	char engine[16];	/* \"threads\" (default) or \"epoll\" */
+	int engine_threads;	/* epoll loops when engine is \"epoll\" */
+	int stats_interval_ms;	/* per-device stats publish period, 0 = off */
 	struct mqtt_config mqtt;
 	int io_device_count;
 	struct io_device io_devices[MAX_IO_DEVICES];
@@ -0,0 +1,128 @@
+#ifndef CONNMGR_H
+#define CONNMGR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <modbus.h>
+#include "config.h"
+
+#define CONN_CONNECT_TIMEOUT_MS	3000
+#define CONN_BACKOFF_MIN_MS	250
+#define CONN_SILENT_CYCLES	3	/* unanswered cycles before reconnecting */
+#define CONN_KEEPALIVE_IDLE_S	10
+#define CONN_KEEPALIVE_INTVL_S	5
+#define CONN_KEEPALIVE_CNT	3
+#define CONN_RTO_INITIAL_MS	500	/* libmodbus' default, until measured */
+#define CONN_RTO_GRANULARITY_NS	1000000ull
+#define CONN_RTU_FAST_SILENCE_NS	1750000ull	/* t3.5 above 19200 baud */
+
+/*
+ * Reconnect pacing: after the n-th failure in a row the next attempt
+ * waits a random time between half and all of
+ * min(CONN_BACKOFF_MIN_MS << n, max_ns). A connect alone does not end a
+ * streak, only an answered poll cycle does, so a device that accepts and
+ * then drops connections backs off as well.
+ */
+struct conn_backoff {
+	unsigned int failures;	/* in a row */
+	uint64_t retry_ns;	/* no attempt before this */
+	uint64_t max_ns;
+	uint32_t seed;
+	uint64_t total;		/* failed connects and lost links, ever */
+};
+
+void backoff_init(struct conn_backoff *b, const struct io_device *dev,
+		  uint32_t seed);
+void backoff_init_ms(struct conn_backoff *b, int max_ms, uint32_t seed);
+uint64_t backoff_failed(struct conn_backoff *b, uint64_t now);
+void backoff_reset(struct conn_backoff *b);
+
+int conn_gateways(const struct config *cfg, int *gw);
+void conn_pacing(const struct io_device *d, int *window, uint64_t *gap_ns);
+int conn_unit(const struct io_device *dev);
+uint64_t conn_char_ns(const struct io_device *dev);
+uint64_t conn_silence_ns(const struct io_device *dev);
+/*
+ * Response timeout of a device, TCP RTO style (RFC 6298): smoothed round
+ * trip time plus four times its mean deviation, kept within the device's
+ * response_timeout_min_ms and _max_ms. A timeout doubles it, but with
+ * samples to go by never past twice what they call for, so a device that
+ * died costs a bounded wait per request instead of climbing to the
+ * ceiling.
+ */
+struct rtt_est {
+	uint64_t srtt_ns;
+	uint64_t rttvar_ns;
+	uint64_t rto_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t samples;
+	uint64_t timeouts;
+};
+
+void rtt_init(struct rtt_est *r, const struct io_device *dev);
+void rtt_sample(struct rtt_est *r, uint64_t ns);
+void rtt_timeout(struct rtt_est *r);
+
+/*
+ * Circuit breaker of a device: after breaker_failures cycles in a row
+ * without a single answer the device is quarantined. Its slots no longer
+ * send the read plan but one single register probe, spaced by a
+ * conn_backoff that grows to quarantine_max_ms; the first probe answered
+ * restores full polling. Connection loss does not count, connmgr's
+ * reconnect handles that.
+ */
+enum brk_state {
+	BRK_CLOSED,		/* polled normally */
+	BRK_OPEN,		/* quarantined */
+};
+
+enum brk_action {
+	BRK_SKIP,
+	BRK_POLL,
+	BRK_PROBE,
+};
+
+struct breaker {
+	int state;
+	unsigned int threshold;	/* 0 = never quarantine */
+	unsigned int failures;	/* unanswered cycles in a row */
+	uint64_t since_ns;	/* of the last state change */
+	uint64_t trips;
+	struct conn_backoff backoff;	/* between probes */
+};
+
+void breaker_init(struct breaker *b, const struct io_device *dev,
+		  uint32_t seed);
+int breaker_action(const struct breaker *b, uint64_t now);
+int breaker_done(struct breaker *b, int answered, uint64_t now);
+const char *breaker_state_str(int state);
+
+int conn_resolve(const struct io_device *dev, struct sockaddr_storage *addr,
+		 socklen_t *len);
+void conn_tune(int fd);
+int conn_link_error(int err);
+
+/*
+ * the libmodbus connection of a thread engine device: TCP, or the RTU
+ * serial line of a bus
+ */
+struct mb_conn {
+	const struct io_device *dev;
+	char name[MAX_STR_LEN + 8];	/* ip:port or serial port, for logs */
+	modbus_t *ctx;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;	/* 0 until resolved */
+	int up;
+	int silent;		/* cycles in a row without an answer */
+	struct conn_backoff backoff;
+};
+
+int conn_init(struct mb_conn *c, const struct io_device *dev, uint32_t seed);
+modbus_t *conn_get(struct mb_conn *c, uint64_t now);
+void conn_cycle_done(struct mb_conn *c, int answered, int link_err,
+		     uint64_t now);
+void conn_free(struct mb_conn *c);
+
+#endif /* CONNMGR_H */
@@ -2,13 +2,57 @@
 #define DATA_Q_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-int data_queue_init(size_t capacity);
+#include "msgpool.h"
+
+/* what enqueue does when the queue is full */
+enum q_overflow {
+	Q_OVERFLOW_BLOCK = 0,	/* wait for the mqtt thread to make room */
+	Q_OVERFLOW_DROP_OLDEST,	/* evict the oldest pending message */
+	Q_OVERFLOW_DROP_NEWEST,	/* discard the message being queued */
+	Q_OVERFLOW_CONFLATE,	/* keep only the newest message per topic */
+};
+
+/* publish lanes, served in this order */
+enum q_prio {
+	Q_PRIO_CONTROL = 0,	/* alarms, command acknowledgements */
+	Q_PRIO_TELEMETRY,	/* live samples */
+	Q_PRIO_BULK,		/* stats, backfill */
+	Q_PRIO_COUNT
+};
+
+/* pops from higher lanes a non-empty lower lane waits out at most */
+#define Q_STARVE_LIMIT	16
+
+struct queue_stats {
+	uint64_t enqueued;
+	uint64_t dropped_oldest;
+	uint64_t dropped_newest;
+	uint64_t conflated;	/* pending messages replaced by a newer one */
+	uint64_t starved;	/* lower-lane pops forced by the guard */
+};
+
+int q_overflow_from_str(const char *s);
+const char *q_overflow_str(int policy);
+
+int data_queue_init(size_t capacity, int policy);
 void data_queue_destroy(void);
 
-int data_queue_enqueue(const char *topic, const char *payload);
+int data_queue_enqueue(const char *topic, const char *payload, int prio);
 int data_queue_dequeue(char **topic, char **payload);
 void data_queue_stop(void);
 
-#endif /* DATA_QUEUE_H */
+/* zero-copy variants: the queue takes over / hands over one reference */
+int data_queue_enqueue_msg(struct msg_buf *m, int prio);
+int data_queue_dequeue_msg(struct msg_buf **m);
+int data_queue_dequeue_msg_timed(struct msg_buf **m, int timeout_ms);
+int data_queue_dequeue_batch(struct msg_buf **v, size_t n, int timeout_ms);
+
+size_t data_queue_depth(int prio);
+size_t data_queue_capacity(void);
 
+int data_queue_policy(void);
+void data_queue_get_stats(struct queue_stats *st);
+
+#endif /* DATA_QUEUE_H */
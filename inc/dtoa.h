@@ -0,0 +1,17 @@
+#ifndef DTOA_H
+#define DTOA_H
+
+#define DTOA_BUF_LEN		32	/* enough for any finite double */
+#define DTOA_MAX_DECIMALS	9
+
+/* decimals below 0: how values without rounding print */
+#define DTOA_CJSON		-1	/* as cJSON_PrintUnformatted() does */
+#define DTOA_SHORTEST		-2	/* shortest text that reads back exact */
+
+int dtoa_shortest(double d, char *buf);
+int dtoa_cjson(double d, char *buf);
+int dtoa_shortest_float(float f, char *buf);
+int dtoa_fixed(double d, int decimals, char *buf);
+double dtoa_round(double d, int decimals);
+
+#endif /* DTOA_H */
@@ -0,0 +1,9 @@
+#ifndef EVPOLL_H
+#define EVPOLL_H
+
+#include "config.h"
+
+int ev_engine_start(const struct config *cfg);
+void ev_engine_stop(void);
+
+#endif /* EVPOLL_H */
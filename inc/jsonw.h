@@ -0,0 +1,31 @@
+#ifndef JSONW_H
+#define JSONW_H
+
+#include <stddef.h>
+
+/*
+ * Append-only JSON writer over a caller supplied buffer. len keeps
+ * counting past cap, so a too small buffer tells the caller how much it
+ * needs; nothing is written beyond cap.
+ */
+struct jw {
+	char *buf;
+	size_t cap;
+	size_t len;
+};
+
+void jw_init(struct jw *w, char *buf, size_t cap);
+void jw_raw(struct jw *w, const char *s, size_t n);
+void jw_char(struct jw *w, char c);
+void jw_str(struct jw *w, const char *s);
+void jw_int(struct jw *w, int v);
+void jw_number(struct jw *w, double d);
+void jw_fixed(struct jw *w, double d, int decimals);
+void jw_float(struct jw *w, float f);
+char *jw_room(struct jw *w, size_t n);
+int jw_finish(struct jw *w);
+
+/* jw_lit - append a string literal */
+#define jw_lit(w, s)	jw_raw((w), (s), sizeof(s) - 1)
+
+#endif /* JSONW_H */
@@ -0,0 +1,30 @@
+#ifndef MBPROTO_H
+#define MBPROTO_H
+
+#include <stdint.h>
+
+#include "readplan.h"
+
+/* function code + address + quantity */
+#define MB_READ_REQ_PDU_LEN	5
+
+/* MBAP header: transaction id, protocol id, length, unit id */
+#define MB_MBAP_LEN		7
+
+#define MB_TCP_READ_REQ_LEN	(MB_MBAP_LEN + MB_READ_REQ_PDU_LEN)
+
+/* RTU: slave address + PDU + CRC */
+#define MB_RTU_CRC_LEN		2
+#define MB_RTU_READ_REQ_LEN	(1 + MB_READ_REQ_PDU_LEN + MB_RTU_CRC_LEN)
+
+int mb_read_fc(int type);
+int mb_build_read_pdu(uint8_t *pdu, const struct read_block *b);
+int mb_parse_read_pdu(const uint8_t *pdu, int len, const struct read_block *b,
+		      struct read_plan *plan);
+
+int mb_build_tcp_read_adu(uint8_t *adu, uint16_t tid, uint8_t unit,
+			  const struct read_block *b);
+int mb_tcp_frame_len(const uint8_t *buf, int len);
+int mb_rtu_read_chars(const struct read_block *b);
+
+#endif /* MBPROTO_H */
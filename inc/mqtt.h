@@ -2,10 +2,13 @@
 #define MQTT_H
 
 #include "config.h"
+#include "msgpool.h"
+#include "dataq.h"
 
 int mqtt_start(const struct config *cfg);
 void mqtt_stop(void);
-int mqtt_publish(const char *topic, const char *payload);
+int mqtt_publish(const char *topic, const char *payload, int prio);
+int mqtt_publish_buf(struct msg_buf *m, int prio);
 
 #endif /* MQTT_H */
 
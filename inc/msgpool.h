@@ -0,0 +1,47 @@
+#ifndef MSGPOOL_H
+#define MSGPOOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define MSG_TOPIC_LEN	256
+#define MSG_BUF_SIZE	2048	/* payload bytes of a pooled buffer */
+
+/* payload encoding, carried to the broker as an MQTT v5 content type */
+enum msg_fmt {
+	MSG_FMT_JSON,
+	MSG_FMT_CBOR,
+	MSG_FMT_MSGPACK,
+	MSG_FMT_SPARKPLUG,	/* Sparkplug B protobuf, see sparkplug.c */
+	MSG_FMT_COUNT
+};
+
+/*
+ * Refcounted publish message. Serializers write the payload straight into
+ * data; the buffer then moves through the data queue without copies and
+ * returns to the pool when the last reference is dropped.
+ */
+struct msg_buf {
+	atomic_int refs;
+	int slot;		/* pool index + 1, 0 = heap allocated */
+	int prio;		/* publish lane, set when queued */
+	int fmt;		/* enum msg_fmt */
+	unsigned int session;	/* Sparkplug session it was encoded for */
+	size_t cap;		/* bytes available in data */
+	size_t len;		/* payload length, excluding the NUL */
+	char topic[MSG_TOPIC_LEN];
+	char data[];
+};
+
+int msg_pool_init(size_t count);
+void msg_pool_destroy(void);
+
+struct msg_buf *msg_alloc(size_t size);
+struct msg_buf *msg_from_strings(const char *topic, const char *payload);
+void msg_get(struct msg_buf *m);
+void msg_put(struct msg_buf *m);
+
+int msg_fmt_from_mode(const char *data_mode);
+const char *msg_fmt_content_type(int fmt);
+
+#endif /* MSGPOOL_H */
@@ -0,0 +1,70 @@
+#ifndef POLLSCHED_H
+#define POLLSCHED_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "twheel.h"
+
+/* how far catch-up may fall behind before it realigns like skip */
+#define SCHED_MAX_CATCHUP	16
+
+/* finest tick a multi-rate device is woken at */
+#define WHEEL_MIN_TICK_MS	10
+
+enum overrun_policy {
+	OVERRUN_SKIP = 0,	/* drop missed slots, wait for the next one */
+	OVERRUN_CATCHUP,	/* run every missed slot back to back */
+	OVERRUN_COALESCE,	/* run once now for all missed slots */
+};
+
+struct sched_stats {
+	uint64_t cycles;
+	uint64_t overruns;
+	uint64_t skipped;
+	int64_t lateness_ns;		/* start lateness of the last cycle */
+	int64_t max_lateness_ns;	/* worst since the last reset */
+};
+
+/*
+ * Absolute-deadline poll schedule on CLOCK_MONOTONIC. next_ns is the slot
+ * on the period grid the next cycle stands for, due_ns is when it should
+ * actually start (earlier than "now" while catching up).
+ */
+struct poll_sched {
+	uint64_t period_ns;
+	uint64_t slot;		/* grid index of next_ns */
+	uint64_t next_ns;
+	uint64_t due_ns;
+	int policy;
+	struct sched_stats stats;
+};
+
+/*
+ * Per-parameter poll rates. The device is scheduled at tick_ms, the GCD
+ * of its parameter intervals, and the wheel reports which parameters are
+ * due in each slot.
+ */
+struct param_wheel {
+	struct twheel wheel;
+	struct tw_timer timers[MAX_PARAMETERS];
+	uint64_t interval[MAX_PARAMETERS];	/* in ticks */
+	int count;
+	int tick_ms;
+};
+
+int sched_policy_from_str(const char *policy);
+const char *sched_policy_str(int policy);
+
+uint64_t sched_now_ns(void);
+void sched_sleep_until(uint64_t ns);
+
+void sched_init(struct poll_sched *s, int period_ms, int policy,
+		uint64_t start_ns);
+void sched_begin(struct poll_sched *s, uint64_t now);
+uint64_t sched_next(struct poll_sched *s, uint64_t now);
+
+int param_wheel_init(struct param_wheel *pw, const struct io_device *dev);
+uint32_t param_wheel_due(struct param_wheel *pw, uint64_t slot);
+
+#endif /* POLLSCHED_H */
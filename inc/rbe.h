@@ -0,0 +1,32 @@
+#ifndef RBE_H
+#define RBE_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "readplan.h"
+
+struct rbe_param {
+	int valid;		/* 1 vals reported, 0 null reported, -1 neither */
+	uint16_t *vals;		/* last reported registers, param_span() of them;
+				   bit strings packed (bitpack.h) */
+};
+
+/*
+ * Report by exception: the values a device last reported, so a poll cycle
+ * only reports parameters that moved past their deadband, plus all of
+ * them every refresh_ns.
+ */
+struct rbe_shadow {
+	uint16_t *vals;
+	struct rbe_param params[MAX_PARAMETERS];
+	uint64_t refresh_ns;	/* 0 = no forced refresh */
+	uint64_t next_full_ns;	/* 0 = nothing reported yet */
+};
+
+int rbe_init(struct rbe_shadow *s, const struct io_device *dev);
+void rbe_free(struct rbe_shadow *s);
+uint32_t rbe_update(struct rbe_shadow *s, const struct io_device *dev,
+		    const struct read_plan *plan, uint64_t now);
+
+#endif /* RBE_H */
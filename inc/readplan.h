@@ -0,0 +1,125 @@
+#ifndef READPLAN_H
+#define READPLAN_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define DEFAULT_MAX_GAP		0
+/*
+ * An RTU request costs about 20 characters besides its data (8 byte
+ * request, 5 byte response frame, 3.5 characters of silence after each),
+ * the time of 10 registers: reading across a gap that wide is no slower
+ * than a second request.
+ */
+#define DEFAULT_RTU_MAX_GAP	10
+#define PLAN_CACHE_SIZE		8
+
+/* parameter sets are passed around as one bit per parameter */
+#if MAX_PARAMETERS > 32
+#error "read plan parameter masks are 32 bits wide"
+#endif
+
+/* per-request limits from the Modbus application protocol spec */
+#define PLAN_MAX_READ_REGS	125
+#define PLAN_MAX_READ_BITS	2000
+
+enum reg_type {
+	REG_UNKNOWN = -1,
+	REG_COIL = 0,
+	REG_HOLDING,
+	REG_INPUT,
+	REG_DISCRETE,		/* discrete inputs, FC02 */
+	REG_BITFIELD,		/* bits of holding registers, read as REG_HOLDING */
+	REG_TYPE_COUNT
+};
+
+/*
+ * coils, discrete inputs and bitfields share the packed bit image; a
+ * bitfield is copied there from the register image after the read
+ */
+#define REG_IS_BIT(type)	((type) == REG_COIL || (type) == REG_DISCRETE || \
+				 (type) == REG_BITFIELD)
+
+/*
+ * One legal Modbus read request. offset is where the block lands in the
+ * plan's bit image (coils, discrete inputs) or register image
+ * (holding/input). Bit blocks start on a byte boundary of the image, so
+ * the packed bytes of a response are copied in as they are.
+ */
+struct read_block {
+	int type;
+	int address;
+	int count;
+	int offset;
+	int status;	/* result of the last read, 0 on success */
+};
+
+/*
+ * Where a parameter lives inside the shared images. A parameter larger
+ * than one PDU spans nblocks consecutive blocks whose image ranges are
+ * contiguous, so it can always be decoded from image + offset. Register
+ * parameters also carry how to decode them (regdecode.h).
+ */
+struct param_slot {
+	int type;
+	int dtype;
+	int order;
+	int offset;
+	int first_block;
+	int nblocks;
+};
+
+/*
+ * The part of a bitfield parameter held by one register: (reg & mask) >>
+ * shift goes to bit dst of the bit image. Built with the plan so that
+ * read_plan_extract() is only loads, masks and stores.
+ */
+struct bit_field {
+	int reg;
+	uint16_t mask;
+	uint8_t shift;
+	uint8_t width;
+	int dst;
+};
+
+struct read_plan {
+	uint32_t mask;		/* parameters this plan reads */
+	int block_count;
+	struct read_block *blocks;
+	struct param_slot slots[MAX_PARAMETERS];
+	int reg_count;
+	int bit_count;
+	uint16_t *regs;
+	uint8_t *bits;		/* packed, see bitpack.h */
+	int field_count;
+	struct bit_field *fields;
+};
+
+int reg_type_from_str(const char *type);
+int param_span(const struct parameter *p);
+
+/*
+ * Plans for the parameter subsets a multi-rate device actually polls,
+ * built on first use and reused, replacing the oldest when full.
+ */
+struct plan_cache {
+	int count;
+	int next_victim;
+	struct read_plan plans[PLAN_CACHE_SIZE];
+};
+
+int read_plan_build(struct read_plan *plan, const struct io_device *dev,
+		    uint32_t mask);
+int read_plan_probe(struct read_plan *plan, const struct io_device *dev);
+void read_plan_free(struct read_plan *plan);
+void read_plan_extract(struct read_plan *plan);
+int read_plan_param_ok(const struct read_plan *plan, int idx);
+int read_plan_answered(const struct read_plan *plan);
+uint32_t read_plan_all_mask(const struct io_device *dev);
+
+struct read_plan *plan_cache_get(struct plan_cache *c,
+				 const struct io_device *dev, uint32_t mask);
+void plan_cache_free(struct plan_cache *c);
+
+#endif /* READPLAN_H */
@@ -0,0 +1,48 @@
+#ifndef REGDECODE_H
+#define REGDECODE_H
+
+#include <stdint.h>
+
+/* what a parameter's registers hold, one value per data_type_words() */
+enum data_type {
+	DTYPE_UNKNOWN = -1,
+	DTYPE_UINT16 = 0,
+	DTYPE_INT16,
+	DTYPE_UINT32,
+	DTYPE_INT32,
+	DTYPE_FLOAT32,
+	DTYPE_UINT64,
+	DTYPE_INT64,
+	DTYPE_FLOAT64,
+};
+
+/*
+ * Where the bytes of a multi-register value sit, the letters naming them
+ * most significant first: ABCD is big endian registers holding the high
+ * word first, CDAB has the low word first (for 64-bit values: the least
+ * significant register first), BADC swaps the bytes within each register
+ * and DCBA does both.
+ */
+enum word_order {
+	WO_UNKNOWN = -1,
+	WO_ABCD = 0,
+	WO_CDAB = 1,
+	WO_BADC = 2,
+	WO_DCBA = 3,
+};
+
+#define WO_WORD_SWAP	1
+#define WO_BYTE_SWAP	2
+
+/* decode into a stack array of this many values at a time */
+#define REGS_DECODE_BATCH	64
+
+int data_type_from_str(const char *s);
+int word_order_from_str(const char *s);
+int data_type_words(int type);
+
+uint64_t regs_raw(const uint16_t *regs, int type, int order);
+void regs_decode(double *out, const uint16_t *regs, int n, int type,
+		 int order, double scale, double offset);
+
+#endif /* REGDECODE_H */
@@ -0,0 +1,91 @@
+#ifndef SIMCFG_H
+#define SIMCFG_H
+
+#include <stdint.h>
+
+#include <modbus.h>
+
+#define SIM_MAX_GROUPS		64
+#define SIM_MAX_WAVES		32
+#define SIM_MAX_UNITS		247
+#define SIM_MAX_PORTS		4096	/* slaves over all groups */
+#define SIM_DEFAULT_TABLE	1000	/* bits or registers per table */
+#define SIM_DEFAULT_STATS_S	5
+#define SIM_DEFAULT_BAUD	19200
+
+enum sim_table {
+	SIM_COILS = 0,
+	SIM_DISCRETE,
+	SIM_HOLDING,
+	SIM_INPUT,
+	SIM_TABLES
+};
+
+enum sim_wave_type {
+	WAVE_SINE = 0,
+	WAVE_SAWTOOTH,
+	WAVE_SQUARE,
+	WAVE_RANDOM,
+	WAVE_COUNTER,
+};
+
+/*
+ * A register (two for float32, high word first) or bit that follows a
+ * function of time: offset + amplitude * f(t / period). A bit is set
+ * while the value is above offset. Counters step by amplitude every
+ * period.
+ */
+struct sim_wave {
+	int type;
+	int table;
+	int address;
+	int float32;
+	int is_signed;		/* int16: negative values in two's complement */
+	double period_s;
+	double amplitude;
+	double offset;
+};
+
+struct sim_range {
+	int start;
+	int count;
+};
+
+/*
+ * one slave, or count identical ones on consecutive ports; with serial
+ * set, one RTU bus on a pseudo terminal instead
+ */
+struct sim_group {
+	char name[64];
+	int port;
+	int count;
+	char serial[108];	/* link to the bus's pty, "" = Modbus TCP */
+	int baud;
+	char parity;		/* 'N', 'E' or 'O', for the time on the wire */
+	int trace;		/* log every request */
+	int units;		/* 0 = one slave for any unit id, else ids 1..units */
+	struct sim_range tables[SIM_TABLES];
+	int latency_ms;
+	int jitter_ms;		/* replies wait latency_ms +- jitter_ms */
+	double drop_pct;	/* requests never answered */
+	double exception_pct;	/* requests answered with exception_code */
+	int exception_code;
+	int max_connections;	/* 0 = unlimited */
+	int wave_count;
+	struct sim_wave waves[SIM_MAX_WAVES];
+};
+
+struct sim_config {
+	char listen[64];
+	int threads;
+	int stats_interval_s;
+	int group_count;
+	struct sim_group groups[SIM_MAX_GROUPS];
+};
+
+int sim_load_config(const char *path, struct sim_config *cfg);
+void sim_wave_apply(const struct sim_wave *w, modbus_mapping_t *map,
+		    double t, uint32_t *seed);
+uint32_t sim_rand(uint32_t *seed);
+
+#endif /* SIMCFG_H */
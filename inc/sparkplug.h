@@ -0,0 +1,29 @@
+#ifndef SPARKPLUG_H
+#define SPARKPLUG_H
+
+#include <stddef.h>
+
+#include "config.h"
+#include "readplan.h"
+#include "msgpool.h"
+
+#define SPARKPLUG_NAMESPACE	"spBv1.0"
+
+/* producer side, called through telemetry.c */
+int sparkplug_init(const struct config *cfg);
+void sparkplug_cleanup(void);
+void sparkplug_publish(const struct config *cfg, const struct io_device *dev,
+		       const struct read_plan *plan);
+
+/* mqtt thread */
+struct msg_buf *sparkplug_death(const struct config *cfg);
+struct msg_buf *sparkplug_online(const struct config *cfg);
+void sparkplug_offline(void);
+int sparkplug_rebirth_pending(void);
+const void *sparkplug_seal(const struct msg_buf *m, size_t *len);
+void sparkplug_command_topic(const struct config *cfg, char *buf, size_t len);
+
+/* paho callback thread */
+void sparkplug_command(const void *payload, size_t len);
+
+#endif /* SPARKPLUG_H */
@@ -0,0 +1,37 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgpool.h"
+
+#define SPOOL_SEGMENT_SIZE	(16u << 20)	/* bytes per segment file */
+#define SPOOL_SYNC_RECORDS	256	/* cursor fsync after this many sends */
+#define SPOOL_SYNC_MS		1000	/* ... or after this long */
+
+struct spool_stats {
+	uint64_t spooled;	/* records appended */
+	uint64_t drained;	/* records sent from the backlog */
+	uint64_t dropped;	/* records lost to the size limit */
+	uint64_t corrupt;	/* records skipped on a bad CRC */
+	uint64_t pending_bytes;	/* backlog still on disk, roughly */
+};
+
+/*
+ * Store-and-forward log. All calls except spool_get_stats() must come
+ * from one thread (the mqtt thread).
+ */
+int spool_open(const char *dir, uint64_t max_bytes);
+void spool_close(void);
+int spool_enabled(void);
+
+int spool_append(const struct msg_buf *m);
+int spool_pending(void);
+int spool_peek(struct msg_buf **m);
+void spool_advance(void);
+void spool_sync(void);
+
+void spool_get_stats(struct spool_stats *st);
+
+#endif /* SPOOL_H */
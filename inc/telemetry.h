@@ -0,0 +1,30 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "config.h"
+#include "readplan.h"
+#include "pollsched.h"
+#include "connmgr.h"
+
+struct device_stats {
+	struct sched_stats sched;
+	int connected;
+	uint64_t connect_failures;	/* failed connects and lost links */
+	struct rtt_est rtt;
+	struct breaker breaker;
+	int serial;
+	double bus_utilization;	/* share of the time the line was busy */
+};
+
+int telemetry_init(const struct config *cfg);
+void telemetry_cleanup(void);
+void telemetry_publish(const struct config *cfg, const struct io_device *dev,
+		       const struct read_plan *plan);
+void telemetry_publish_stats(const struct config *cfg,
+			     const struct io_device *dev,
+			     const struct device_stats *st);
+void telemetry_publish_state(const struct config *cfg,
+			     const struct io_device *dev,
+			     const struct breaker *b, uint64_t now);
+
+#endif /* TELEMETRY_H */
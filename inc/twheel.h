@@ -0,0 +1,33 @@
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdint.h>
+
+#define TW_BITS		6
+#define TW_SIZE		(1u << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+
+struct tw_timer {
+	uint64_t expires;	/* absolute tick */
+	int id;
+	struct tw_timer *next;
+};
+
+/*
+ * Hierarchical timing wheel: level n has TW_SIZE slots of TW_SIZE^n ticks.
+ * Timers further out than the top level are parked in its last reachable
+ * slot and re-inserted until they are due.
+ */
+struct twheel {
+	uint64_t now;
+	struct tw_timer *slots[TW_LEVELS][TW_SIZE];
+};
+
+typedef void (*tw_expire_fn)(struct tw_timer *t, void *arg);
+
+void tw_init(struct twheel *w, uint64_t now);
+void tw_add(struct twheel *w, struct tw_timer *t);
+void tw_advance(struct twheel *w, uint64_t to, tw_expire_fn fn, void *arg);
+
+#endif /* TWHEEL_H */
@@ -0,0 +1,239 @@
+/*
+ * binw.c - streaming CBOR / MessagePack encoder.
+ *
+ * Covers what telemetry needs: maps, arrays, text and byte strings,
+ * integers, doubles and null. Numbers take the smallest encoding that
+ * holds them exactly: integral values become integers, then float32, then
+ * float64.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "binw.h"
+
+/* CBOR major types */
+#define CBOR_UINT	0
+#define CBOR_NEGINT	1
+#define CBOR_BYTES	2
+#define CBOR_TEXT	3
+#define CBOR_ARRAY	4
+#define CBOR_MAP	5
+#define CBOR_FLOAT32	0xfa
+#define CBOR_FLOAT64	0xfb
+#define CBOR_NULL	0xf6
+
+/* MessagePack type bytes */
+#define MP_NIL		0xc0
+#define MP_BIN8		0xc4
+#define MP_FLOAT32	0xca
+#define MP_FLOAT64	0xcb
+#define MP_UINT8	0xcc
+#define MP_INT8		0xd0
+#define MP_STR8		0xd9
+#define MP_ARRAY16	0xdc
+#define MP_MAP16	0xde
+
+#define EXACT_INT_LIMIT	9223372036854775808.0	/* 2^63 */
+
+void bw_init(struct bw *w, void *buf, size_t cap, int fmt)
+{
+	w->buf = buf;
+	w->cap = cap;
+	w->len = 0;
+	w->fmt = fmt;
+}
+
+void bw_raw(struct bw *w, const void *p, size_t n)
+{
+	if (w->len < w->cap) {
+		size_t room = w->cap - w->len;
+
+		memcpy(w->buf + w->len, p, n < room ? n : room);
+	}
+	w->len += n;
+}
+
+static void put8(struct bw *w, uint8_t b)
+{
+	if (w->len < w->cap)
+		w->buf[w->len] = b;
+	w->len++;
+}
+
+/* put_be - type byte followed by v in size bytes, big endian */
+static void put_be(struct bw *w, uint8_t type, uint64_t v, int size)
+{
+	uint8_t tmp[9];
+	int i;
+
+	tmp[0] = type;
+	for (i = size; i > 0; i--) {
+		tmp[i] = (uint8_t)v;
+		v >>= 8;
+	}
+	bw_raw(w, tmp, size + 1);
+}
+
+/* cbor_head - major type with its argument in the shortest form */
+static void cbor_head(struct bw *w, int major, uint64_t v)
+{
+	uint8_t mt = (uint8_t)(major << 5);
+
+	if (v < 24)
+		put8(w, mt | (uint8_t)v);
+	else if (v <= 0xff)
+		put_be(w, mt | 24, v, 1);
+	else if (v <= 0xffff)
+		put_be(w, mt | 25, v, 2);
+	else if (v <= 0xffffffffull)
+		put_be(w, mt | 26, v, 4);
+	else
+		put_be(w, mt | 27, v, 8);
+}
+
+/*
+ * mp_head - MessagePack container/string header: the fix form when n
+ * fits fix_max, otherwise the 8 (strings only), 16 or 32-bit form whose
+ * type bytes follow one another starting at type_16 (or type_8).
+ */
+static void mp_head(struct bw *w, uint8_t fix, uint32_t fix_max,
+		    uint8_t type_8, uint8_t type_16, uint32_t n)
+{
+	if (n <= fix_max)
+		put8(w, fix | (uint8_t)n);
+	else if (type_8 && n <= 0xff)
+		put_be(w, type_8, n, 1);
+	else if (n <= 0xffff)
+		put_be(w, type_16, n, 2);
+	else
+		put_be(w, type_16 + 1, n, 4);
+}
+
+void bw_map(struct bw *w, uint32_t n)
+{
+	if (w->fmt == MSG_FMT_CBOR)
+		cbor_head(w, CBOR_MAP, n);
+	else
+		mp_head(w, 0x80, 15, 0, MP_MAP16, n);
+}
+
+void bw_array(struct bw *w, uint32_t n)
+{
+	if (w->fmt == MSG_FMT_CBOR)
+		cbor_head(w, CBOR_ARRAY, n);
+	else
+		mp_head(w, 0x90, 15, 0, MP_ARRAY16, n);
+}
+
+void bw_str(struct bw *w, const char *s)
+{
+	size_t n = strlen(s);
+
+	if (w->fmt == MSG_FMT_CBOR)
+		cbor_head(w, CBOR_TEXT, n);
+	else
+		mp_head(w, 0xa0, 31, MP_STR8, MP_STR8 + 1, (uint32_t)n);
+	bw_raw(w, s, n);
+}
+
+void bw_uint(struct bw *w, uint64_t v)
+{
+	int i;
+
+	if (w->fmt == MSG_FMT_CBOR) {
+		cbor_head(w, CBOR_UINT, v);
+		return;
+	}
+
+	if (v < 0x80) {
+		put8(w, (uint8_t)v);
+		return;
+	}
+	/* uint 8, 16, 32, 64 are 0xcc..0xcf */
+	for (i = 0; i < 3 && v >> (8 << i); i++)
+		;
+	put_be(w, MP_UINT8 + i, v, 1 << i);
+}
+
+void bw_int(struct bw *w, int64_t v)
+{
+	uint64_t mag;
+	int i;
+
+	if (v >= 0) {
+		bw_uint(w, (uint64_t)v);
+		return;
+	}
+
+	if (w->fmt == MSG_FMT_CBOR) {
+		/* CBOR stores -1 - v */
+		cbor_head(w, CBOR_NEGINT, ~(uint64_t)v);
+		return;
+	}
+
+	if (v >= -32) {
+		put8(w, (uint8_t)v);	/* negative fixint 0xe0..0xff */
+		return;
+	}
+	/* int 8, 16, 32, 64 are 0xd0..0xd3 */
+	mag = ~(uint64_t)v;
+	for (i = 0; i < 3 && mag >> ((8 << i) - 1); i++)
+		;
+	put_be(w, MP_INT8 + i, (uint64_t)v, 1 << i);
+}
+
+void bw_null(struct bw *w)
+{
+	put8(w, w->fmt == MSG_FMT_CBOR ? CBOR_NULL : MP_NIL);
+}
+
+/*
+ * bw_bin - byte string header for n bytes, then room for the caller to
+ * fill them in place. Returns NULL when they do not fit, like jw_room().
+ */
+uint8_t *bw_bin(struct bw *w, size_t n)
+{
+	uint8_t *p;
+
+	if (w->fmt == MSG_FMT_CBOR)
+		cbor_head(w, CBOR_BYTES, n);
+	else if (n <= 0xff)
+		put_be(w, MP_BIN8, n, 1);	/* bin 8, 16, 32 are 0xc4..0xc6 */
+	else if (n <= 0xffff)
+		put_be(w, MP_BIN8 + 1, n, 2);
+	else
+		put_be(w, MP_BIN8 + 2, n, 4);
+
+	p = w->len + n <= w->cap ? w->buf + w->len : NULL;
+	w->len += n;
+	return p;
+}
+
+void bw_number(struct bw *w, double d)
+{
+	float f;
+	uint32_t u32;
+	uint64_t u64;
+
+	if (isnan(d) || isinf(d)) {
+		bw_null(w);	/* what the JSON encoding publishes */
+		return;
+	}
+
+	if (d == trunc(d) && fabs(d) < EXACT_INT_LIMIT) {
+		bw_int(w, (int64_t)d);
+		return;
+	}
+
+	f = (float)d;
+	if ((double)f == d) {
+		memcpy(&u32, &f, sizeof(u32));
+		put_be(w, w->fmt == MSG_FMT_CBOR ? CBOR_FLOAT32 : MP_FLOAT32,
+		       u32, 4);
+		return;
+	}
+
+	memcpy(&u64, &d, sizeof(u64));
+	put_be(w, w->fmt == MSG_FMT_CBOR ? CBOR_FLOAT64 : MP_FLOAT64, u64, 8);
+}
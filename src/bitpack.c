@@ -0,0 +1,206 @@
+/*
+ * bitpack.c - packed bit strings.
+ *
+ * A parameter can start at any bit of a block's image, so everything here
+ * works on (image, bit offset, count). Unaligned extraction shifts eight
+ * bytes at a time, hex encodes four bytes per 64-bit word (SWAR), and the
+ * text encoders run over 48-byte chunks extracted onto the stack, 48 being
+ * a multiple of the three bytes base64 encodes at once.
+ */
+
+#include <string.h>
+
+#include "bitpack.h"
+
+#define CHUNK	48
+
+static const char b64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int bit_fmt_from_str(const char *s)
+{
+	if (strcmp(s, "base64") == 0)
+		return BIT_FMT_BASE64;
+	if (strcmp(s, "array") == 0)
+		return BIT_FMT_ARRAY;
+	return BIT_FMT_HEX;
+}
+
+/* bits_text_len - characters bits_text() writes for count bits */
+size_t bits_text_len(int fmt, int count)
+{
+	size_t n = BITS_BYTES(count);
+
+	if (fmt == BIT_FMT_HEX)
+		return 2 * n;
+	if (fmt == BIT_FMT_BASE64)
+		return 4 * ((n + 2) / 3);
+	return 0;
+}
+
+static uint64_t load_le64(const uint8_t *p)
+{
+	uint64_t v;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&v, p, sizeof(v));
+#else
+	int i;
+
+	for (v = 0, i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+#endif
+	return v;
+}
+
+static void store_le64(void *p, uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &v, sizeof(v));
+#else
+	uint8_t *b = p;
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8)
+		b[i] = (uint8_t)v;
+#endif
+}
+
+/*
+ * bits_extract - copy count bits starting at bit off of src to the start
+ * of dst, BITS_BYTES(count) bytes with the unused high bits cleared.
+ */
+void bits_extract(uint8_t *dst, const uint8_t *src, int off, int count)
+{
+	const uint8_t *s = src + off / 8;
+	unsigned int shift = off % 8;
+	size_t n = BITS_BYTES(count);
+	size_t avail = BITS_BYTES(shift + count);	/* source bytes touched */
+	size_t i = 0;
+
+	if (count <= 0)
+		return;
+
+	if (!shift) {
+		memcpy(dst, s, n);
+	} else {
+		/* nine source bytes give eight shifted ones */
+		for (; i + 8 < avail; i += 8)
+			store_le64(dst + i, load_le64(s + i) >> shift |
+				   (uint64_t)s[i + 8] << (64 - shift));
+		for (; i < n; i++)
+			dst[i] = (uint8_t)(s[i] >> shift |
+				 (i + 1 < avail ? s[i + 1] << (8 - shift) : 0));
+	}
+	if (count % 8)
+		dst[n - 1] &= (uint8_t)((1u << (count % 8)) - 1);
+}
+
+/* bits_put - store the low n bits of v at bit off of p */
+void bits_put(uint8_t *p, int off, unsigned int v, int n)
+{
+	while (n > 0) {
+		int sh = off % 8;
+		int take = 8 - sh < n ? 8 - sh : n;
+		uint8_t m = (uint8_t)(((1u << take) - 1) << sh);
+
+		p[off / 8] = (uint8_t)((p[off / 8] & ~m) | ((v << sh) & m));
+		v >>= take;
+		off += take;
+		n -= take;
+	}
+}
+
+/* bits_differ - whether the packed copy differs from count bits at off */
+int bits_differ(const uint8_t *packed, const uint8_t *src, int off,
+		int count)
+{
+	uint8_t tmp[CHUNK];
+	int done, n;
+
+	for (done = 0; done < count; done += n) {
+		n = count - done < CHUNK * 8 ? count - done : CHUNK * 8;
+		bits_extract(tmp, src, off + done, n);
+		if (memcmp(tmp, packed + done / 8, BITS_BYTES(n)))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * hex4 - the low four bytes of v as eight hex digits, first byte first:
+ * spread the nibbles one per byte, then add '0', or 'a' - 10 for those
+ * above 9, to all of them at once.
+ */
+static uint64_t hex4(uint64_t v)
+{
+	uint64_t x = v & 0xffffffffull;
+	uint64_t m;
+
+	x = (x | x << 16) & 0x0000ffff0000ffffull;
+	x = (x | x << 8) & 0x00ff00ff00ff00ffull;
+	x = (x >> 4 & 0x000f000f000f000full) | (x & 0x000f000f000f000full) << 8;
+	m = (x + 0x0606060606060606ull) >> 4 & 0x0101010101010101ull;
+	return x + 0x3030303030303030ull + m * ('a' - '0' - 10);
+}
+
+static char *hex_encode(char *d, const uint8_t *p, size_t n)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8, d += 16) {
+		uint64_t v = load_le64(p + i);
+
+		store_le64(d, hex4(v));
+		store_le64(d + 8, hex4(v >> 32));
+	}
+	for (; i < n; i++) {
+		*d++ = digits[p[i] >> 4];
+		*d++ = digits[p[i] & 15];
+	}
+	return d;
+}
+
+static char *base64_encode(char *d, const uint8_t *p, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 3 <= n; i += 3, d += 4) {
+		uint32_t v = (uint32_t)p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+
+		d[0] = b64_digits[v >> 18];
+		d[1] = b64_digits[v >> 12 & 63];
+		d[2] = b64_digits[v >> 6 & 63];
+		d[3] = b64_digits[v & 63];
+	}
+	if (i < n) {
+		uint32_t v = (uint32_t)p[i] << 16 |
+			     (i + 1 < n ? p[i + 1] << 8 : 0);
+
+		d[0] = b64_digits[v >> 18];
+		d[1] = b64_digits[v >> 12 & 63];
+		d[2] = i + 1 < n ? b64_digits[v >> 6 & 63] : '=';
+		d[3] = '=';
+		d += 4;
+	}
+	return d;
+}
+
+/*
+ * bits_text - count bits at off as hex or base64, bits_text_len() chars,
+ * not NUL terminated.
+ */
+void bits_text(char *dst, int fmt, const uint8_t *src, int off, int count)
+{
+	uint8_t tmp[CHUNK];
+	int done, n;
+
+	for (done = 0; done < count; done += n) {
+		n = count - done < CHUNK * 8 ? count - done : CHUNK * 8;
+		bits_extract(tmp, src, off + done, n);
+		if (fmt == BIT_FMT_BASE64)
+			dst = base64_encode(dst, tmp, BITS_BYTES(n));
+		else
+			dst = hex_encode(dst, tmp, BITS_BYTES(n));
+	}
+}
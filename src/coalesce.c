@@ -0,0 +1,195 @@
+/*
+ * coalesce.c - Nagle-style batching of small publishes.
+ *
+ * Runs on the mqtt thread only. Messages whose topics share their first
+ * `levels` levels (e.g. forgeedge/<edge>) are appended to one open batch
+ * per prefix; a batch goes out on <prefix>/batch when the next message
+ * would push it past max_bytes, or when its first message is delay_ns
+ * old. Only JSON payloads are batched; anything else, and anything too
+ * big to share a batch, is left to the caller to send on its own.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "coalesce.h"
+
+static const char batch_head[] = "{\"batch\":[";
+static const char batch_tail[] = "]}";
+static const char entry_topic[] = "{\"topic\":\"";
+static const char entry_msg[] = "\",\"msg\":";
+
+#define BATCH_OVERHEAD	(sizeof(batch_head) - 1 + sizeof(batch_tail) - 1)
+
+void coalesce_init(struct coalescer *c, size_t max_bytes, int delay_ms,
+		   int levels, void (*emit)(struct msg_buf *m))
+{
+	memset(c, 0, sizeof(*c));
+	c->max_bytes = max_bytes;
+	c->delay_ns = (uint64_t)(delay_ms > 0 ? delay_ms : 0) * 1000000ull;
+	c->levels = levels > 0 ? levels : 1;
+	c->emit = emit;
+}
+
+/* prefix_len - length of the first levels levels of topic, 0 if shorter */
+static size_t prefix_len(const char *topic, int levels)
+{
+	const char *p = topic;
+
+	while ((p = strchr(p, '/'))) {
+		if (--levels == 0)
+			return p - topic;
+		p++;
+	}
+	return 0;
+}
+
+static size_t escaped_len(const char *s)
+{
+	size_t n = 0;
+
+	for (; *s; s++)
+		n += (*s == '"' || *s == '\\') ? 2 : 1;
+	return n;
+}
+
+static void append(struct msg_buf *out, const char *s, size_t len)
+{
+	memcpy(out->data + out->len, s, len);
+	out->len += len;
+}
+
+static void append_escaped(struct msg_buf *out, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			out->data[out->len++] = '\\';
+		out->data[out->len++] = *s;
+	}
+}
+
+static void batch_flush(struct coalescer *c, struct co_batch *b)
+{
+	append(b->out, batch_tail, sizeof(batch_tail) - 1);
+	b->out->data[b->out->len] = '\0';
+	c->emit(b->out);
+	msg_put(b->out);
+	b->out = NULL;
+	b->entries = 0;
+}
+
+static struct co_batch *batch_open(struct coalescer *c, const char *topic,
+				   size_t key_len, uint64_t now)
+{
+	struct co_batch *b = NULL;
+	int i;
+
+	for (i = 0; i < COALESCE_MAX_OPEN; i++)
+		if (!c->open[i].out) {
+			b = &c->open[i];
+			break;
+		}
+
+	if (!b) {
+		/* every slot busy: ship the batch that is due first */
+		b = &c->open[0];
+		for (i = 1; i < COALESCE_MAX_OPEN; i++)
+			if (c->open[i].deadline_ns < b->deadline_ns)
+				b = &c->open[i];
+		batch_flush(c, b);
+	}
+
+	b->out = msg_alloc(c->max_bytes + 1);
+	if (!b->out)
+		return NULL;
+
+	memcpy(b->key, topic, key_len);
+	b->key[key_len] = '\0';
+	b->key_len = key_len;
+	/* coalesce_add() only opens a batch when key/batch fits a topic */
+	memcpy(b->out->topic, topic, key_len);
+	memcpy(b->out->topic + key_len, "/batch", sizeof("/batch"));
+	append(b->out, batch_head, sizeof(batch_head) - 1);
+	b->entries = 0;
+	b->deadline_ns = now + c->delay_ns;
+	return b;
+}
+
+/*
+ * coalesce_add - copy m into the open batch for its topic prefix.
+ * Returns 0 when m was taken (the caller still releases its reference),
+ * 1 when m has to be sent on its own.
+ */
+int coalesce_add(struct coalescer *c, const struct msg_buf *m, uint64_t now)
+{
+	struct co_batch *b = NULL;
+	size_t key_len, entry;
+	int i;
+
+	if (!c->max_bytes || !m->len || m->fmt != MSG_FMT_JSON ||
+	    (m->data[0] != '{' && m->data[0] != '['))
+		return 1;
+
+	key_len = prefix_len(m->topic, c->levels);
+	if (!key_len || key_len + sizeof("/batch") > MSG_TOPIC_LEN)
+		return 1;
+
+	/* separator + {"topic":"...","msg":...} */
+	entry = 1 + sizeof(entry_topic) - 1 + escaped_len(m->topic) +
+		sizeof(entry_msg) - 1 + m->len + 1;
+	if (BATCH_OVERHEAD + entry > c->max_bytes)
+		return 1;
+
+	for (i = 0; i < COALESCE_MAX_OPEN; i++) {
+		struct co_batch *o = &c->open[i];
+
+		if (o->out && o->key_len == key_len &&
+		    memcmp(o->key, m->topic, key_len) == 0) {
+			b = o;
+			break;
+		}
+	}
+
+	if (b && b->out->len + entry + sizeof(batch_tail) - 1 > c->max_bytes)
+		batch_flush(c, b);
+	if (!b || !b->out)
+		b = batch_open(c, m->topic, key_len, now);
+	if (!b)
+		return 1;
+
+	if (b->entries++)
+		append(b->out, ",", 1);
+	append(b->out, entry_topic, sizeof(entry_topic) - 1);
+	append_escaped(b->out, m->topic);
+	append(b->out, entry_msg, sizeof(entry_msg) - 1);
+	append(b->out, m->data, m->len);
+	append(b->out, "}", 1);
+
+	/* the batch inherits the most urgent lane of its members */
+	if (b->entries == 1 || m->prio < b->out->prio)
+		b->out->prio = m->prio;
+	return 0;
+}
+
+/* coalesce_flush - send batches that are due at now, or all of them */
+void coalesce_flush(struct coalescer *c, uint64_t now, int all)
+{
+	int i;
+
+	for (i = 0; i < COALESCE_MAX_OPEN; i++)
+		if (c->open[i].out && (all || now >= c->open[i].deadline_ns))
+			batch_flush(c, &c->open[i]);
+}
+
+/* coalesce_next_deadline - earliest batch deadline, 0 when none is open */
+uint64_t coalesce_next_deadline(const struct coalescer *c)
+{
+	uint64_t next = 0;
+	int i;
+
+	for (i = 0; i < COALESCE_MAX_OPEN; i++)
+		if (c->open[i].out &&
+		    (!next || c->open[i].deadline_ns < next))
+			next = c->open[i].deadline_ns;
+	return next;
+}
@@ -15,6 +15,8 @@
 #include <errno.h>
 
 #include "config.h"
+#include "readplan.h"
+#include "dtoa.h"
 #include "cJSON.h"
 
 static double get_json_double(cJSON *obj, const char *name, double dflt)
@@ -28,6 +30,95 @@ static double get_json_double(cJSON *obj, const char *name, double dflt)
 	return item->valuedouble;
 }
 
+/*
+ * parse_bit_names - join the names of a bit string parameter with commas.
+ * Names that do not fit are dropped, their bits stay unnamed.
+ */
+static void parse_bit_names(struct parameter *p, cJSON *arr)
+{
+	size_t len = 0;
+	cJSON *it;
+
+	p->bit_names[0] = '\0';
+	cJSON_ArrayForEach(it, arr) {
+		const char *s = cJSON_IsString(it) ? it->valuestring : "";
+		size_t n = strcspn(s, ",");
+
+		if (len + n + 2 > sizeof(p->bit_names))
+			break;
+		if (it != arr->child)
+			p->bit_names[len++] = ',';
+		memcpy(p->bit_names + len, s, n);
+		len += n;
+		p->bit_names[len] = '\0';
+	}
+}
+
+static cJSON *bit_names_array(const struct parameter *p)
+{
+	cJSON *arr = cJSON_CreateArray();
+	const char *s = p->bit_names;
+	char name[MAX_BIT_NAMES_LEN];
+
+	for (;;) {
+		size_t n = strcspn(s, ",");
+
+		memcpy(name, s, n);
+		name[n] = '\0';
+		cJSON_AddItemToArray(arr, cJSON_CreateString(name));
+		if (!s[n])
+			break;
+		s += n + 1;
+	}
+	return arr;
+}
+
+/*
+ * parse_serial - "serial": {"port", "baud", "parity", "data_bits",
+ * "stop_bits"}; parity is "none", "even" or "odd", defaults 19200 8E1.
+ */
+static void parse_serial(cJSON *obj, struct serial_line *s)
+{
+	cJSON *p;
+
+	p = cJSON_GetObjectItem(obj, "port");
+	if (p && cJSON_IsString(p))
+		strncpy(s->port, p->valuestring, sizeof(s->port) - 1);
+
+	p = cJSON_GetObjectItem(obj, "baud");
+	s->baud = p && cJSON_IsNumber(p) && p->valueint > 0 ?
+		  p->valueint : DEFAULT_SERIAL_BAUD;
+
+	s->parity = DEFAULT_SERIAL_PARITY;
+	p = cJSON_GetObjectItem(obj, "parity");
+	if (p && cJSON_IsString(p)) {
+		if (strcmp(p->valuestring, "none") == 0)
+			s->parity = 'N';
+		else if (strcmp(p->valuestring, "odd") == 0)
+			s->parity = 'O';
+	}
+
+	p = cJSON_GetObjectItem(obj, "data_bits");
+	s->data_bits = p && cJSON_IsNumber(p) && p->valueint >= 5 &&
+		       p->valueint <= 8 ? p->valueint : 8;
+
+	p = cJSON_GetObjectItem(obj, "stop_bits");
+	s->stop_bits = p && cJSON_IsNumber(p) && p->valueint == 2 ? 2 : 1;
+}
+
+static cJSON *serial_to_json(const struct serial_line *s)
+{
+	cJSON *obj = cJSON_CreateObject();
+
+	cJSON_AddStringToObject(obj, "port", s->port);
+	cJSON_AddNumberToObject(obj, "baud", s->baud);
+	cJSON_AddStringToObject(obj, "parity", s->parity == 'N' ? "none" :
+				s->parity == 'O' ? "odd" : "even");
+	cJSON_AddNumberToObject(obj, "data_bits", s->data_bits);
+	cJSON_AddNumberToObject(obj, "stop_bits", s->stop_bits);
+	return obj;
+}
+
 int load_config_from_file(const char *path, struct config *cfg)
 {
 	FILE *fp;
@@ -91,7 +182,43 @@ int load_config_from_file(const char *path, struct config *cfg)
 		strncpy(cfg->data_mode, tmp->valuestring,
 			sizeof(cfg->data_mode) - 1);
 
+	tmp = cJSON_GetObjectItem(root, "bit_format");
+	if (tmp && cJSON_IsString(tmp))
+		strncpy(cfg->bit_format, tmp->valuestring,
+			sizeof(cfg->bit_format) - 1);
+	else
+		strncpy(cfg->bit_format, "hex", sizeof(cfg->bit_format) - 1);
+
+	tmp = cJSON_GetObjectItem(root, "engine");
+	if (tmp && cJSON_IsString(tmp))
+		strncpy(cfg->engine, tmp->valuestring, sizeof(cfg->engine) - 1);
+	else
+		strncpy(cfg->engine, "threads", sizeof(cfg->engine) - 1);
+
+	tmp = cJSON_GetObjectItem(root, "engine_threads");
+	if (tmp && cJSON_IsNumber(tmp) && tmp->valueint > 0)
+		cfg->engine_threads = tmp->valueint;
+	else
+		cfg->engine_threads = 1;
+
+	tmp = cJSON_GetObjectItem(root, "stats_interval_ms");
+	if (tmp && cJSON_IsNumber(tmp) && tmp->valueint >= 0)
+		cfg->stats_interval_ms = tmp->valueint;
+	else
+		cfg->stats_interval_ms = DEFAULT_STATS_INTERVAL_MS;
+
 	/* mqtt block */
+	strncpy(cfg->mqtt.queue_overflow, "drop_oldest",
+		sizeof(cfg->mqtt.queue_overflow) - 1);
+	strncpy(cfg->mqtt.spool_dir, DEFAULT_SPOOL_DIR,
+		sizeof(cfg->mqtt.spool_dir) - 1);
+	cfg->mqtt.spool_max_mb = DEFAULT_SPOOL_MAX_MB;
+	cfg->mqtt.spool_drain_rate = DEFAULT_SPOOL_DRAIN_RATE;
+	cfg->mqtt.coalesce_bytes = 0;
+	cfg->mqtt.coalesce_delay_ms = DEFAULT_COALESCE_DELAY_MS;
+	cfg->mqtt.coalesce_levels = DEFAULT_COALESCE_LEVELS;
+	strncpy(cfg->mqtt.sparkplug_group, DEFAULT_SPARKPLUG_GROUP,
+		sizeof(cfg->mqtt.sparkplug_group) - 1);
 	tmp = cJSON_GetObjectItem(root, "mqtt");
 	if (tmp && cJSON_IsObject(tmp)) {
 		cJSON *it;
@@ -128,6 +255,49 @@ int load_config_from_file(const char *path, struct config *cfg)
 			strncpy(cfg->mqtt.password, it->valuestring,
 				sizeof(cfg->mqtt.password) - 1);
 
+		it = cJSON_GetObjectItem(tmp, "queue_overflow");
+		if (it && cJSON_IsString(it))
+			strncpy(cfg->mqtt.queue_overflow, it->valuestring,
+				sizeof(cfg->mqtt.queue_overflow) - 1);
+
+		/* "" turns the disk spool off */
+		it = cJSON_GetObjectItem(tmp, "spool_dir");
+		if (it && cJSON_IsString(it)) {
+			memset(cfg->mqtt.spool_dir, 0, sizeof(cfg->mqtt.spool_dir));
+			strncpy(cfg->mqtt.spool_dir, it->valuestring,
+				sizeof(cfg->mqtt.spool_dir) - 1);
+		}
+
+		it = cJSON_GetObjectItem(tmp, "spool_max_mb");
+		if (it && cJSON_IsNumber(it) && it->valueint > 0)
+			cfg->mqtt.spool_max_mb = it->valueint;
+
+		it = cJSON_GetObjectItem(tmp, "spool_drain_rate");
+		if (it && cJSON_IsNumber(it) && it->valueint > 0)
+			cfg->mqtt.spool_drain_rate = it->valueint;
+
+		it = cJSON_GetObjectItem(tmp, "coalesce_bytes");
+		if (it && cJSON_IsNumber(it) && it->valueint >= 0)
+			cfg->mqtt.coalesce_bytes = it->valueint;
+
+		it = cJSON_GetObjectItem(tmp, "coalesce_delay_ms");
+		if (it && cJSON_IsNumber(it) && it->valueint >= 0)
+			cfg->mqtt.coalesce_delay_ms = it->valueint;
+
+		it = cJSON_GetObjectItem(tmp, "coalesce_levels");
+		if (it && cJSON_IsNumber(it) && it->valueint > 0)
+			cfg->mqtt.coalesce_levels = it->valueint;
+
+		it = cJSON_GetObjectItem(tmp, "protocol_version");
+		if (it && cJSON_IsNumber(it) &&
+		    (it->valueint == 4 || it->valueint == 5))
+			cfg->mqtt.protocol_version = it->valueint;
+
+		it = cJSON_GetObjectItem(tmp, "sparkplug_group");
+		if (it && cJSON_IsString(it) && it->valuestring[0])
+			strncpy(cfg->mqtt.sparkplug_group, it->valuestring,
+				sizeof(cfg->mqtt.sparkplug_group) - 1);
+
 		it = cJSON_GetObjectItem(tmp, "tls_config");
 		if (it && cJSON_IsObject(it)) {
 			cJSON *t;
@@ -174,12 +344,98 @@ int load_config_from_file(const char *path, struct config *cfg)
 			else
 				cfg->io_devices[i].port = 502;
 
+			p = cJSON_GetObjectItem(dev, "unit_id");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0 &&
+			    p->valueint <= 247)
+				cfg->io_devices[i].unit_id = p->valueint;
+
+			p = cJSON_GetObjectItem(dev, "serial");
+			if (p && cJSON_IsObject(p))
+				parse_serial(p, &cfg->io_devices[i].serial);
+
 			p = cJSON_GetObjectItem(dev, "poll_interval_ms");
 			if (p && cJSON_IsNumber(p))
 				cfg->io_devices[i].poll_interval_ms = p->valueint;
 			else
 				cfg->io_devices[i].poll_interval_ms = 1000;
 
+			p = cJSON_GetObjectItem(dev, "max_gap");
+			if (p && cJSON_IsNumber(p) && p->valueint >= 0)
+				cfg->io_devices[i].max_gap = p->valueint;
+			else if (cfg->io_devices[i].serial.port[0])
+				cfg->io_devices[i].max_gap = DEFAULT_RTU_MAX_GAP;
+			else
+				cfg->io_devices[i].max_gap = DEFAULT_MAX_GAP;
+
+			p = cJSON_GetObjectItem(dev, "max_outstanding");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0)
+				cfg->io_devices[i].max_outstanding =
+					p->valueint < (int)MAX_OUTSTANDING ?
+					p->valueint : (int)MAX_OUTSTANDING;
+			else
+				cfg->io_devices[i].max_outstanding = 1;
+
+			p = cJSON_GetObjectItem(dev, "overrun_policy");
+			if (p && cJSON_IsString(p))
+				strncpy(cfg->io_devices[i].overrun_policy,
+					p->valuestring,
+					sizeof(cfg->io_devices[i].overrun_policy) - 1);
+			else
+				strncpy(cfg->io_devices[i].overrun_policy, "skip",
+					sizeof(cfg->io_devices[i].overrun_policy) - 1);
+
+			p = cJSON_GetObjectItem(dev, "report_by_exception");
+			cfg->io_devices[i].report_by_exception = cJSON_IsTrue(p);
+
+			p = cJSON_GetObjectItem(dev, "full_refresh_s");
+			if (p && cJSON_IsNumber(p) && p->valueint >= 0)
+				cfg->io_devices[i].full_refresh_s = p->valueint;
+			else
+				cfg->io_devices[i].full_refresh_s =
+					DEFAULT_FULL_REFRESH_S;
+
+			p = cJSON_GetObjectItem(dev, "reconnect_max_ms");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0)
+				cfg->io_devices[i].reconnect_max_ms = p->valueint;
+
+			p = cJSON_GetObjectItem(dev, "request_gap_ms");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0)
+				cfg->io_devices[i].request_gap_ms = p->valueint;
+
+			p = cJSON_GetObjectItem(dev, "response_timeout_min_ms");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0)
+				cfg->io_devices[i].response_timeout_min_ms =
+					p->valueint;
+			else
+				cfg->io_devices[i].response_timeout_min_ms =
+					DEFAULT_RESPONSE_TIMEOUT_MIN_MS;
+
+			p = cJSON_GetObjectItem(dev, "response_timeout_max_ms");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0)
+				cfg->io_devices[i].response_timeout_max_ms =
+					p->valueint;
+			else
+				cfg->io_devices[i].response_timeout_max_ms =
+					DEFAULT_RESPONSE_TIMEOUT_MAX_MS;
+			if (cfg->io_devices[i].response_timeout_max_ms <
+			    cfg->io_devices[i].response_timeout_min_ms)
+				cfg->io_devices[i].response_timeout_max_ms =
+					cfg->io_devices[i].response_timeout_min_ms;
+
+			p = cJSON_GetObjectItem(dev, "breaker_failures");
+			if (p && cJSON_IsNumber(p) && p->valueint >= 0)
+				cfg->io_devices[i].breaker_failures = p->valueint;
+			else
+				cfg->io_devices[i].breaker_failures =
+					DEFAULT_BREAKER_FAILURES;
+
+			p = cJSON_GetObjectItem(dev, "quarantine_max_ms");
+			if (p && cJSON_IsNumber(p) && p->valueint > 0)
+				cfg->io_devices[i].quarantine_max_ms = p->valueint;
+			else
+				cfg->io_devices[i].quarantine_max_ms =
+					DEFAULT_QUARANTINE_MAX_MS;
+
 			/* parameters array */
 			p = cJSON_GetObjectItem(dev, "parameters");
 			if (p && cJSON_IsArray(p)) {
@@ -207,6 +463,23 @@ int load_config_from_file(const char *path, struct config *cfg)
 						cfg->io_devices[i].parameters[j].address =
 							pn->valueint;
 
+					pn = cJSON_GetObjectItem(par, "bit");
+					if (pn && cJSON_IsNumber(pn))
+						cfg->io_devices[i].parameters[j].bit =
+							pn->valueint;
+
+					pn = cJSON_GetObjectItem(par, "data_type");
+					if (pn && cJSON_IsString(pn))
+						strncpy(cfg->io_devices[i].parameters[j].data_type,
+							pn->valuestring,
+							sizeof(cfg->io_devices[i].parameters[j].data_type) - 1);
+
+					pn = cJSON_GetObjectItem(par, "word_order");
+					if (pn && cJSON_IsString(pn))
+						strncpy(cfg->io_devices[i].parameters[j].word_order,
+							pn->valuestring,
+							sizeof(cfg->io_devices[i].parameters[j].word_order) - 1);
+
 					pn = cJSON_GetObjectItem(par, "count");
 					if (pn && cJSON_IsNumber(pn))
 						cfg->io_devices[i].parameters[j].count =
@@ -216,6 +489,37 @@ int load_config_from_file(const char *path, struct config *cfg)
 
 					cfg->io_devices[i].parameters[j].scale =
 						get_json_double(par, "scale", 1.0);
+					cfg->io_devices[i].parameters[j].offset =
+						get_json_double(par, "offset", 0.0);
+
+					pn = cJSON_GetObjectItem(par, "decimals");
+					if (pn && cJSON_IsNumber(pn) && pn->valueint >= 0 &&
+					    pn->valueint <= DTOA_MAX_DECIMALS)
+						cfg->io_devices[i].parameters[j].decimals =
+							pn->valueint;
+					else if (pn && cJSON_IsString(pn) &&
+						 !strcmp(pn->valuestring, "shortest"))
+						cfg->io_devices[i].parameters[j].decimals =
+							DTOA_SHORTEST;
+					else
+						cfg->io_devices[i].parameters[j].decimals =
+							DTOA_CJSON;
+
+					/* negative deadbands read as none */
+					cfg->io_devices[i].parameters[j].deadband =
+						get_json_double(par, "deadband", 0.0);
+					cfg->io_devices[i].parameters[j].deadband_pct =
+						get_json_double(par, "deadband_pct", 0.0);
+
+					pn = cJSON_GetObjectItem(par, "poll_interval_ms");
+					if (pn && cJSON_IsNumber(pn) && pn->valueint > 0)
+						cfg->io_devices[i].parameters[j].poll_interval_ms =
+							pn->valueint;
+
+					pn = cJSON_GetObjectItem(par, "bit_names");
+					if (pn && cJSON_IsArray(pn))
+						parse_bit_names(&cfg->io_devices[i].parameters[j],
+								pn);
 
 					j++;
 				}
@@ -246,6 +550,10 @@ int save_config_to_file(const char *path, const struct config *cfg)
 
 	cJSON_AddStringToObject(root, "forge_edge_id", cfg->forge_edge_id);
 	cJSON_AddStringToObject(root, "data_mode", cfg->data_mode);
+	cJSON_AddStringToObject(root, "bit_format", cfg->bit_format);
+	cJSON_AddStringToObject(root, "engine", cfg->engine);
+	cJSON_AddNumberToObject(root, "engine_threads", cfg->engine_threads);
+	cJSON_AddNumberToObject(root, "stats_interval_ms", cfg->stats_interval_ms);
 
 	mqtt = cJSON_CreateObject();
 	cJSON_AddBoolToObject(mqtt, "enabled", cfg->mqtt.enabled);
@@ -255,6 +563,17 @@ int save_config_to_file(const char *path, const struct config *cfg)
 	cJSON_AddStringToObject(mqtt, "client_id", cfg->mqtt.client_id);
 	cJSON_AddStringToObject(mqtt, "username", cfg->mqtt.username);
 	cJSON_AddStringToObject(mqtt, "password", cfg->mqtt.password);
+	cJSON_AddStringToObject(mqtt, "queue_overflow", cfg->mqtt.queue_overflow);
+	cJSON_AddStringToObject(mqtt, "spool_dir", cfg->mqtt.spool_dir);
+	cJSON_AddNumberToObject(mqtt, "spool_max_mb", cfg->mqtt.spool_max_mb);
+	cJSON_AddNumberToObject(mqtt, "spool_drain_rate", cfg->mqtt.spool_drain_rate);
+	cJSON_AddNumberToObject(mqtt, "coalesce_bytes", cfg->mqtt.coalesce_bytes);
+	cJSON_AddNumberToObject(mqtt, "coalesce_delay_ms", cfg->mqtt.coalesce_delay_ms);
+	cJSON_AddNumberToObject(mqtt, "coalesce_levels", cfg->mqtt.coalesce_levels);
+	if (cfg->mqtt.protocol_version)
+		cJSON_AddNumberToObject(mqtt, "protocol_version",
+					cfg->mqtt.protocol_version);
+	cJSON_AddStringToObject(mqtt, "sparkplug_group", cfg->mqtt.sparkplug_group);
 
 	tls = cJSON_CreateObject();
 	cJSON_AddStringToObject(tls, "ca_cert", cfg->mqtt.tls.ca_cert);
@@ -271,8 +590,37 @@ int save_config_to_file(const char *path, const struct config *cfg)
 		cJSON_AddStringToObject(dev, "io_device_id", cfg->io_devices[i].io_device_id);
 		cJSON_AddStringToObject(dev, "ip", cfg->io_devices[i].ip);
 		cJSON_AddNumberToObject(dev, "port", cfg->io_devices[i].port);
+		if (cfg->io_devices[i].unit_id)
+			cJSON_AddNumberToObject(dev, "unit_id",
+				cfg->io_devices[i].unit_id);
+		if (cfg->io_devices[i].serial.port[0])
+			cJSON_AddItemToObject(dev, "serial",
+				serial_to_json(&cfg->io_devices[i].serial));
 		cJSON_AddNumberToObject(dev, "poll_interval_ms",
 			cfg->io_devices[i].poll_interval_ms);
+		cJSON_AddNumberToObject(dev, "max_gap", cfg->io_devices[i].max_gap);
+		cJSON_AddNumberToObject(dev, "max_outstanding",
+			cfg->io_devices[i].max_outstanding);
+		cJSON_AddStringToObject(dev, "overrun_policy",
+			cfg->io_devices[i].overrun_policy);
+		cJSON_AddBoolToObject(dev, "report_by_exception",
+			cfg->io_devices[i].report_by_exception);
+		cJSON_AddNumberToObject(dev, "full_refresh_s",
+			cfg->io_devices[i].full_refresh_s);
+		if (cfg->io_devices[i].reconnect_max_ms)
+			cJSON_AddNumberToObject(dev, "reconnect_max_ms",
+				cfg->io_devices[i].reconnect_max_ms);
+		if (cfg->io_devices[i].request_gap_ms)
+			cJSON_AddNumberToObject(dev, "request_gap_ms",
+				cfg->io_devices[i].request_gap_ms);
+		cJSON_AddNumberToObject(dev, "response_timeout_min_ms",
+			cfg->io_devices[i].response_timeout_min_ms);
+		cJSON_AddNumberToObject(dev, "response_timeout_max_ms",
+			cfg->io_devices[i].response_timeout_max_ms);
+		cJSON_AddNumberToObject(dev, "breaker_failures",
+			cfg->io_devices[i].breaker_failures);
+		cJSON_AddNumberToObject(dev, "quarantine_max_ms",
+			cfg->io_devices[i].quarantine_max_ms);
 
 		params = cJSON_CreateArray();
 		for (j = 0; j < cfg->io_devices[i].parameter_count; j++) {
@@ -283,10 +631,40 @@ int save_config_to_file(const char *path, const struct config *cfg)
 				cfg->io_devices[i].parameters[j].type);
 			cJSON_AddNumberToObject(p, "address",
 				cfg->io_devices[i].parameters[j].address);
+			if (cfg->io_devices[i].parameters[j].bit)
+				cJSON_AddNumberToObject(p, "bit",
+					cfg->io_devices[i].parameters[j].bit);
 			cJSON_AddNumberToObject(p, "count",
 				cfg->io_devices[i].parameters[j].count);
+			if (cfg->io_devices[i].parameters[j].data_type[0])
+				cJSON_AddStringToObject(p, "data_type",
+					cfg->io_devices[i].parameters[j].data_type);
+			if (cfg->io_devices[i].parameters[j].word_order[0])
+				cJSON_AddStringToObject(p, "word_order",
+					cfg->io_devices[i].parameters[j].word_order);
 			cJSON_AddNumberToObject(p, "scale",
 				cfg->io_devices[i].parameters[j].scale);
+			if (cfg->io_devices[i].parameters[j].offset != 0)
+				cJSON_AddNumberToObject(p, "offset",
+					cfg->io_devices[i].parameters[j].offset);
+			if (cfg->io_devices[i].parameters[j].decimals >= 0)
+				cJSON_AddNumberToObject(p, "decimals",
+					cfg->io_devices[i].parameters[j].decimals);
+			else if (cfg->io_devices[i].parameters[j].decimals ==
+				 DTOA_SHORTEST)
+				cJSON_AddStringToObject(p, "decimals", "shortest");
+			if (cfg->io_devices[i].parameters[j].deadband > 0)
+				cJSON_AddNumberToObject(p, "deadband",
+					cfg->io_devices[i].parameters[j].deadband);
+			if (cfg->io_devices[i].parameters[j].deadband_pct > 0)
+				cJSON_AddNumberToObject(p, "deadband_pct",
+					cfg->io_devices[i].parameters[j].deadband_pct);
+			if (cfg->io_devices[i].parameters[j].poll_interval_ms)
+				cJSON_AddNumberToObject(p, "poll_interval_ms",
+					cfg->io_devices[i].parameters[j].poll_interval_ms);
+			if (cfg->io_devices[i].parameters[j].bit_names[0])
+				cJSON_AddItemToObject(p, "bit_names",
+					bit_names_array(&cfg->io_devices[i].parameters[j]));
 			cJSON_AddItemToArray(params, p);
 		}
 		cJSON_AddItemToObject(dev, "parameters", params);
@@ -0,0 +1,528 @@
+/*
+ * connmgr.c - Modbus TCP connections: connect, tune, lose, retry.
+ *
+ *  - connects are non-blocking with a CONN_CONNECT_TIMEOUT_MS deadline;
+ *    the thread engine then hands the socket to libmodbus with
+ *    modbus_set_socket(), the epoll engine drives its own
+ *  - every socket gets TCP_NODELAY, small requests must not wait for
+ *    Nagle, and keepalive, so a peer that vanished without a RST is
+ *    noticed even while a device is idle between slow polls
+ *  - a failed connect or a lost link is retried with jittered exponential
+ *    backoff (struct conn_backoff), capped at the device's
+ *    reconnect_max_ms or by default its poll interval: a device that
+ *    comes back is polled again within one interval, and one that keeps
+ *    failing is tried at most once a slot, never in a tight loop
+ *  - a link counts as lost on a socket error, or after CONN_SILENT_CYCLES
+ *    poll cycles in a row without a single answer (half-open connections,
+ *    gateways that stopped forwarding)
+ *  - devices with the same ip:port are units behind one gateway and share
+ *    a single connection (conn_gateways()), paced by conn_pacing()
+ *  - devices with the same serial port are slaves on one RTU bus: one
+ *    line, opened by libmodbus, with at least the 3.5 character silence
+ *    between frames (conn_silence_ns())
+ *  - a device that stops answering on a working connection is
+ *    quarantined by its circuit breaker (struct breaker) and only probed
+ *    with backed off single register reads until it answers again
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <modbus-rtu.h>
+#include "connmgr.h"
+
+void backoff_init(struct conn_backoff *b, const struct io_device *dev,
+		  uint32_t seed)
+{
+	backoff_init_ms(b, dev->reconnect_max_ms > 0 ? dev->reconnect_max_ms :
+						       dev->poll_interval_ms, seed);
+}
+
+void backoff_init_ms(struct conn_backoff *b, int max_ms, uint32_t seed)
+{
+	memset(b, 0, sizeof(*b));
+	if (max_ms < CONN_BACKOFF_MIN_MS)
+		max_ms = CONN_BACKOFF_MIN_MS;
+	b->max_ns = (uint64_t)max_ms * 1000000ull;
+	b->seed = seed ? seed : 1;
+}
+
+/* backoff_failed - one more failure at now; returns the delay chosen */
+uint64_t backoff_failed(struct conn_backoff *b, uint64_t now)
+{
+	unsigned int shift = b->failures < 20 ? b->failures : 20;
+	uint64_t d = (uint64_t)CONN_BACKOFF_MIN_MS * 1000000ull << shift;
+
+	if (d > b->max_ns)
+		d = b->max_ns;
+
+	/* xorshift32, spreads devices that failed together */
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 17;
+	b->seed ^= b->seed << 5;
+	d = d / 2 + b->seed % (d / 2 + 1);
+
+	b->failures++;
+	b->total++;
+	b->retry_ns = now + d;
+	return d;
+}
+
+void backoff_reset(struct conn_backoff *b)
+{
+	b->failures = 0;
+	b->retry_ns = 0;
+}
+
+void breaker_init(struct breaker *b, const struct io_device *dev,
+		  uint32_t seed)
+{
+	memset(b, 0, sizeof(*b));
+	b->threshold = dev->breaker_failures > 0 ? dev->breaker_failures : 0;
+	backoff_init_ms(&b->backoff, dev->quarantine_max_ms, seed);
+}
+
+/* breaker_action - what a slot of the device due at now should send */
+int breaker_action(const struct breaker *b, uint64_t now)
+{
+	if (b->state == BRK_CLOSED)
+		return BRK_POLL;
+	return now >= b->backoff.retry_ns ? BRK_PROBE : BRK_SKIP;
+}
+
+/*
+ * breaker_done - account a cycle that sent requests (a probe when open).
+ * Returns 1 when the device was quarantined or restored by it.
+ */
+int breaker_done(struct breaker *b, int answered, uint64_t now)
+{
+	if (b->state == BRK_CLOSED) {
+		if (answered) {
+			b->failures = 0;
+			return 0;
+		}
+		if (!b->threshold || ++b->failures < b->threshold)
+			return 0;
+		b->state = BRK_OPEN;
+		b->since_ns = now;
+		b->trips++;
+		backoff_reset(&b->backoff);
+		backoff_failed(&b->backoff, now);
+		return 1;
+	}
+
+	if (!answered) {
+		backoff_failed(&b->backoff, now);
+		return 0;
+	}
+	b->state = BRK_CLOSED;
+	b->since_ns = now;
+	b->failures = 0;
+	backoff_reset(&b->backoff);
+	return 1;
+}
+
+const char *breaker_state_str(int state)
+{
+	return state == BRK_OPEN ? "quarantined" : "online";
+}
+
+void rtt_init(struct rtt_est *r, const struct io_device *dev)
+{
+	memset(r, 0, sizeof(*r));
+	r->min_ns = (uint64_t)dev->response_timeout_min_ms * 1000000ull;
+	r->max_ns = (uint64_t)dev->response_timeout_max_ms * 1000000ull;
+	if (!r->min_ns)
+		r->min_ns = DEFAULT_RESPONSE_TIMEOUT_MIN_MS * 1000000ull;
+	if (r->max_ns < r->min_ns)
+		r->max_ns = r->min_ns;
+	r->rto_ns = (uint64_t)CONN_RTO_INITIAL_MS * 1000000ull;
+	if (r->rto_ns < r->min_ns)
+		r->rto_ns = r->min_ns;
+	if (r->rto_ns > r->max_ns)
+		r->rto_ns = r->max_ns;
+}
+
+/* rtt_base - what the samples call for, before clamping */
+static uint64_t rtt_base(const struct rtt_est *r)
+{
+	uint64_t var = 4 * r->rttvar_ns;
+
+	return r->srtt_ns + (var > CONN_RTO_GRANULARITY_NS ? var :
+			     CONN_RTO_GRANULARITY_NS);
+}
+
+static uint64_t rtt_clamp(const struct rtt_est *r, uint64_t ns)
+{
+	if (ns < r->min_ns)
+		return r->min_ns;
+	if (ns > r->max_ns)
+		return r->max_ns;
+	return ns;
+}
+
+/* rtt_sample - a response came ns after its request */
+void rtt_sample(struct rtt_est *r, uint64_t ns)
+{
+	if (!r->samples) {
+		r->srtt_ns = ns;
+		r->rttvar_ns = ns / 2;
+	} else {
+		uint64_t err = ns > r->srtt_ns ? ns - r->srtt_ns :
+						 r->srtt_ns - ns;
+
+		/* alpha 1/8, beta 1/4 */
+		r->rttvar_ns = r->rttvar_ns - r->rttvar_ns / 4 + err / 4;
+		r->srtt_ns = r->srtt_ns - r->srtt_ns / 8 + ns / 8;
+	}
+	r->samples++;
+	r->rto_ns = rtt_clamp(r, rtt_base(r));
+}
+
+/* rtt_timeout - a request went unanswered for rto_ns */
+void rtt_timeout(struct rtt_est *r)
+{
+	uint64_t rto = r->rto_ns * 2;
+
+	if (r->samples && rto > 2 * rtt_base(r))
+		rto = 2 * rtt_base(r);
+	r->timeouts++;
+	r->rto_ns = rtt_clamp(r, rto > r->rto_ns ? rto : r->rto_ns);
+}
+
+/* same_link - a and b are reached over the same connection */
+static int same_link(const struct io_device *a, const struct io_device *b)
+{
+	if (a->serial.port[0] || b->serial.port[0])
+		return strcmp(a->serial.port, b->serial.port) == 0;
+	return a->port == b->port && strcmp(a->ip, b->ip) == 0;
+}
+
+/* link_hash - FNV-1a of the ip and port, or of the serial port */
+static uint32_t link_hash(const struct io_device *d)
+{
+	const char *s = d->serial.port[0] ? d->serial.port : d->ip;
+	uint32_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (uint8_t)*s) * 16777619u;
+	if (!d->serial.port[0])
+		h = (h ^ (uint32_t)d->port) * 16777619u;
+	return h;
+}
+
+/*
+ * conn_gateways - gw[i] = index of the first device with the same ip and
+ * port, or the same serial port, as device i, for every device in one
+ * hashed pass. Devices behind one gateway or on one bus share its
+ * connection; the first one's reconnect_max_ms paces reconnects.
+ */
+int conn_gateways(const struct config *cfg, int *gw)
+{
+	int n = cfg->io_device_count;
+	unsigned int size = 16;
+	unsigned int h;
+	int *slots;
+	int i;
+
+	while (size < 2u * (unsigned int)n)
+		size *= 2;
+	slots = malloc(size * sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+	memset(slots, 0xff, size * sizeof(*slots));
+
+	for (i = 0; i < n; i++) {
+		const struct io_device *d = &cfg->io_devices[i];
+
+		for (h = link_hash(d) & (size - 1); slots[h] >= 0;
+		     h = (h + 1) & (size - 1))
+			if (same_link(&cfg->io_devices[slots[h]], d))
+				break;
+		if (slots[h] < 0)
+			slots[h] = i;
+		gw[i] = slots[h];
+	}
+	free(slots);
+	return 0;
+}
+
+/*
+ * conn_pacing - fold device d into the requests in flight and the gap
+ * between them on its gateway's connection, starting from
+ * MAX_OUTSTANDING and no gap: the most careful of its devices wins, and a
+ * gap means strictly one request at a time.
+ */
+void conn_pacing(const struct io_device *d, int *window, uint64_t *gap_ns)
+{
+	if (d->max_outstanding < *window)
+		*window = d->max_outstanding;
+	if ((uint64_t)d->request_gap_ms * 1000000ull > *gap_ns)
+		*gap_ns = (uint64_t)d->request_gap_ms * 1000000ull;
+	if (*window < 1 || *gap_ns)
+		*window = 1;
+
+	/* RTU is half duplex, and frames are delimited by silence */
+	if (d->serial.port[0]) {
+		*window = 1;
+		if (*gap_ns < conn_silence_ns(d))
+			*gap_ns = conn_silence_ns(d);
+	}
+}
+
+/* conn_unit - MBAP unit id of dev's requests */
+int conn_unit(const struct io_device *dev)
+{
+	return dev->unit_id > 0 ? dev->unit_id : MODBUS_TCP_SLAVE;
+}
+
+/* conn_char_ns - time one character takes on dev's serial line, 0 on TCP */
+uint64_t conn_char_ns(const struct io_device *dev)
+{
+	const struct serial_line *l = &dev->serial;
+	int bits;
+
+	if (!l->port[0] || l->baud <= 0)
+		return 0;
+	bits = 1 + l->data_bits + (l->parity != 'N') + l->stop_bits;
+	return (uint64_t)bits * 1000000000ull / (uint64_t)l->baud;
+}
+
+/*
+ * conn_silence_ns - the t3.5 silence that ends an RTU frame. Above 19200
+ * baud the spec fixes it at 1.75 ms instead of scaling with the rate.
+ */
+uint64_t conn_silence_ns(const struct io_device *dev)
+{
+	if (!dev->serial.port[0])
+		return 0;
+	if (dev->serial.baud > 19200)
+		return CONN_RTU_FAST_SILENCE_NS;
+	return conn_char_ns(dev) * 7 / 2;
+}
+
+int conn_resolve(const struct io_device *dev, struct sockaddr_storage *addr,
+		 socklen_t *len)
+{
+	struct addrinfo hints, *res;
+	char port[16];
+	int rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%d", dev->port);
+
+	rc = getaddrinfo(dev->ip, port, &hints, &res);
+	if (rc)
+		return -1;
+
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/* conn_tune - socket options every Modbus TCP connection gets */
+void conn_tune(int fd)
+{
+	int one = 1;
+	int idle = CONN_KEEPALIVE_IDLE_S;
+	int intvl = CONN_KEEPALIVE_INTVL_S;
+	int cnt = CONN_KEEPALIVE_CNT;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef TCP_KEEPIDLE
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#else
+	(void)idle;
+	(void)intvl;
+	(void)cnt;
+#endif
+}
+
+/* conn_link_error - whether err means the connection itself is gone */
+int conn_link_error(int err)
+{
+	switch (err) {
+	case ECONNRESET:
+	case ECONNREFUSED:
+	case ECONNABORTED:
+	case EPIPE:
+	case ENOTCONN:
+	case EBADF:
+	case ENETDOWN:
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+	case EIO:		/* serial adapter unplugged */
+	case ENXIO:
+	case ENODEV:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* connect_deadline - connected socket or -errno, waiting at most ms */
+static int connect_deadline(const struct sockaddr_storage *addr,
+			    socklen_t len, int ms)
+{
+	struct pollfd pfd;
+	socklen_t elen = sizeof(int);
+	int err = 0;
+	int fd, rc;
+
+	fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (const struct sockaddr *)addr, len) == 0)
+		return fd;
+	if (errno != EINPROGRESS) {
+		err = errno;
+		goto fail;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	do {
+		rc = poll(&pfd, 1, ms);
+	} while (rc < 0 && errno == EINTR);
+	if (rc == 0) {
+		err = ETIMEDOUT;
+		goto fail;
+	}
+	if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0)
+		err = errno;
+	if (!err)
+		return fd;
+
+fail:
+	close(fd);
+	return -err;
+}
+
+int conn_init(struct mb_conn *c, const struct io_device *dev, uint32_t seed)
+{
+	memset(c, 0, sizeof(*c));
+	c->dev = dev;
+	backoff_init(&c->backoff, dev, seed);
+
+	if (dev->serial.port[0]) {
+		snprintf(c->name, sizeof(c->name), "%s", dev->serial.port);
+		c->ctx = modbus_new_rtu(dev->serial.port, dev->serial.baud,
+					dev->serial.parity,
+					dev->serial.data_bits,
+					dev->serial.stop_bits);
+		if (!c->ctx)
+			return -1;
+		return 0;
+	}
+
+	/* libmodbus only gets the socket connected here, never connects */
+	snprintf(c->name, sizeof(c->name), "%s:%d", dev->ip, dev->port);
+	c->ctx = modbus_new_tcp(dev->ip, dev->port);
+	if (!c->ctx)
+		return -1;
+	if (dev->unit_id > 0)
+		modbus_set_slave(c->ctx, dev->unit_id);
+	return 0;
+}
+
+/*
+ * conn_get - the connected context, connecting first when down and the
+ * backoff allows. NULL means skip this cycle.
+ */
+modbus_t *conn_get(struct mb_conn *c, uint64_t now)
+{
+	int fd;
+
+	if (c->up)
+		return c->ctx;
+	if (now < c->backoff.retry_ns)
+		return NULL;
+
+	/* libmodbus opens and configures the serial line itself */
+	if (c->dev->serial.port[0]) {
+		fd = modbus_connect(c->ctx) ? -(errno ? errno : EIO) : 0;
+	} else if (!c->addrlen && conn_resolve(c->dev, &c->addr, &c->addrlen)) {
+		c->addrlen = 0;
+		fd = -EHOSTUNREACH;
+	} else {
+		fd = connect_deadline(&c->addr, c->addrlen,
+				      CONN_CONNECT_TIMEOUT_MS);
+	}
+
+	if (fd < 0) {
+		uint64_t d = backoff_failed(&c->backoff, now);
+
+		/* one line per outage, not one per attempt */
+		if (c->backoff.failures == 1)
+			fprintf(stderr, "[CONN] %s connect failed: %s, retrying in %llu ms\n",
+				c->name, strerror(-fd),
+				(unsigned long long)(d / 1000000));
+		return NULL;
+	}
+
+	if (!c->dev->serial.port[0]) {
+		conn_tune(fd);
+		modbus_set_socket(c->ctx, fd);
+	}
+	c->up = 1;
+	c->silent = 0;
+	return c->ctx;
+}
+
+/*
+ * conn_cycle_done - account a poll cycle: answered when any block got a
+ * response, link_err when a request failed with conn_link_error(). Drops
+ * the connection when it looks dead; the next conn_get() reconnects once
+ * the backoff allows.
+ */
+void conn_cycle_done(struct mb_conn *c, int answered, int link_err,
+		     uint64_t now)
+{
+	if (!c->up)
+		return;
+
+	if (answered) {
+		if (c->backoff.failures)
+			fprintf(stderr, "[CONN] %s back after %u failures\n",
+				c->name, c->backoff.failures);
+		c->silent = 0;
+		backoff_reset(&c->backoff);
+		return;
+	}
+
+	if (!link_err && ++c->silent < CONN_SILENT_CYCLES)
+		return;
+
+	if (!c->backoff.failures)
+		fprintf(stderr, "[CONN] %s link lost, reconnecting\n",
+			c->name);
+	modbus_close(c->ctx);
+	c->up = 0;
+	backoff_failed(&c->backoff, now);
+}
+
+void conn_free(struct mb_conn *c)
+{
+	if (c->ctx) {
+		if (c->up)
+			modbus_close(c->ctx);
+		modbus_free(c->ctx);
+	}
+	memset(c, 0, sizeof(*c));
+}
@@ -1,122 +1,689 @@
+/*
+ * dataq.c - publish queue between the poll engines and the mqtt thread.
+ *
+ * One bounded lock-free ring (per-slot sequence numbers, Vyukov style)
+ * per priority lane:
+ *  - any number of producers claim slots with a CAS on the tail
+ *  - the mqtt thread consumes from the head; the head is claimed with a
+ *    CAS as well so a producer can evict the oldest entry when full
+ *  - head and tail live on their own cache lines so producers and the
+ *    consumer do not false-share
+ * Sleeping is done on futex words that are only touched, with the
+ * syscall, when somebody is actually waiting, and a sleeping consumer is
+ * woken by one push only, so the fast path is lock and syscall free.
+ *
+ * Lanes are served in strict priority order, so a control message waits
+ * for at most the publish in progress no matter how deep the telemetry
+ * and bulk lanes are. A lower lane that has been passed over
+ * Q_STARVE_LIMIT times while non-empty is served once out of turn.
+ *
+ * Slots carry pooled msg_buf references (see msgpool.c), so a payload
+ * serialized by a poller reaches the mqtt thread without being copied.
+ *
+ * Overflow policy (set at init, per lane):
+ *  - block: producers sleep until there is room (the historic behaviour)
+ *  - drop_oldest / drop_newest: producers never wait, the evicted or
+ *    rejected message is counted and released
+ *  - conflate: each topic owns a "latest" pointer in an open addressed
+ *    table keyed by a 64-bit FNV-1a hash of the topic. Only the first
+ *    message of a topic takes a ring slot; later ones replace the pending
+ *    message in place until the mqtt thread picks it up, so the ring
+ *    holds at most one entry per topic and never fills. The control lane
+ *    never conflates, it falls back to drop_oldest.
+ */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "dataq.h"
 
+#define CACHE_LINE	64
+#define Q_NO_TOPIC	UINT_MAX
+
 struct queue_item {
-	char *topic;
-	char *payload;
+	atomic_size_t seq;
+	struct msg_buf *msg;	/* NULL for a conflated entry */
+	unsigned int topic;	/* conflation table index */
+};
+
+/*
+ * a futex word plus the number of threads sleeping on it; for q_not_empty,
+ * slept on by the consumer alone, waiters is a 0/1 flag
+ */
+struct q_waitq {
+	_Alignas(CACHE_LINE) atomic_uint word;
+	atomic_int waiters;
+};
+
+struct q_topic {
+	_Atomic uint64_t key;			/* topic hash, 0 = free */
+	_Atomic(struct msg_buf *) latest;	/* pending message */
+};
+
+struct q_lane {
+	struct queue_item *buf;
+	struct q_topic *topics;	/* conflate only */
+	size_t mask;
+	int policy;
+	unsigned int passed;	/* consumer only, see q_pop_next() */
+	_Alignas(CACHE_LINE) atomic_size_t head;
+	_Alignas(CACHE_LINE) atomic_size_t tail;
+	struct q_waitq not_full;
+};
+
+struct q_counters {
+	_Alignas(CACHE_LINE) atomic_uint_fast64_t enqueued;
+	atomic_uint_fast64_t dropped_oldest;
+	atomic_uint_fast64_t dropped_newest;
+	atomic_uint_fast64_t conflated;
+	atomic_uint_fast64_t starved;
+};
+
+static const char *const overflow_names[] = {
+	[Q_OVERFLOW_BLOCK] = "block",
+	[Q_OVERFLOW_DROP_OLDEST] = "drop_oldest",
+	[Q_OVERFLOW_DROP_NEWEST] = "drop_newest",
+	[Q_OVERFLOW_CONFLATE] = "conflate",
 };
 
-static struct queue_item *queue_buf;
-static size_t q_head;
-static size_t q_tail;
-static size_t q_cap;
-static int q_running;
-static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t q_not_empty = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t q_not_full = PTHREAD_COND_INITIALIZER;
+static struct q_lane q_lanes[Q_PRIO_COUNT];
+static int q_ready;
+static int q_policy;
+static _Alignas(CACHE_LINE) atomic_int q_running;
+static struct q_waitq q_not_empty;
+static struct q_counters q_stats;
+
+int q_overflow_from_str(const char *s)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(overflow_names) / sizeof(overflow_names[0]); i++)
+		if (strcmp(s, overflow_names[i]) == 0)
+			return (int)i;
+	return -1;
+}
+
+const char *q_overflow_str(int policy)
+{
+	if (policy < 0 ||
+	    policy >= (int)(sizeof(overflow_names) / sizeof(overflow_names[0])))
+		return "unknown";
+	return overflow_names[policy];
+}
+
+static void q_wait(struct q_waitq *wq, unsigned int seen,
+		   const struct timespec *timeout)
+{
+	syscall(SYS_futex, (unsigned int *)&wq->word, FUTEX_WAIT_PRIVATE,
+		seen, timeout, NULL, 0);
+}
+
+static void q_wake(struct q_waitq *wq, int nr)
+{
+	atomic_fetch_add(&wq->word, 1);
+	if (atomic_load(&wq->waiters))
+		syscall(SYS_futex, (unsigned int *)&wq->word,
+			FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/*
+ * q_wake_consumer - wake the mqtt thread after a push. It is the only
+ * thread sleeping on q_not_empty and sets its waiters to 1 before it
+ * does; the first producer to see that claims it and makes the syscall,
+ * the pushes after it leave the futex alone until the consumer sleeps
+ * again. The fence orders the slot just published before the check; the
+ * consumer sets waiters before looking for slots, so one of the two sees
+ * the other.
+ */
+static void q_wake_consumer(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&q_not_empty.waiters, memory_order_relaxed) ||
+	    !atomic_exchange(&q_not_empty.waiters, 0))
+		return;
+	atomic_fetch_add(&q_not_empty.word, 1);
+	syscall(SYS_futex, (unsigned int *)&q_not_empty.word,
+		FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static uint64_t topic_hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ull;
+	}
+	return h ? h : 1;
+}
+
+/*
+ * q_topic_index - conflation slot for topic, claimed on first use.
+ * Returns Q_NO_TOPIC when every slot belongs to another topic.
+ */
+static unsigned int q_topic_index(struct q_lane *l, const char *topic)
+{
+	uint64_t h = topic_hash(topic);
+	size_t i, n;
+
+	for (n = 0, i = h & l->mask; n <= l->mask;
+	     n++, i = (i + 1) & l->mask) {
+		uint64_t key = atomic_load_explicit(&l->topics[i].key,
+						    memory_order_acquire);
+
+		if (key == 0 &&
+		    atomic_compare_exchange_strong(&l->topics[i].key, &key, h))
+			return (unsigned int)i;
+		if (key == h)
+			return (unsigned int)i;
+	}
+	return Q_NO_TOPIC;
+}
+
+static void lane_free(struct q_lane *l)
+{
+	size_t i;
+
+	if (!l->buf)
+		return;
+
+	/* release remaining items */
+	for (i = 0; i <= l->mask; i++) {
+		msg_put(l->buf[i].msg);
+		if (l->topics)
+			msg_put(atomic_load(&l->topics[i].latest));
+	}
 
-int data_queue_init(size_t capacity)
+	free(l->topics);
+	free(l->buf);
+	l->topics = NULL;
+	l->buf = NULL;
+}
+
+static int lane_init(struct q_lane *l, size_t cap, int policy)
 {
-	if (capacity == 0)
+	size_t i;
+
+	l->buf = calloc(cap, sizeof(*l->buf));
+	if (!l->buf)
 		return -1;
 
-	queue_buf = calloc(capacity, sizeof(*queue_buf));
-	if (!queue_buf)
+	if (policy == Q_OVERFLOW_CONFLATE) {
+		/* one topic slot per ring slot keeps the ring from filling */
+		l->topics = calloc(cap, sizeof(*l->topics));
+		if (!l->topics) {
+			free(l->buf);
+			l->buf = NULL;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < cap; i++)
+		atomic_init(&l->buf[i].seq, i);
+
+	l->mask = cap - 1;
+	l->policy = policy;
+	l->passed = 0;
+	atomic_store(&l->head, 0);
+	atomic_store(&l->tail, 0);
+	return 0;
+}
+
+int data_queue_init(size_t capacity, int policy)
+{
+	size_t cap = 1;
+	int i;
+
+	if (capacity == 0 || policy < Q_OVERFLOW_BLOCK ||
+	    policy > Q_OVERFLOW_CONFLATE)
 		return -1;
 
-	q_cap = capacity;
-	q_head = 0;
-	q_tail = 0;
-	q_running = 1;
+	/* slot index is pos & mask, so round up to a power of two */
+	while (cap < capacity)
+		cap <<= 1;
+
+	for (i = 0; i < Q_PRIO_COUNT; i++) {
+		int lp = policy;
+
+		if (i == Q_PRIO_CONTROL && policy == Q_OVERFLOW_CONFLATE)
+			lp = Q_OVERFLOW_DROP_OLDEST;
+
+		if (lane_init(&q_lanes[i], cap, lp)) {
+			while (i--)
+				lane_free(&q_lanes[i]);
+			return -1;
+		}
+	}
+
+	q_policy = policy;
+	memset(&q_stats, 0, sizeof(q_stats));
+	atomic_store(&q_running, 1);
+	q_ready = 1;
 	return 0;
 }
 
 void data_queue_destroy(void)
 {
-	size_t i;
+	int i;
 
-	if (!queue_buf)
+	if (!q_ready)
 		return;
 
-	pthread_mutex_lock(&q_lock);
-	q_running = 0;
-	pthread_cond_broadcast(&q_not_empty);
-	pthread_cond_broadcast(&q_not_full);
-	pthread_mutex_unlock(&q_lock);
+	data_queue_stop();
+
+	for (i = 0; i < Q_PRIO_COUNT; i++)
+		lane_free(&q_lanes[i]);
+	q_ready = 0;
+}
+
+/*
+ * q_try_pop - claim the oldest entry of lane l without waiting.
+ * Returns 0 on success, 1 when the lane is empty.
+ */
+static int q_try_pop(struct q_lane *l, struct msg_buf **m,
+		     unsigned int *topic)
+{
+	struct queue_item *item;
+	size_t pos;
+
+	pos = atomic_load_explicit(&l->head, memory_order_relaxed);
+	for (;;) {
+		size_t seq;
+		intptr_t dif;
+
+		item = &l->buf[pos & l->mask];
+		seq = atomic_load_explicit(&item->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&l->head, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return 1;
+		} else {
+			pos = atomic_load_explicit(&l->head, memory_order_relaxed);
+		}
+	}
+
+	*m = item->msg;
+	*topic = item->topic;
+	item->msg = NULL;
+	atomic_store_explicit(&item->seq, pos + l->mask + 1,
+			      memory_order_release);
+	return 0;
+}
+
+static int lane_empty(struct q_lane *l)
+{
+	size_t pos = atomic_load(&l->head);
+	size_t seq = atomic_load(&l->buf[pos & l->mask].seq);
+
+	return (intptr_t)seq - (intptr_t)(pos + 1) < 0;
+}
+
+static int q_empty(void)
+{
+	int i;
+
+	for (i = 0; i < Q_PRIO_COUNT; i++)
+		if (!lane_empty(&q_lanes[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * q_push - append one entry to lane l. Returns 0 when queued, 1 when the
+ * ring is full and the policy does not allow waiting or evicting, -1
+ * once the queue has been stopped.
+ */
+static int q_push(struct q_lane *l, struct msg_buf *m, unsigned int topic)
+{
+	struct queue_item *item;
+	size_t pos;
+
+	pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+	for (;;) {
+		size_t seq;
+		intptr_t dif;
+
+		if (!atomic_load_explicit(&q_running, memory_order_relaxed))
+			return -1;
+
+		item = &l->buf[pos & l->mask];
+		seq = atomic_load_explicit(&item->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&l->tail, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (dif < 0 && l->policy == Q_OVERFLOW_BLOCK) {
+			/* full: sleep until the consumer frees a slot */
+			unsigned int seen = atomic_load(&l->not_full.word);
+
+			atomic_fetch_add(&l->not_full.waiters, 1);
+			seq = atomic_load(&item->seq);
+			if ((intptr_t)seq - (intptr_t)pos < 0 &&
+			    atomic_load(&q_running))
+				q_wait(&l->not_full, seen, NULL);
+			atomic_fetch_sub(&l->not_full.waiters, 1);
+			pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+		} else if (dif < 0 && l->policy == Q_OVERFLOW_DROP_OLDEST) {
+			struct msg_buf *old;
+			unsigned int t;
+
+			/* full: evict from the head, racing the consumer */
+			if (q_try_pop(l, &old, &t) == 0) {
+				msg_put(old);
+				atomic_fetch_add_explicit(&q_stats.dropped_oldest,
+						1, memory_order_relaxed);
+			}
+			pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+		} else if (dif < 0) {
+			return 1;
+		} else {
+			pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+		}
+	}
 
-	/* free remaining items */
-	for (i = 0; i < q_cap; i++) {
-		free(queue_buf[i].topic);
-		free(queue_buf[i].payload);
+	item->msg = m;
+	item->topic = topic;
+	atomic_store_explicit(&item->seq, pos + 1, memory_order_release);
+
+	q_wake_consumer();
+	return 0;
+}
+
+/*
+ * q_conflate - replace the pending message of m's topic, or queue the
+ * topic when nothing is pending. Always consumes m.
+ */
+static void q_conflate(struct q_lane *l, struct msg_buf *m)
+{
+	struct msg_buf *old;
+	unsigned int t;
+
+	t = q_topic_index(l, m->topic);
+	if (t == Q_NO_TOPIC) {
+		msg_put(m);
+		atomic_fetch_add_explicit(&q_stats.dropped_newest, 1,
+					  memory_order_relaxed);
+		return;
+	}
+
+	old = atomic_exchange(&l->topics[t].latest, m);
+	if (old) {
+		/* the topic already has a ring entry that will pick up m */
+		msg_put(old);
+		atomic_fetch_add_explicit(&q_stats.conflated, 1,
+					  memory_order_relaxed);
+		return;
 	}
 
-	free(queue_buf);
-	queue_buf = NULL;
+	/*
+	 * A topic has at most one ring entry and there are as many topic
+	 * slots as ring slots, so this only fails after data_queue_stop();
+	 * m then stays in the table until data_queue_destroy().
+	 */
+	q_push(l, NULL, t);
 }
 
-int data_queue_enqueue(const char *topic, const char *payload)
+/*
+ * data_queue_enqueue_msg - hand m to the lane for prio. On success the
+ * queue owns the caller's reference, including when the overflow policy
+ * discards it; on failure (queue stopped) the caller still does.
+ */
+int data_queue_enqueue_msg(struct msg_buf *m, int prio)
 {
-	size_t next;
+	struct q_lane *l;
+	int rc;
 
-	if (!topic || !payload || !queue_buf)
+	if (!m || !q_ready || prio < 0 || prio >= Q_PRIO_COUNT)
 		return -1;
 
-	pthread_mutex_lock(&q_lock);
+	if (!atomic_load_explicit(&q_running, memory_order_relaxed))
+		return -1;
+
+	l = &q_lanes[prio];
+	m->prio = prio;
+	atomic_fetch_add_explicit(&q_stats.enqueued, 1, memory_order_relaxed);
+
+	if (l->policy == Q_OVERFLOW_CONFLATE) {
+		q_conflate(l, m);
+		return 0;
+	}
+
+	rc = q_push(l, m, Q_NO_TOPIC);
+	if (rc == 1) {
+		msg_put(m);
+		atomic_fetch_add_explicit(&q_stats.dropped_newest, 1,
+					  memory_order_relaxed);
+		return 0;
+	}
+	return rc;
+}
+
+int data_queue_enqueue(const char *topic, const char *payload, int prio)
+{
+	struct msg_buf *m;
+
+	if (!topic || !payload || !q_ready)
+		return -1;
 
-	/* wait until not full or stopped */
-	next = (q_tail + 1) % q_cap;
-	while (next == q_head && q_running)
-		pthread_cond_wait(&q_not_full, &q_lock);
+	m = msg_from_strings(topic, payload);
+	if (!m)
+		return -1;
 
-	if (!q_running) {
-		pthread_mutex_unlock(&q_lock);
+	if (data_queue_enqueue_msg(m, prio)) {
+		msg_put(m);
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * q_pop_lane - take one message from lane l, resolving conflated entries.
+ * Returns 0 with *m set, 1 when the lane had nothing to give. Slots freed
+ * are added to *freed; the caller wakes producers once per batch.
+ */
+static int q_pop_lane(struct q_lane *l, struct msg_buf **m,
+		      unsigned int *freed)
+{
+	struct msg_buf *msg;
+	unsigned int topic;
+
+	while (q_try_pop(l, &msg, &topic) == 0) {
+		(*freed)++;
+		if (!msg)
+			msg = atomic_exchange(&l->topics[topic].latest, NULL);
+		if (msg) {
+			*m = msg;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * q_pop_next - strict priority with a starvation guard: every pop from a
+ * higher lane counts against each non-empty lower lane, and a lane that
+ * reaches Q_STARVE_LIMIT is served next.
+ */
+static int q_pop_next(struct msg_buf **m, unsigned int *freed)
+{
+	int i, from = -1;
+
+	for (i = Q_PRIO_COUNT - 1; i > 0 && from < 0; i--) {
+		if (q_lanes[i].passed < Q_STARVE_LIMIT ||
+		    q_pop_lane(&q_lanes[i], m, &freed[i]))
+			continue;
+		from = i;
+		atomic_fetch_add_explicit(&q_stats.starved, 1,
+					  memory_order_relaxed);
+	}
 
-	queue_buf[q_tail].topic = strdup(topic);
-	queue_buf[q_tail].payload = strdup(payload);
-	q_tail = next;
+	for (i = 0; i < Q_PRIO_COUNT && from < 0; i++)
+		if (q_pop_lane(&q_lanes[i], m, &freed[i]) == 0)
+			from = i;
 
-	pthread_cond_signal(&q_not_empty);
-	pthread_mutex_unlock(&q_lock);
+	if (from < 0)
+		return 1;
+
+	q_lanes[from].passed = 0;
+	for (i = from + 1; i < Q_PRIO_COUNT; i++)
+		if (!lane_empty(&q_lanes[i]))
+			q_lanes[i].passed++;
 	return 0;
 }
 
-int data_queue_dequeue(char **topic, char **payload)
+/*
+ * data_queue_dequeue_batch - take up to n messages in priority order,
+ * waiting at most timeout_ms (forever when negative) for the first one.
+ * Producers blocked on a full lane are woken once for the whole batch.
+ * Returns the number of messages stored in v, the caller owning each
+ * reference, -ETIMEDOUT when nothing arrived in time (possibly early on a
+ * spurious wakeup), or -1 once the queue is stopped and empty.
+ */
+int data_queue_dequeue_batch(struct msg_buf **v, size_t n, int timeout_ms)
 {
-	if (!topic || !payload || !queue_buf)
+	unsigned int freed[Q_PRIO_COUNT];
+	struct timespec ts;
+	int waited = 0;
+
+	if (!v || !n || !q_ready)
 		return -1;
 
-	pthread_mutex_lock(&q_lock);
-	while (q_head == q_tail && q_running)
-		pthread_cond_wait(&q_not_empty, &q_lock);
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
 
-	if (!q_running && q_head == q_tail) {
-		pthread_mutex_unlock(&q_lock);
-		return -1;
+	for (;;) {
+		unsigned int seen;
+		size_t got = 0;
+		int i;
+
+		memset(freed, 0, sizeof(freed));
+		while (got < n && q_pop_next(&v[got], freed) == 0)
+			got++;
+
+		for (i = 0; i < Q_PRIO_COUNT; i++)
+			if (freed[i])
+				q_wake(&q_lanes[i].not_full, (int)freed[i]);
+		if (got)
+			return (int)got;
+
+		if (!atomic_load(&q_running))
+			return -1;
+		if (waited && timeout_ms >= 0)
+			return -ETIMEDOUT;
+
+		/* empty: sleep until a producer publishes a slot */
+		seen = atomic_load(&q_not_empty.word);
+		atomic_store(&q_not_empty.waiters, 1);
+		if (q_empty() && atomic_load(&q_running))
+			q_wait(&q_not_empty, seen,
+			       timeout_ms >= 0 ? &ts : NULL);
+		atomic_store(&q_not_empty.waiters, 0);
+		waited = 1;
 	}
+}
+
+/*
+ * data_queue_dequeue_msg_timed - data_queue_dequeue_batch() for a single
+ * message; returns 0 with *m set.
+ */
+int data_queue_dequeue_msg_timed(struct msg_buf **m, int timeout_ms)
+{
+	int rc = data_queue_dequeue_batch(m, 1, timeout_ms);
+
+	return rc == 1 ? 0 : rc;
+}
 
-	*topic = queue_buf[q_head].topic;
-	*payload = queue_buf[q_head].payload;
-	queue_buf[q_head].topic = NULL;
-	queue_buf[q_head].payload = NULL;
-	q_head = (q_head + 1) % q_cap;
+int data_queue_dequeue_msg(struct msg_buf **m)
+{
+	return data_queue_dequeue_msg_timed(m, -1);
+}
+
+int data_queue_dequeue(char **topic, char **payload)
+{
+	struct msg_buf *m;
 
-	pthread_cond_signal(&q_not_full);
-	pthread_mutex_unlock(&q_lock);
+	if (!topic || !payload)
+		return -1;
+
+	if (data_queue_dequeue_msg(&m))
+		return -1;
+
+	*topic = strdup(m->topic);
+	*payload = strdup(m->data);
+	msg_put(m);
+	if (!*topic || !*payload) {
+		free(*topic);
+		free(*payload);
+		return -1;
+	}
 	return 0;
 }
 
 void data_queue_stop(void)
 {
-	pthread_mutex_lock(&q_lock);
-	q_running = 0;
-	pthread_cond_broadcast(&q_not_empty);
-	pthread_cond_broadcast(&q_not_full);
-	pthread_mutex_unlock(&q_lock);
+	int i;
+
+	atomic_store(&q_running, 0);
+	q_wake(&q_not_empty, INT_MAX);
+	for (i = 0; i < Q_PRIO_COUNT; i++)
+		q_wake(&q_lanes[i].not_full, INT_MAX);
+}
+
+/*
+ * data_queue_depth - entries queued in lane prio; a snapshot that may be
+ * stale by the time it is used.
+ */
+size_t data_queue_depth(int prio)
+{
+	struct q_lane *l;
+	size_t head, tail;
+
+	if (!q_ready || prio < 0 || prio >= Q_PRIO_COUNT)
+		return 0;
+
+	l = &q_lanes[prio];
+	head = atomic_load_explicit(&l->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&l->tail, memory_order_relaxed);
+	return tail > head ? tail - head : 0;
+}
+
+/* data_queue_capacity - slots per lane */
+size_t data_queue_capacity(void)
+{
+	return q_ready ? q_lanes[0].mask + 1 : 0;
 }
 
+int data_queue_policy(void)
+{
+	return q_policy;
+}
+
+void data_queue_get_stats(struct queue_stats *st)
+{
+	st->enqueued = atomic_load_explicit(&q_stats.enqueued,
+					    memory_order_relaxed);
+	st->dropped_oldest = atomic_load_explicit(&q_stats.dropped_oldest,
+						  memory_order_relaxed);
+	st->dropped_newest = atomic_load_explicit(&q_stats.dropped_newest,
+						  memory_order_relaxed);
+	st->conflated = atomic_load_explicit(&q_stats.conflated,
+					     memory_order_relaxed);
+	st->starved = atomic_load_explicit(&q_stats.starved,
+					   memory_order_relaxed);
+}
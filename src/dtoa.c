@@ -0,0 +1,596 @@
+/*
+ * dtoa.c - double to decimal text for the telemetry path.
+ *
+ * dtoa_shortest() prints the fewest digits that read back as the same
+ * double, using Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers", PLDI 2010) on 64-bit integer arithmetic.
+ * Grisu2 always round-trips and is shortest for all but a tiny fraction
+ * of inputs, where it may emit one digit more. Integral values skip it
+ * entirely. The layout follows %g: scientific notation only when the
+ * decimal exponent is below -4 or at least 17. dtoa_cjson() prints what
+ * cJSON_PrintUnformatted() would, from the same digits where they settle
+ * it and through printf where they do not. dtoa_shortest_float() runs
+ * the same algorithm with the neighbours of a float, so float32 registers
+ * print as 23.45 rather than as the double 23.450000762939453.
+ *
+ * dtoa_fixed() rounds to a number of decimals and drops trailing zeros,
+ * for parameters configured with "decimals"; dtoa_round() applies the
+ * same rounding for the binary encodings.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+
+#include "dtoa.h"
+
+#define DP_SIGNIFICAND_MASK	0x000fffffffffffffull
+#define DP_HIDDEN_BIT		0x0010000000000000ull
+#define DP_EXPONENT_BIAS	1075	/* 1023 + 52 */
+#define DP_MIN_EXPONENT		(1 - DP_EXPONENT_BIAS)
+
+#define SP_SIGNIFICAND_MASK	0x007fffffu
+#define SP_HIDDEN_BIT		0x00800000u
+#define SP_EXPONENT_BIAS	150	/* 127 + 23 */
+#define SP_MIN_EXPONENT		(1 - SP_EXPONENT_BIAS)
+
+#define EXACT_INT_LIMIT		9007199254740992.0	/* 2^53 */
+
+/* do-it-yourself floating point: f * 2^e */
+struct diyfp {
+	uint64_t f;
+	int e;
+};
+
+/* normalized 10^k for k = -348, -340, ..., 340 */
+static const struct diyfp cached_pow10[] = {
+	{ 0xfa8fd5a0081c0288ull, -1220 },	/* 1e-348 */
+	{ 0xbaaee17fa23ebf76ull, -1193 },	/* 1e-340 */
+	{ 0x8b16fb203055ac76ull, -1166 },	/* 1e-332 */
+	{ 0xcf42894a5dce35eaull, -1140 },	/* 1e-324 */
+	{ 0x9a6bb0aa55653b2dull, -1113 },	/* 1e-316 */
+	{ 0xe61acf033d1a45dfull, -1087 },	/* 1e-308 */
+	{ 0xab70fe17c79ac6caull, -1060 },	/* 1e-300 */
+	{ 0xff77b1fcbebcdc4full, -1034 },	/* 1e-292 */
+	{ 0xbe5691ef416bd60cull, -1007 },	/* 1e-284 */
+	{ 0x8dd01fad907ffc3cull,  -980 },	/* 1e-276 */
+	{ 0xd3515c2831559a83ull,  -954 },	/* 1e-268 */
+	{ 0x9d71ac8fada6c9b5ull,  -927 },	/* 1e-260 */
+	{ 0xea9c227723ee8bcbull,  -901 },	/* 1e-252 */
+	{ 0xaecc49914078536dull,  -874 },	/* 1e-244 */
+	{ 0x823c12795db6ce57ull,  -847 },	/* 1e-236 */
+	{ 0xc21094364dfb5637ull,  -821 },	/* 1e-228 */
+	{ 0x9096ea6f3848984full,  -794 },	/* 1e-220 */
+	{ 0xd77485cb25823ac7ull,  -768 },	/* 1e-212 */
+	{ 0xa086cfcd97bf97f4ull,  -741 },	/* 1e-204 */
+	{ 0xef340a98172aace5ull,  -715 },	/* 1e-196 */
+	{ 0xb23867fb2a35b28eull,  -688 },	/* 1e-188 */
+	{ 0x84c8d4dfd2c63f3bull,  -661 },	/* 1e-180 */
+	{ 0xc5dd44271ad3cdbaull,  -635 },	/* 1e-172 */
+	{ 0x936b9fcebb25c996ull,  -608 },	/* 1e-164 */
+	{ 0xdbac6c247d62a584ull,  -582 },	/* 1e-156 */
+	{ 0xa3ab66580d5fdaf6ull,  -555 },	/* 1e-148 */
+	{ 0xf3e2f893dec3f126ull,  -529 },	/* 1e-140 */
+	{ 0xb5b5ada8aaff80b8ull,  -502 },	/* 1e-132 */
+	{ 0x87625f056c7c4a8bull,  -475 },	/* 1e-124 */
+	{ 0xc9bcff6034c13053ull,  -449 },	/* 1e-116 */
+	{ 0x964e858c91ba2655ull,  -422 },	/* 1e-108 */
+	{ 0xdff9772470297ebdull,  -396 },	/* 1e-100 */
+	{ 0xa6dfbd9fb8e5b88full,  -369 },	/* 1e-92 */
+	{ 0xf8a95fcf88747d94ull,  -343 },	/* 1e-84 */
+	{ 0xb94470938fa89bcfull,  -316 },	/* 1e-76 */
+	{ 0x8a08f0f8bf0f156bull,  -289 },	/* 1e-68 */
+	{ 0xcdb02555653131b6ull,  -263 },	/* 1e-60 */
+	{ 0x993fe2c6d07b7facull,  -236 },	/* 1e-52 */
+	{ 0xe45c10c42a2b3b06ull,  -210 },	/* 1e-44 */
+	{ 0xaa242499697392d3ull,  -183 },	/* 1e-36 */
+	{ 0xfd87b5f28300ca0eull,  -157 },	/* 1e-28 */
+	{ 0xbce5086492111aebull,  -130 },	/* 1e-20 */
+	{ 0x8cbccc096f5088ccull,  -103 },	/* 1e-12 */
+	{ 0xd1b71758e219652cull,   -77 },	/* 1e-4 */
+	{ 0x9c40000000000000ull,   -50 },	/* 1e4 */
+	{ 0xe8d4a51000000000ull,   -24 },	/* 1e12 */
+	{ 0xad78ebc5ac620000ull,     3 },	/* 1e20 */
+	{ 0x813f3978f8940984ull,    30 },	/* 1e28 */
+	{ 0xc097ce7bc90715b3ull,    56 },	/* 1e36 */
+	{ 0x8f7e32ce7bea5c70ull,    83 },	/* 1e44 */
+	{ 0xd5d238a4abe98068ull,   109 },	/* 1e52 */
+	{ 0x9f4f2726179a2245ull,   136 },	/* 1e60 */
+	{ 0xed63a231d4c4fb27ull,   162 },	/* 1e68 */
+	{ 0xb0de65388cc8ada8ull,   189 },	/* 1e76 */
+	{ 0x83c7088e1aab65dbull,   216 },	/* 1e84 */
+	{ 0xc45d1df942711d9aull,   242 },	/* 1e92 */
+	{ 0x924d692ca61be758ull,   269 },	/* 1e100 */
+	{ 0xda01ee641a708deaull,   295 },	/* 1e108 */
+	{ 0xa26da3999aef774aull,   322 },	/* 1e116 */
+	{ 0xf209787bb47d6b85ull,   348 },	/* 1e124 */
+	{ 0xb454e4a179dd1877ull,   375 },	/* 1e132 */
+	{ 0x865b86925b9bc5c2ull,   402 },	/* 1e140 */
+	{ 0xc83553c5c8965d3dull,   428 },	/* 1e148 */
+	{ 0x952ab45cfa97a0b3ull,   455 },	/* 1e156 */
+	{ 0xde469fbd99a05fe3ull,   481 },	/* 1e164 */
+	{ 0xa59bc234db398c25ull,   508 },	/* 1e172 */
+	{ 0xf6c69a72a3989f5cull,   534 },	/* 1e180 */
+	{ 0xb7dcbf5354e9beceull,   561 },	/* 1e188 */
+	{ 0x88fcf317f22241e2ull,   588 },	/* 1e196 */
+	{ 0xcc20ce9bd35c78a5ull,   614 },	/* 1e204 */
+	{ 0x98165af37b2153dfull,   641 },	/* 1e212 */
+	{ 0xe2a0b5dc971f303aull,   667 },	/* 1e220 */
+	{ 0xa8d9d1535ce3b396ull,   694 },	/* 1e228 */
+	{ 0xfb9b7cd9a4a7443cull,   720 },	/* 1e236 */
+	{ 0xbb764c4ca7a44410ull,   747 },	/* 1e244 */
+	{ 0x8bab8eefb6409c1aull,   774 },	/* 1e252 */
+	{ 0xd01fef10a657842cull,   800 },	/* 1e260 */
+	{ 0x9b10a4e5e9913129ull,   827 },	/* 1e268 */
+	{ 0xe7109bfba19c0c9dull,   853 },	/* 1e276 */
+	{ 0xac2820d9623bf429ull,   880 },	/* 1e284 */
+	{ 0x80444b5e7aa7cf85ull,   907 },	/* 1e292 */
+	{ 0xbf21e44003acdd2dull,   933 },	/* 1e300 */
+	{ 0x8e679c2f5e44ff8full,   960 },	/* 1e308 */
+	{ 0xd433179d9c8cb841ull,   986 },	/* 1e316 */
+	{ 0x9e19db92b4e31ba9ull,  1013 },	/* 1e324 */
+	{ 0xeb96bf6ebadf77d9ull,  1039 },	/* 1e332 */
+	{ 0xaf87023b9bf0ee6bull,  1066 },	/* 1e340 */
+};
+
+static const uint32_t pow10_32[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000
+};
+
+static const uint64_t pow10_64[] = {
+	1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+	10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+	100000000000ull, 1000000000000ull, 10000000000000ull,
+	100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+	100000000000000000ull, 1000000000000000000ull,
+	10000000000000000000ull
+};
+
+/* 10^k as exact doubles, for reading 15 digits back without strtod() */
+static const double pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+	1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static struct diyfp diy_from_double(double d)
+{
+	struct diyfp r;
+	uint64_t u;
+	int biased;
+
+	memcpy(&u, &d, sizeof(u));
+	biased = (int)((u >> 52) & 0x7ff);
+	r.f = u & DP_SIGNIFICAND_MASK;
+	if (biased) {
+		r.f += DP_HIDDEN_BIT;
+		r.e = biased - DP_EXPONENT_BIAS;
+	} else {
+		r.e = DP_MIN_EXPONENT;
+	}
+	return r;
+}
+
+static struct diyfp diy_from_float(float f)
+{
+	struct diyfp r;
+	uint32_t u;
+	int biased;
+
+	memcpy(&u, &f, sizeof(u));
+	biased = (int)((u >> 23) & 0xff);
+	r.f = u & SP_SIGNIFICAND_MASK;
+	if (biased) {
+		r.f += SP_HIDDEN_BIT;
+		r.e = biased - SP_EXPONENT_BIAS;
+	} else {
+		r.e = SP_MIN_EXPONENT;
+	}
+	return r;
+}
+
+static struct diyfp diy_normalize(struct diyfp x)
+{
+	while (!(x.f & 0x8000000000000000ull)) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+/* diy_mul - upper 64 bits of the 128-bit product, rounded */
+static struct diyfp diy_mul(struct diyfp x, struct diyfp y)
+{
+	const uint64_t m32 = 0xffffffffull;
+	uint64_t a = x.f >> 32, b = x.f & m32;
+	uint64_t c = y.f >> 32, d = y.f & m32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+	struct diyfp r;
+
+	tmp += 1ull << 31;
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+/*
+ * boundaries - the halfway points to the neighbouring values of a format
+ * whose hidden bit is hidden (a double's or a float's)
+ */
+static void boundaries(struct diyfp v, uint64_t hidden, struct diyfp *minus,
+		       struct diyfp *plus)
+{
+	struct diyfp pl = { (v.f << 1) + 1, v.e - 1 };
+	struct diyfp mi;
+
+	pl = diy_normalize(pl);
+
+	if (v.f == hidden) {
+		/* lower neighbour is closer: the exponent steps down */
+		mi.f = (v.f << 2) - 1;
+		mi.e = v.e - 2;
+	} else {
+		mi.f = (v.f << 1) - 1;
+		mi.e = v.e - 1;
+	}
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+
+	*minus = mi;
+	*plus = pl;
+}
+
+/* cached_power - c ~ 10^-k such that e + c.e + 64 lands in [-60, -32] */
+static struct diyfp cached_power(int e, int *k)
+{
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	int idx;
+
+	if (dk - ik > 0.0)
+		ik++;
+	idx = (ik >> 3) + 1;
+	*k = -(-348 + idx * 8);
+	return cached_pow10[idx];
+}
+
+static int count_digits(uint32_t n)
+{
+	int d = 1;
+
+	while (d < 10 && n >= pow10_32[d])
+		d++;
+	return d;
+}
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+			uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < wp_w ||
+		wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+/* digit_gen - digits of w, as few as the interval [mp - delta, mp] allows */
+static int digit_gen(struct diyfp w, struct diyfp mp, uint64_t delta,
+		     char *buf, int *k)
+{
+	int shift = -mp.e;
+	uint64_t one = 1ull << shift;
+	uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = (uint32_t)(mp.f >> shift);
+	uint64_t p2 = mp.f & (one - 1);
+	int kappa = count_digits(p1);
+	int len = 0;
+
+	while (kappa > 0) {
+		uint32_t d = p1 / pow10_32[kappa - 1];
+		uint64_t rest;
+
+		p1 %= pow10_32[kappa - 1];
+		if (d || len)
+			buf[len++] = (char)('0' + d);
+		kappa--;
+		rest = ((uint64_t)p1 << shift) + p2;
+		if (rest <= delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, rest,
+				    (uint64_t)pow10_32[kappa] << shift, wp_w);
+			return len;
+		}
+	}
+
+	for (;;) {
+		uint32_t d;
+
+		p2 *= 10;
+		delta *= 10;
+		d = (uint32_t)(p2 >> shift);
+		if (d || len)
+			buf[len++] = (char)('0' + d);
+		p2 &= one - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			grisu_round(buf, len, delta, p2, one,
+				    -kappa < 20 ? wp_w * pow10_64[-kappa] : 0);
+			return len;
+		}
+	}
+}
+
+/* grisu2 - shortest digits of w > 0; w == digits * 10^k */
+static int grisu2(struct diyfp w, uint64_t hidden, char *digits, int *k)
+{
+	struct diyfp wm, wp, c, W, Wm, Wp;
+
+	boundaries(w, hidden, &wm, &wp);
+	c = cached_power(wp.e, k);
+	W = diy_mul(diy_normalize(w), c);
+	Wp = diy_mul(wp, c);
+	Wm = diy_mul(wm, c);
+	Wm.f++;
+	Wp.f--;
+	return digit_gen(W, Wp, Wp.f - Wm.f, digits, k);
+}
+
+static int utoa64(uint64_t u, char *buf)
+{
+	char tmp[20];
+	int n = 0, i;
+
+	do {
+		tmp[n++] = (char)('0' + u % 10);
+		u /= 10;
+	} while (u);
+	for (i = 0; i < n; i++)
+		buf[i] = tmp[n - 1 - i];
+	return n;
+}
+
+/*
+ * layout - place the decimal point the way %g with the given precision
+ * would
+ */
+static int layout(const char *digits, int len, int k, int precision,
+		  char *buf)
+{
+	int exp10 = len + k - 1;
+	char *p = buf;
+
+	if (exp10 < -4 || exp10 >= precision) {
+		*p++ = digits[0];
+		if (len > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, len - 1);
+			p += len - 1;
+		}
+		*p++ = 'e';
+		*p++ = exp10 < 0 ? '-' : '+';
+		if (exp10 < 0)
+			exp10 = -exp10;
+		if (exp10 < 10)
+			*p++ = '0';
+		p += utoa64((uint64_t)exp10, p);
+	} else if (k >= 0) {
+		memcpy(p, digits, len);
+		p += len;
+		memset(p, '0', k);
+		p += k;
+	} else if (exp10 >= 0) {
+		memcpy(p, digits, exp10 + 1);
+		p += exp10 + 1;
+		*p++ = '.';
+		memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+		p += len - exp10 - 1;
+	} else {
+		*p++ = '0';
+		*p++ = '.';
+		memset(p, '0', -exp10 - 1);
+		p += -exp10 - 1;
+		memcpy(p, digits, len);
+		p += len;
+	}
+	*p = '\0';
+	return (int)(p - buf);
+}
+
+/*
+ * dtoa_shortest - shortest round-trip text of a finite d into buf
+ * (DTOA_BUF_LEN bytes). Returns the length.
+ */
+int dtoa_shortest(double d, char *buf)
+{
+	char digits[20];
+	char *p = buf;
+	int len, k;
+
+	if (signbit(d) && d != 0) {
+		*p++ = '-';
+		d = -d;
+	}
+
+	/* integer fast path, also covers zero */
+	if (d < EXACT_INT_LIMIT && d == (double)(int64_t)d) {
+		p += utoa64((uint64_t)d, p);
+		*p = '\0';
+		return (int)(p - buf);
+	}
+
+	len = grisu2(diy_from_double(d), DP_HIDDEN_BIT, digits, &k);
+	return (int)(p - buf) + layout(digits, len, k, 17, p);
+}
+
+/* cjson_close - cJSON's compare_double(): equal to within DBL_EPSILON */
+static int cjson_close(double a, double b)
+{
+	double max = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+
+	return fabs(a - b) <= max * DBL_EPSILON;
+}
+
+/* cjson_printf - print_number()'s own way, for what the digits leave open */
+static int cjson_printf(double d, char *buf)
+{
+	int n = snprintf(buf, DTOA_BUF_LEN, "%1.15g", d);
+
+	if (!cjson_close(strtod(buf, NULL), d))
+		n = snprintf(buf, DTOA_BUF_LEN, "%1.17g", d);
+	return n;
+}
+
+/*
+ * dtoa_cjson - a finite d the way cJSON_PrintUnformatted() prints it: an
+ * int as one, else 15 significant digits when they read back within
+ * cJSON's epsilon, else 17. Returns the length.
+ *
+ * Grisu2's digits are within half an ulp of d, so with 15 or fewer they
+ * are d to 15 digits, and with more they round to it unless d sits that
+ * close to a tie. Ties, subnormals and 17 digit output go through printf.
+ */
+int dtoa_cjson(double d, char *buf)
+{
+	char digits[20];
+	double a = fabs(d), back;
+	uint64_t m = 0, tail = 0, half;
+	int len, k, i, slack;
+	char *p = buf;
+
+	if (d >= INT_MIN && d <= INT_MAX && d == (double)(int)d) {
+		if (d < 0)
+			*p++ = '-';
+		p += utoa64((uint64_t)a, p);
+		*p = '\0';
+		return (int)(p - buf);
+	}
+
+	/* subnormals carry fewer than 15 digits of their own */
+	if (a < DBL_MIN)
+		return cjson_printf(d, buf);
+
+	if (d < 0)
+		*p++ = '-';
+	len = grisu2(diy_from_double(a), DP_HIDDEN_BIT, digits, &k);
+	if (len <= 15)
+		return (int)(p - buf) + layout(digits, len, k, 15, p);
+	if (len > 17)
+		return cjson_printf(d, buf);
+
+	/* half an ulp is under 2 units of the 16th digit, 12 of the 17th */
+	for (i = 15; i < len; i++)
+		tail = tail * 10 + (uint64_t)(digits[i] - '0');
+	half = 5 * pow10_64[len - 16];
+	slack = len == 16 ? 2 : 12;
+	if (tail + slack >= half && tail <= half + slack)
+		return cjson_printf(d, buf);
+
+	for (i = 0; i < 15; i++)
+		m = m * 10 + (uint64_t)(digits[i] - '0');
+	k += len - 15;
+	if (tail > half && ++m == pow10_64[15]) {
+		m = pow10_64[14];
+		k++;
+	}
+
+	/* m < 2^53 and 10^|k| are exact, so this rounds as sscanf() does */
+	if (k < -22 || k > 22)
+		return cjson_printf(d, buf);
+	back = k < 0 ? (double)m / pow10_exact[-k] : (double)m * pow10_exact[k];
+	if (!cjson_close(back, a))
+		return snprintf(buf, DTOA_BUF_LEN, "%1.17g", d);
+
+	while (m % 10 == 0) {
+		m /= 10;
+		k++;
+	}
+	len = utoa64(m, digits);
+	return (int)(p - buf) + layout(digits, len, k, 15, p);
+}
+
+/* dtoa_shortest_float - shortest text that reads back as the same float */
+int dtoa_shortest_float(float f, char *buf)
+{
+	char digits[20];
+	char *p = buf;
+	int len, k;
+
+	if (signbit(f) && f != 0) {
+		*p++ = '-';
+		f = -f;
+	}
+
+	if (f < EXACT_INT_LIMIT && f == (float)(int64_t)f) {
+		p += utoa64((uint64_t)f, p);
+		*p = '\0';
+		return (int)(p - buf);
+	}
+
+	len = grisu2(diy_from_float(f), SP_HIDDEN_BIT, digits, &k);
+	return (int)(p - buf) + layout(digits, len, k, 17, p);
+}
+
+/*
+ * dtoa_fixed - d rounded to decimals places, trailing zeros dropped.
+ * Falls back to dtoa_shortest() when the scaled value is not exact.
+ */
+int dtoa_fixed(double d, int decimals, char *buf)
+{
+	double scaled;
+	uint64_t u, pw;
+	char *p = buf;
+	int i, neg;
+
+	if (decimals < 0 || decimals > DTOA_MAX_DECIMALS)
+		return dtoa_shortest(d, buf);
+
+	pw = pow10_64[decimals];
+	scaled = d * (double)pw;
+	if (!(fabs(scaled) < EXACT_INT_LIMIT))
+		return dtoa_shortest(d, buf);
+
+	neg = scaled < 0;
+	u = (uint64_t)llround(fabs(scaled));
+	if (neg && u)
+		*p++ = '-';
+
+	p += utoa64(u / pw, p);
+	u %= pw;
+	if (u) {
+		/* fractional digits, zero padded, then trailing zeros dropped */
+		while (u % 10 == 0) {
+			u /= 10;
+			decimals--;
+		}
+		*p++ = '.';
+		for (i = decimals - 1; i >= 0; i--) {
+			p[i] = (char)('0' + u % 10);
+			u /= 10;
+		}
+		p += decimals;
+	}
+	*p = '\0';
+	return (int)(p - buf);
+}
+
+/* dtoa_round - d rounded the way dtoa_fixed() prints it, as a double */
+double dtoa_round(double d, int decimals)
+{
+	double pw, scaled;
+
+	if (decimals < 0 || decimals > DTOA_MAX_DECIMALS)
+		return d;
+
+	pw = (double)pow10_64[decimals];
+	scaled = d * pw;
+	if (!(fabs(scaled) < EXACT_INT_LIMIT))
+		return d;
+	return (double)llround(scaled) / pw;
+}
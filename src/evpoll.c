@@ -0,0 +1,1018 @@
+/*
+ * evpoll.c - event-driven Modbus TCP poller, selected with
+ * "engine": "epoll" in the config.
+ *
+ *  - a small, fixed number of loop threads ("engine_threads") drive all
+ *    device sockets through epoll instead of one blocking thread each
+ *  - sockets are non-blocking; connect, send and receive are steps of a
+ *    per-device state machine
+ *  - lost links and failed connects are retried with connmgr.c's backoff,
+ *    a slot that falls before the next retry is skipped
+ *  - devices sharing an ip:port are units behind one gateway and share one
+ *    socket; a cycle serves every unit that is due, their requests
+ *    interleaved round robin and spaced by request_gap_ms
+ *  - serial (RTU) devices are left to the bus scheduler in modbus_if.c
+ *  - next-poll, connect and response deadlines live in a per-loop min-heap;
+ *    one CLOCK_MONOTONIC timerfd is armed for the earliest of them
+ *  - a request times out after its device's adaptive response timeout
+ *    (struct rtt_est), learnt from the round trips of earlier requests
+ *  - a unit that keeps not answering is quarantined by its circuit breaker
+ *    and only probed, at backed off slots, until it answers again
+ *  - requests come from the read plan of the parameters due in the slot
+ *    (see param_wheel_due()), framed by mbproto.c, with up to
+ *    max_outstanding in flight matched by transaction id
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <modbus.h>
+#include "evpoll.h"
+#include "readplan.h"
+#include "mbproto.h"
+#include "telemetry.h"
+#include "pollsched.h"
+#include "connmgr.h"
+
+#define EV_MAX_EVENTS		64
+#define EV_MAX_LOOPS		16
+#define EV_RX_BUF		(MODBUS_MAX_ADU_LENGTH * 4)
+#define EV_TX_BUF		(MAX_OUTSTANDING * MB_TCP_READ_REQ_LEN)
+
+enum ev_state {
+	EV_IDLE,
+	EV_CONNECTING,
+	EV_BUSY,
+};
+
+struct ev_pending {
+	uint16_t tid;
+	int req;
+	uint64_t sent_ns;
+	uint64_t deadline_ns;
+};
+
+/* one device, polled on its own schedule over its gateway's socket */
+struct ev_unit {
+	const struct io_device *dev;
+	struct plan_cache plans;
+	struct read_plan *plan;
+	struct param_wheel wheel;
+	struct poll_sched sched;
+	uint64_t stats_due_ns;
+	struct rtt_est rtt;
+	struct breaker breaker;
+	struct read_plan probe;
+	uint8_t unit;
+	int active;		/* has requests in the running cycle */
+};
+
+/* a request of the running cycle: one block of a unit's plan */
+struct ev_req {
+	struct ev_unit *u;
+	int block;
+};
+
+struct ev_loop;
+
+/* a socket and the units polled over it */
+struct ev_device {
+	const struct io_device *dev;	/* first unit's, for address and pacing */
+	struct ev_loop *loop;
+	struct ev_unit **units;		/* sized from the gateway's membership */
+	int unit_count;
+	int rr;				/* unit that goes first next cycle */
+	struct ev_req *reqs;
+	int req_count;
+	int req_cap;
+	int window;
+	uint64_t gap_ns;
+	uint64_t last_io_ns;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int fd;
+	int state;
+	int silent;		/* cycles in a row without an answer */
+	struct conn_backoff backoff;
+	uint32_t events;
+	uint16_t next_tid;
+	int next_req;
+	int done_reqs;
+	int npending;
+	struct ev_pending pending[MAX_OUTSTANDING];
+	int txlen;
+	int txoff;
+	int rxlen;
+	uint8_t tx[EV_TX_BUF];
+	uint8_t rx[EV_RX_BUF];
+	uint64_t wake_ns;
+	int heap_idx;
+};
+
+struct ev_loop {
+	int epfd;
+	int tfd;
+	int stopfd;
+	pthread_t thread;
+	int started;
+	int heap_len;
+	struct ev_device **heap;
+};
+
+static const struct config *global_cfg;
+static struct ev_unit *units;
+static int unit_count;
+static struct ev_device *devices;
+static int device_count;
+static struct ev_loop loops[EV_MAX_LOOPS];
+static int loop_count;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* min-heap of devices ordered by wake_ns */
+
+static void heap_swap(struct ev_loop *l, int a, int b)
+{
+	struct ev_device *t = l->heap[a];
+
+	l->heap[a] = l->heap[b];
+	l->heap[b] = t;
+	l->heap[a]->heap_idx = a;
+	l->heap[b]->heap_idx = b;
+}
+
+static void heap_fix(struct ev_loop *l, int i)
+{
+	while (i > 0 && l->heap[(i - 1) / 2]->wake_ns > l->heap[i]->wake_ns) {
+		heap_swap(l, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		int c = 2 * i + 1;
+
+		if (c >= l->heap_len)
+			break;
+		if (c + 1 < l->heap_len &&
+		    l->heap[c + 1]->wake_ns < l->heap[c]->wake_ns)
+			c++;
+		if (l->heap[i]->wake_ns <= l->heap[c]->wake_ns)
+			break;
+		heap_swap(l, i, c);
+		i = c;
+	}
+}
+
+static void ev_set_wake(struct ev_device *d, uint64_t ns)
+{
+	d->wake_ns = ns;
+	heap_fix(d->loop, d->heap_idx);
+}
+
+static void ev_arm_timer(struct ev_loop *l)
+{
+	struct itimerspec its;
+	uint64_t ns;
+
+	memset(&its, 0, sizeof(its));
+	if (l->heap_len) {
+		/* a zero it_value disarms, so never ask for time 0 */
+		ns = l->heap[0]->wake_ns ? l->heap[0]->wake_ns : 1;
+		its.it_value.tv_sec = ns / 1000000000ull;
+		its.it_value.tv_nsec = ns % 1000000000ull;
+	}
+	timerfd_settime(l->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void ev_watch(struct ev_device *d, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (d->fd < 0 || d->events == events)
+		return;
+
+	ev.events = events;
+	ev.data.ptr = d;
+	epoll_ctl(d->loop->epfd, EPOLL_CTL_MOD, d->fd, &ev);
+	d->events = events;
+}
+
+static void ev_close(struct ev_device *d)
+{
+	if (d->fd < 0)
+		return;
+
+	epoll_ctl(d->loop->epfd, EPOLL_CTL_DEL, d->fd, NULL);
+	close(d->fd);
+	d->fd = -1;
+	d->events = 0;
+	d->txlen = 0;
+	d->txoff = 0;
+	d->rxlen = 0;
+}
+
+/*
+ * ev_unit_next - move a unit on to the next slot of its poll schedule
+ * (see pollsched.c for the overrun policies). Stats go out from here so a
+ * device that is down still reports.
+ */
+static void ev_unit_next(struct ev_device *d, struct ev_unit *u, uint64_t now)
+{
+	if (global_cfg->stats_interval_ms > 0 && now >= u->stats_due_ns) {
+		struct device_stats st;
+
+		memset(&st, 0, sizeof(st));
+		st.sched = u->sched.stats;
+		st.connected = d->fd >= 0;
+		st.connect_failures = d->backoff.total;
+		st.rtt = u->rtt;
+		st.breaker = u->breaker;
+		telemetry_publish_stats(global_cfg, u->dev, &st);
+		u->sched.stats.max_lateness_ns = 0;
+		u->stats_due_ns = now + global_cfg->stats_interval_ms * 1000000ull;
+	}
+
+	sched_next(&u->sched, now);
+	u->active = 0;
+}
+
+/* ev_idle - back to idle, woken when the first unit is due */
+static void ev_idle(struct ev_device *d)
+{
+	uint64_t due = d->units[0]->sched.due_ns;
+	int k;
+
+	for (k = 1; k < d->unit_count; k++)
+		if (d->units[k]->sched.due_ns < due)
+			due = d->units[k]->sched.due_ns;
+
+	d->state = EV_IDLE;
+	ev_set_wake(d, due);
+}
+
+/*
+ * ev_schedule_next - the due slots cannot be served (no connection yet):
+ * skip them and idle
+ */
+static void ev_schedule_next(struct ev_device *d, uint64_t now)
+{
+	int k;
+
+	for (k = 0; k < d->unit_count; k++)
+		if (d->units[k]->active || d->units[k]->sched.due_ns <= now)
+			ev_unit_next(d, d->units[k], now);
+	ev_idle(d);
+}
+
+/*
+ * ev_conn_failed - a connect failed or the link was lost: back off before
+ * the next attempt, logging once per outage.
+ */
+static void ev_conn_failed(struct ev_device *d, uint64_t now, const char *why)
+{
+	uint64_t delay = backoff_failed(&d->backoff, now);
+
+	if (d->backoff.failures == 1)
+		fprintf(stderr, "[EVPOLL] %s %s:%d, retrying in %llu ms\n", why,
+			d->dev->ip, d->dev->port,
+			(unsigned long long)(delay / 1000000));
+}
+
+static void ev_finish_cycle(struct ev_device *d, uint64_t now)
+{
+	int answered = 0;
+	int k;
+
+	for (k = 0; k < d->unit_count; k++) {
+		struct ev_unit *u = d->units[k];
+
+		if (!u->active)
+			continue;
+		/* a lost link closed the socket first, that is not the unit's fault */
+		if (d->fd >= 0 && u->plan->block_count &&
+		    breaker_done(&u->breaker, read_plan_answered(u->plan), now)) {
+			fprintf(stderr, "[EVPOLL] %s %s\n", u->dev->io_device_id,
+				breaker_state_str(u->breaker.state));
+			telemetry_publish_state(global_cfg, u->dev, &u->breaker,
+						now);
+		}
+		if (u->plan != &u->probe) {
+			read_plan_extract(u->plan);
+			telemetry_publish(global_cfg, u->dev, u->plan);
+		}
+		if (read_plan_answered(u->plan))
+			answered = 1;
+	}
+
+	/* an open connection nobody answers on is as good as lost */
+	if (answered) {
+		if (d->backoff.failures)
+			fprintf(stderr, "[EVPOLL] %s:%d back after %u failures\n",
+				d->dev->ip, d->dev->port, d->backoff.failures);
+		backoff_reset(&d->backoff);
+		d->silent = 0;
+	} else if (d->fd >= 0 && ++d->silent >= CONN_SILENT_CYCLES) {
+		ev_close(d);
+		d->silent = 0;
+		ev_conn_failed(d, now, "no answer from");
+	}
+
+	/* units that fell due meanwhile are served by the next cycle */
+	for (k = 0; k < d->unit_count; k++)
+		if (d->units[k]->active)
+			ev_unit_next(d, d->units[k], now);
+	ev_idle(d);
+}
+
+static int ev_flush_tx(struct ev_device *d)
+{
+	while (d->txoff < d->txlen) {
+		ssize_t n = send(d->fd, d->tx + d->txoff, d->txlen - d->txoff,
+				 MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		d->txoff += n;
+	}
+
+	if (d->txoff == d->txlen) {
+		d->txoff = 0;
+		d->txlen = 0;
+		ev_watch(d, EPOLLIN);
+	} else {
+		ev_watch(d, EPOLLIN | EPOLLOUT);
+	}
+	return 0;
+}
+
+/* ev_arm_response - wake at the first response deadline in flight */
+static void ev_arm_response(struct ev_device *d)
+{
+	uint64_t first = d->pending[0].deadline_ns;
+	int i;
+
+	for (i = 1; i < d->npending; i++)
+		if (d->pending[i].deadline_ns < first)
+			first = d->pending[i].deadline_ns;
+	ev_set_wake(d, first);
+}
+
+/*
+ * ev_fill_window - queue requests until the window is in flight. With a
+ * request gap the next request waits for it, woken by the timer. Bytes of
+ * requests that timed out before they went out still take up tx, so the
+ * window also waits for the flush to make room. Finishes the cycle when
+ * the last requests could not be built.
+ */
+static int ev_fill_window(struct ev_device *d, uint64_t now)
+{
+	int rc;
+
+	if (d->gap_ns && !d->npending && d->next_req < d->req_count &&
+	    now < d->last_io_ns + d->gap_ns) {
+		ev_set_wake(d, d->last_io_ns + d->gap_ns);
+		return 0;
+	}
+
+	if (d->txlen) {
+		rc = ev_flush_tx(d);
+		if (rc)
+			return rc;
+	}
+	if (d->txoff) {
+		memmove(d->tx, d->tx + d->txoff, d->txlen - d->txoff);
+		d->txlen -= d->txoff;
+		d->txoff = 0;
+	}
+
+	while (d->npending < d->window && d->next_req < d->req_count &&
+	       d->txlen + MB_TCP_READ_REQ_LEN <= (int)sizeof(d->tx)) {
+		int idx = d->next_req++;
+		struct ev_req *r = &d->reqs[idx];
+		int len;
+
+		len = mb_build_tcp_read_adu(d->tx + d->txlen, d->next_tid,
+					    r->u->unit,
+					    &r->u->plan->blocks[r->block]);
+		if (len < 0) {
+			d->done_reqs++;
+			continue;
+		}
+		d->txlen += len;
+		d->pending[d->npending].tid = d->next_tid++;
+		d->pending[d->npending].req = idx;
+		d->pending[d->npending].sent_ns = now;
+		d->pending[d->npending].deadline_ns = now + r->u->rtt.rto_ns;
+		d->npending++;
+	}
+
+	/* nothing in flight and still no room: the peer stopped reading */
+	if (!d->npending && d->next_req < d->req_count)
+		return -ETIMEDOUT;
+
+	if (d->npending)
+		ev_arm_response(d);
+
+	rc = ev_flush_tx(d);
+	if (!rc && d->done_reqs == d->req_count)
+		ev_finish_cycle(d, now);
+	return rc;
+}
+
+/*
+ * ev_fail_conn - the link is gone: every block not yet answered fails,
+ * the partial cycle is published and a later slot reconnects once the
+ * backoff allows.
+ */
+static void ev_fail_conn(struct ev_device *d, uint64_t now)
+{
+	int state = d->state;
+
+	ev_close(d);
+	d->npending = 0;
+
+	if (state == EV_BUSY)
+		ev_finish_cycle(d, now);
+	else
+		ev_schedule_next(d, now);
+	ev_conn_failed(d, now, "link lost to");
+}
+
+/*
+ * ev_queue_requests - the active units' blocks, one of each unit per
+ * round, so a unit with a long plan does not hold the others up. The unit
+ * going first rotates from cycle to cycle.
+ */
+static int ev_queue_requests(struct ev_device *d)
+{
+	int round, k, left;
+
+	d->req_count = 0;
+	for (round = 0, left = 1; left; round++) {
+		left = 0;
+		for (k = 0; k < d->unit_count; k++) {
+			struct ev_unit *u = d->units[(d->rr + k) % d->unit_count];
+
+			if (!u->active || round >= u->plan->block_count)
+				continue;
+			if (d->req_count == d->req_cap) {
+				int cap = d->req_cap ? d->req_cap * 2 : 16;
+				struct ev_req *r = realloc(d->reqs,
+							   cap * sizeof(*r));
+
+				if (!r)
+					return -1;
+				d->reqs = r;
+				d->req_cap = cap;
+			}
+			d->reqs[d->req_count].u = u;
+			d->reqs[d->req_count].block = round;
+			d->req_count++;
+			left = 1;
+		}
+	}
+	d->rr = (d->rr + 1) % d->unit_count;
+	return 0;
+}
+
+static void ev_start_cycle(struct ev_device *d, uint64_t now)
+{
+	int active = 0;
+	int i, k;
+
+	/*
+	 * only the units due now, and of those the parameters due; a
+	 * quarantined unit sends its probe when the breaker allows
+	 */
+	for (k = 0; k < d->unit_count; k++) {
+		struct ev_unit *u = d->units[k];
+		uint32_t due;
+
+		if (u->sched.due_ns > now)
+			continue;
+		switch (breaker_action(&u->breaker, now)) {
+		case BRK_POLL:
+			due = param_wheel_due(&u->wheel, u->sched.slot);
+			u->plan = due ? plan_cache_get(&u->plans, u->dev, due) :
+					NULL;
+			break;
+		case BRK_PROBE:
+			u->plan = &u->probe;
+			break;
+		default:
+			u->plan = NULL;
+			break;
+		}
+		if (!u->plan) {
+			ev_unit_next(d, u, now);
+			continue;
+		}
+		u->active = 1;
+		active++;
+	}
+	if (!active || ev_queue_requests(d)) {
+		ev_schedule_next(d, now);
+		return;
+	}
+
+	for (k = 0; k < d->unit_count; k++) {
+		struct ev_unit *u = d->units[k];
+
+		if (!u->active)
+			continue;
+		sched_begin(&u->sched, now);
+		for (i = 0; i < u->plan->block_count; i++)
+			u->plan->blocks[i].status = -1;
+	}
+
+	d->next_req = 0;
+	d->done_reqs = 0;
+	d->npending = 0;
+	d->state = EV_BUSY;
+
+	if (ev_fill_window(d, now))
+		ev_fail_conn(d, now);
+}
+
+static void ev_connect(struct ev_device *d, uint64_t now)
+{
+	struct epoll_event ev;
+	int rc;
+
+	if (!d->addrlen && conn_resolve(d->dev, &d->addr, &d->addrlen)) {
+		d->addrlen = 0;
+		ev_conn_failed(d, now, "cannot resolve");
+		ev_schedule_next(d, now);
+		return;
+	}
+
+	d->fd = socket(d->addr.ss_family,
+		       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (d->fd < 0) {
+		ev_conn_failed(d, now, "no socket for");
+		ev_schedule_next(d, now);
+		return;
+	}
+	conn_tune(d->fd);
+
+	d->events = EPOLLIN | EPOLLOUT;
+	ev.events = d->events;
+	ev.data.ptr = d;
+	if (epoll_ctl(d->loop->epfd, EPOLL_CTL_ADD, d->fd, &ev) < 0) {
+		close(d->fd);
+		d->fd = -1;
+		ev_conn_failed(d, now, "cannot watch");
+		ev_schedule_next(d, now);
+		return;
+	}
+
+	rc = connect(d->fd, (struct sockaddr *)&d->addr, d->addrlen);
+	if (rc == 0) {
+		ev_start_cycle(d, now);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		ev_close(d);
+		ev_conn_failed(d, now, "connect failed");
+		ev_schedule_next(d, now);
+		return;
+	}
+
+	d->state = EV_CONNECTING;
+	ev_set_wake(d, now + CONN_CONNECT_TIMEOUT_MS * 1000000ull);
+}
+
+static void ev_connected(struct ev_device *d, uint64_t now)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		ev_close(d);
+		ev_conn_failed(d, now, "connect failed");
+		ev_schedule_next(d, now);
+		return;
+	}
+
+	ev_start_cycle(d, now);
+}
+
+static void ev_handle_frame(struct ev_device *d, const uint8_t *frame,
+			    int len, uint64_t now)
+{
+	uint16_t tid = (uint16_t)(frame[0] << 8 | frame[1]);
+	struct ev_req *r;
+	struct read_block *b;
+	int i;
+
+	if (d->state != EV_BUSY)
+		return;
+
+	for (i = 0; i < d->npending; i++)
+		if (d->pending[i].tid == tid)
+			break;
+	if (i == d->npending)
+		return;		/* stale reply from a timed out window */
+
+	r = &d->reqs[d->pending[i].req];
+	b = &r->u->plan->blocks[r->block];
+	b->status = mb_parse_read_pdu(frame + MB_MBAP_LEN, len - MB_MBAP_LEN,
+				      b, r->u->plan);
+	rtt_sample(&r->u->rtt, now - d->pending[i].sent_ns);
+	d->pending[i] = d->pending[--d->npending];
+	d->done_reqs++;
+	d->last_io_ns = now;
+
+	if (d->done_reqs == d->req_count) {
+		ev_finish_cycle(d, now);
+		return;
+	}
+	if (ev_fill_window(d, now))
+		ev_fail_conn(d, now);
+}
+
+static int ev_read(struct ev_device *d, uint64_t now)
+{
+	for (;;) {
+		ssize_t n;
+		int off = 0;
+
+		n = recv(d->fd, d->rx + d->rxlen, sizeof(d->rx) - d->rxlen, 0);
+		if (n == 0)
+			return -ECONNRESET;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		d->rxlen += n;
+
+		for (;;) {
+			int flen = mb_tcp_frame_len(d->rx + off, d->rxlen - off);
+
+			if (flen < 0)
+				return flen;
+			if (flen == 0)
+				break;
+			ev_handle_frame(d, d->rx + off, flen, now);
+			off += flen;
+			if (d->fd < 0)
+				return 0;
+		}
+
+		memmove(d->rx, d->rx + off, d->rxlen - off);
+		d->rxlen -= off;
+	}
+}
+
+static void ev_handle_io(struct ev_device *d, uint32_t events, uint64_t now)
+{
+	if (d->state == EV_CONNECTING) {
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+			ev_watch(d, EPOLLIN);
+			ev_connected(d, now);
+		}
+		return;
+	}
+
+	if (events & EPOLLIN) {
+		if (ev_read(d, now)) {
+			ev_fail_conn(d, now);
+			return;
+		}
+	} else if (events & (EPOLLERR | EPOLLHUP)) {
+		ev_fail_conn(d, now);
+		return;
+	}
+
+	if (d->fd < 0 || !(events & EPOLLOUT))
+		return;
+	if (ev_flush_tx(d)) {
+		ev_fail_conn(d, now);
+		return;
+	}
+	/* the flush made room for requests the window held back */
+	if (d->state == EV_BUSY && d->npending < d->window &&
+	    d->next_req < d->req_count && ev_fill_window(d, now))
+		ev_fail_conn(d, now);
+}
+
+static void ev_handle_timeout(struct ev_device *d, uint64_t now)
+{
+	int i;
+
+	switch (d->state) {
+	case EV_IDLE:
+		if (d->fd >= 0)
+			ev_start_cycle(d, now);
+		else if (now < d->backoff.retry_ns)
+			ev_schedule_next(d, now);	/* still backing off */
+		else
+			ev_connect(d, now);
+		break;
+	case EV_CONNECTING:
+		ev_close(d);
+		ev_conn_failed(d, now, "connect timeout");
+		ev_schedule_next(d, now);
+		break;
+	case EV_BUSY:
+		/* response deadlines, or the end of a request gap */
+		for (i = 0; i < d->npending; ) {
+			if (d->pending[i].deadline_ns > now) {
+				i++;
+				continue;
+			}
+			rtt_timeout(&d->reqs[d->pending[i].req].u->rtt);
+			d->pending[i] = d->pending[--d->npending];
+			d->done_reqs++;
+			d->last_io_ns = now;
+		}
+		if (d->done_reqs == d->req_count)
+			ev_finish_cycle(d, now);
+		else if (ev_fill_window(d, now))
+			ev_fail_conn(d, now);
+		break;
+	}
+}
+
+static void *ev_loop_thread(void *arg)
+{
+	struct ev_loop *l = (struct ev_loop *)arg;
+	struct epoll_event events[EV_MAX_EVENTS];
+	uint64_t now;
+	int n, i;
+
+	ev_arm_timer(l);
+
+	for (;;) {
+		n = epoll_wait(l->epfd, events, EV_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		now = now_ns();
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == l)
+				goto out;
+			if (ptr == NULL) {
+				uint64_t expirations;
+				ssize_t rc;
+
+				/* expirations don't matter, the heap is checked below */
+				rc = read(l->tfd, &expirations, sizeof(expirations));
+				(void)rc;
+				continue;
+			}
+			ev_handle_io((struct ev_device *)ptr, events[i].events,
+				     now);
+		}
+
+		while (l->heap_len && l->heap[0]->wake_ns <= now)
+			ev_handle_timeout(l->heap[0], now);
+
+		ev_arm_timer(l);
+	}
+
+out:
+	for (i = 0; i < l->heap_len; i++)
+		ev_close(l->heap[i]);
+	return NULL;
+}
+
+static int ev_loop_init(struct ev_loop *l, int capacity)
+{
+	struct epoll_event ev;
+
+	memset(l, 0, sizeof(*l));
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	l->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	l->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	l->heap = calloc(capacity ? capacity : 1, sizeof(*l->heap));
+	if (l->epfd < 0 || l->tfd < 0 || l->stopfd < 0 || !l->heap)
+		return -1;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->tfd, &ev) < 0)
+		return -1;
+
+	ev.data.ptr = l;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->stopfd, &ev) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void ev_loop_free(struct ev_loop *l)
+{
+	if (l->epfd > 0)
+		close(l->epfd);
+	if (l->tfd > 0)
+		close(l->tfd);
+	if (l->stopfd > 0)
+		close(l->stopfd);
+	free(l->heap);
+	memset(l, 0, sizeof(*l));
+}
+
+int ev_engine_start(const struct config *cfg)
+{
+	uint64_t start = now_ns();
+	int *gw, *dev_of, *members;
+	int per_loop;
+	int i, k;
+
+	global_cfg = cfg;
+	unit_count = cfg->io_device_count;
+	units = calloc(unit_count ? unit_count : 1, sizeof(*units));
+	/* gateway of each device, the socket serving it and its unit count */
+	gw = malloc((unit_count ? unit_count : 1) * 3 * sizeof(*gw));
+	if (!units || !gw || conn_gateways(cfg, gw)) {
+		free(gw);
+		ev_engine_stop();
+		return -1;
+	}
+	dev_of = gw + unit_count;
+	members = dev_of + unit_count;
+	memset(dev_of, 0xff, unit_count * sizeof(*dev_of));
+
+	/* a socket per ip:port, shared by the units behind a gateway */
+	device_count = 0;
+	for (i = 0; i < unit_count; i++) {
+		struct ev_unit *u = &units[i];
+
+		u->dev = &cfg->io_devices[i];
+		if (u->dev->serial.port[0])
+			continue;
+		u->unit = (uint8_t)conn_unit(u->dev);
+		rtt_init(&u->rtt, u->dev);
+		param_wheel_init(&u->wheel, u->dev);
+		u->plan = plan_cache_get(&u->plans, u->dev,
+					 read_plan_all_mask(u->dev));
+		if (!u->plan) {
+			fprintf(stderr, "[EVPOLL] failed plan reads %s\n",
+				u->dev->io_device_id);
+			continue;
+		}
+		/* without a probe there is no way back from quarantine */
+		breaker_init(&u->breaker, u->dev, (uint32_t)(i + 1) * 2246822519u);
+		if (read_plan_probe(&u->probe, u->dev))
+			u->breaker.threshold = 0;
+
+		if (dev_of[gw[i]] < 0) {
+			dev_of[gw[i]] = device_count;
+			members[device_count++] = 0;
+		}
+		members[dev_of[gw[i]]]++;
+	}
+
+	/* sockets and their unit lists, sized now that they are counted */
+	devices = calloc(device_count ? device_count : 1, sizeof(*devices));
+	if (!devices) {
+		free(gw);
+		ev_engine_stop();
+		return -1;
+	}
+	for (i = 0; i < unit_count; i++) {
+		struct ev_unit *u = &units[i];
+		struct ev_device *d;
+
+		if (!u->plan)
+			continue;
+		d = &devices[dev_of[gw[i]]];
+		if (!d->units) {
+			d->units = calloc(members[dev_of[gw[i]]], sizeof(*d->units));
+			if (!d->units) {
+				free(gw);
+				ev_engine_stop();
+				return -1;
+			}
+			d->dev = u->dev;
+			d->fd = -1;
+			d->window = MAX_OUTSTANDING;
+			backoff_init(&d->backoff, d->dev,
+				     (uint32_t)(d - devices + 1) * 2654435761u);
+			if (conn_resolve(d->dev, &d->addr, &d->addrlen)) {
+				/* retried on every connect attempt */
+				fprintf(stderr, "[EVPOLL] cannot resolve %s:%d\n",
+					d->dev->ip, d->dev->port);
+				d->addrlen = 0;
+			}
+		}
+		conn_pacing(u->dev, &d->window, &d->gap_ns);
+		d->units[d->unit_count++] = u;
+	}
+	free(gw);
+
+	loop_count = cfg->engine_threads > 0 ? cfg->engine_threads : 1;
+	if (loop_count > EV_MAX_LOOPS)
+		loop_count = EV_MAX_LOOPS;
+	if (loop_count > device_count)
+		loop_count = device_count ? device_count : 1;
+
+	per_loop = (device_count + loop_count - 1) / loop_count;
+	for (i = 0; i < loop_count; i++) {
+		if (ev_loop_init(&loops[i], per_loop)) {
+			fprintf(stderr, "[EVPOLL] failed init loop %d\n", i);
+			ev_engine_stop();
+			return -1;
+		}
+	}
+
+	for (i = 0; i < device_count; i++) {
+		struct ev_device *d = &devices[i];
+		struct ev_loop *l = &loops[i % loop_count];
+
+		if (d->unit_count > 1)
+			fprintf(stderr, "[EVPOLL] %d devices share %s:%d\n",
+				d->unit_count, d->dev->ip, d->dev->port);
+
+		/* spread first polls over the interval to avoid a connect storm */
+		for (k = 0; k < d->unit_count; k++) {
+			struct ev_unit *u = d->units[k];
+			uint64_t period = (uint64_t)u->wheel.tick_ms * 1000000ull;
+
+			sched_init(&u->sched, u->wheel.tick_ms,
+				   sched_policy_from_str(u->dev->overrun_policy),
+				   start + period * l->heap_len / per_loop);
+			u->stats_due_ns = u->sched.next_ns +
+					  cfg->stats_interval_ms * 1000000ull;
+		}
+
+		d->loop = l;
+		d->heap_idx = l->heap_len;
+		l->heap[l->heap_len++] = d;
+		ev_idle(d);
+	}
+
+	for (i = 0; i < loop_count; i++) {
+		if (pthread_create(&loops[i].thread, NULL, ev_loop_thread,
+				   &loops[i])) {
+			fprintf(stderr, "[EVPOLL] failed create thread %d\n", i);
+			continue;
+		}
+		loops[i].started = 1;
+	}
+	return 0;
+}
+
+void ev_engine_stop(void)
+{
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < loop_count; i++) {
+		if (!loops[i].started)
+			continue;
+		if (write(loops[i].stopfd, &one, sizeof(one)) < 0)
+			fprintf(stderr, "[EVPOLL] failed wake loop %d\n", i);
+		pthread_join(loops[i].thread, NULL);
+	}
+
+	for (i = 0; i < loop_count; i++)
+		ev_loop_free(&loops[i]);
+
+	for (i = 0; units && i < unit_count; i++) {
+		plan_cache_free(&units[i].plans);
+		read_plan_free(&units[i].probe);
+	}
+	for (i = 0; devices && i < device_count; i++) {
+		free(devices[i].reqs);
+		free(devices[i].units);
+	}
+
+	free(units);
+	units = NULL;
+	unit_count = 0;
+	free(devices);
+	devices = NULL;
+	device_count = 0;
+	loop_count = 0;
+}
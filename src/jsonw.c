@@ -0,0 +1,153 @@
+/*
+ * jsonw.c - minimal streaming JSON writer.
+ *
+ * Strings are escaped the way cJSON_PrintUnformatted() does. Numbers go
+ * through dtoa.c and print as cJSON prints them, unless a parameter asks
+ * for a fixed number of decimals or for the shortest text that reads back
+ * as the same double. NaN and infinities print as null, as cJSON does.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "jsonw.h"
+#include "dtoa.h"
+
+void jw_init(struct jw *w, char *buf, size_t cap)
+{
+	w->buf = buf;
+	w->cap = cap;
+	w->len = 0;
+}
+
+void jw_raw(struct jw *w, const char *s, size_t n)
+{
+	if (w->len < w->cap) {
+		size_t room = w->cap - w->len;
+
+		memcpy(w->buf + w->len, s, n < room ? n : room);
+	}
+	w->len += n;
+}
+
+void jw_char(struct jw *w, char c)
+{
+	if (w->len < w->cap)
+		w->buf[w->len] = c;
+	w->len++;
+}
+
+void jw_str(struct jw *w, const char *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *run = p;
+
+	jw_char(w, '"');
+	for (; *p; p++) {
+		char esc[8];
+		int n;
+
+		if (*p > 31 && *p != '"' && *p != '\\')
+			continue;
+
+		jw_raw(w, (const char *)run, p - run);
+		run = p + 1;
+
+		switch (*p) {
+		case '"':  n = snprintf(esc, sizeof(esc), "\\\""); break;
+		case '\\': n = snprintf(esc, sizeof(esc), "\\\\"); break;
+		case '\b': n = snprintf(esc, sizeof(esc), "\\b"); break;
+		case '\f': n = snprintf(esc, sizeof(esc), "\\f"); break;
+		case '\n': n = snprintf(esc, sizeof(esc), "\\n"); break;
+		case '\r': n = snprintf(esc, sizeof(esc), "\\r"); break;
+		case '\t': n = snprintf(esc, sizeof(esc), "\\t"); break;
+		default:   n = snprintf(esc, sizeof(esc), "\\u%04x", *p); break;
+		}
+		jw_raw(w, esc, n);
+	}
+	jw_raw(w, (const char *)run, p - run);
+	jw_char(w, '"');
+}
+
+void jw_int(struct jw *w, int v)
+{
+	char tmp[12];
+	char *p = tmp + sizeof(tmp);
+	unsigned int u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+
+	do {
+		*--p = (char)('0' + u % 10);
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		*--p = '-';
+	jw_raw(w, p, tmp + sizeof(tmp) - p);
+}
+
+void jw_number(struct jw *w, double d)
+{
+	jw_fixed(w, d, DTOA_CJSON);
+}
+
+/*
+ * jw_fixed - d rounded to decimals places, or unrounded as DTOA_CJSON or
+ * DTOA_SHORTEST say
+ */
+void jw_fixed(struct jw *w, double d, int decimals)
+{
+	char tmp[DTOA_BUF_LEN];
+	int n;
+
+	if (isnan(d) || isinf(d)) {
+		jw_lit(w, "null");
+		return;
+	}
+
+	if (decimals >= 0)
+		n = dtoa_fixed(d, decimals, tmp);
+	else if (decimals == DTOA_SHORTEST)
+		n = dtoa_shortest(d, tmp);
+	else
+		n = dtoa_cjson(d, tmp);
+	jw_raw(w, tmp, n);
+}
+
+/* jw_float - the shortest digits that read back as the same float */
+void jw_float(struct jw *w, float f)
+{
+	char tmp[DTOA_BUF_LEN];
+
+	if (isnan(f) || isinf(f)) {
+		jw_lit(w, "null");
+		return;
+	}
+	jw_raw(w, tmp, dtoa_shortest_float(f, tmp));
+}
+
+/*
+ * jw_room - reserve n bytes for the caller to fill in place. Returns
+ * where they go, NULL when they do not fit (they are counted either way).
+ */
+char *jw_room(struct jw *w, size_t n)
+{
+	char *p = w->len + n <= w->cap ? w->buf + w->len : NULL;
+
+	w->len += n;
+	return p;
+}
+
+/*
+ * jw_finish - NUL terminate. Returns 0 when the whole document fit,
+ * -1 when the buffer needs at least len + 1 bytes.
+ */
+int jw_finish(struct jw *w)
+{
+	if (w->len < w->cap) {
+		w->buf[w->len] = '\0';
+		return 0;
+	}
+	if (w->cap)
+		w->buf[w->cap - 1] = '\0';
+	return -1;
+}
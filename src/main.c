@@ -21,7 +21,7 @@
 
 #include "config.h"
 #include "mqtt.h"
-#include "modbus.h"
+#include "modbus_if.h"
 
 static volatile int running = 1;
 static struct config cfg;
@@ -52,6 +52,8 @@ int main(int argc, char **argv)
 	memset(&cfg, 0, sizeof(cfg));
 	strncpy(cfg.forge_edge_id, serial, sizeof(cfg.forge_edge_id) - 1);
 	strncpy(cfg.data_mode, "processed", sizeof(cfg.data_mode) - 1);
+	strncpy(cfg.engine, "threads", sizeof(cfg.engine) - 1);
+	cfg.stats_interval_ms = DEFAULT_STATS_INTERVAL_MS;
 
 	/* try load saved config; if missing, we wait for mqtt-provided config */
 	if (load_config_from_file(DEFAULT_CONFIG_PATH, &cfg) == 0)
@@ -0,0 +1,154 @@
+/*
+ * mbproto.c - Modbus PDU encode/decode for the read requests produced by
+ * the read planner.
+ *
+ * libmodbus only exposes blocking one-request-at-a-time reads; the
+ * pipelined poller needs to frame requests itself and decode responses
+ * that come back matched by transaction id, so the PDU layout lives here.
+ * The event-driven poller also uses the MBAP framing helpers below, the
+ * RTU bus scheduler the frame sizes to know how long a read keeps the
+ * line busy.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <modbus.h>
+#include "mbproto.h"
+
+int mb_read_fc(int type)
+{
+	switch (type) {
+	case REG_COIL:
+		return MODBUS_FC_READ_COILS;
+	case REG_HOLDING:
+		return MODBUS_FC_READ_HOLDING_REGISTERS;
+	case REG_INPUT:
+		return MODBUS_FC_READ_INPUT_REGISTERS;
+	case REG_DISCRETE:
+		return MODBUS_FC_READ_DISCRETE_INPUTS;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * mb_build_read_pdu - encode the read request for block b. Returns the PDU
+ * length or -EINVAL for a block type that has no read function.
+ */
+int mb_build_read_pdu(uint8_t *pdu, const struct read_block *b)
+{
+	int fc = mb_read_fc(b->type);
+
+	if (fc < 0)
+		return -EINVAL;
+
+	pdu[0] = (uint8_t)fc;
+	pdu[1] = (uint8_t)(b->address >> 8);
+	pdu[2] = (uint8_t)(b->address & 0xff);
+	pdu[3] = (uint8_t)(b->count >> 8);
+	pdu[4] = (uint8_t)(b->count & 0xff);
+	return MB_READ_REQ_PDU_LEN;
+}
+
+/*
+ * mb_parse_read_pdu - validate the response PDU for block b and store its
+ * data into the plan images. Returns 0, the Modbus exception code as a
+ * negative libmodbus errno, or -EPROTO for a malformed response.
+ */
+int mb_parse_read_pdu(const uint8_t *pdu, int len, const struct read_block *b,
+		      struct read_plan *plan)
+{
+	int fc = mb_read_fc(b->type);
+	int nbytes;
+	int i;
+
+	if (len < 2)
+		return -EPROTO;
+
+	if (pdu[0] == (uint8_t)(fc | 0x80))
+		return -(MODBUS_ENOBASE + pdu[1]);
+
+	if (pdu[0] != fc)
+		return -EPROTO;
+
+	if (REG_IS_BIT(b->type))
+		nbytes = (b->count + 7) / 8;
+	else
+		nbytes = b->count * 2;
+
+	if (pdu[1] != nbytes || len < 2 + nbytes)
+		return -EPROTO;
+
+	if (REG_IS_BIT(b->type)) {
+		/* same packing as the image, and the block is byte aligned */
+		uint8_t *dest = plan->bits + b->offset / 8;
+
+		memcpy(dest, pdu + 2, nbytes);
+		if (b->count % 8)
+			dest[nbytes - 1] &= (uint8_t)((1u << (b->count % 8)) - 1);
+	} else {
+		uint16_t *dest = plan->regs + b->offset;
+
+		for (i = 0; i < b->count; i++)
+			dest[i] = (uint16_t)(pdu[2 + 2 * i] << 8 |
+					     pdu[3 + 2 * i]);
+	}
+	return 0;
+}
+
+/*
+ * mb_build_tcp_read_adu - MBAP header plus read request PDU for block b.
+ * Returns the ADU length or -EINVAL.
+ */
+int mb_build_tcp_read_adu(uint8_t *adu, uint16_t tid, uint8_t unit,
+			  const struct read_block *b)
+{
+	int len;
+
+	len = mb_build_read_pdu(adu + MB_MBAP_LEN, b);
+	if (len < 0)
+		return len;
+
+	adu[0] = (uint8_t)(tid >> 8);
+	adu[1] = (uint8_t)(tid & 0xff);
+	adu[2] = 0;
+	adu[3] = 0;
+	adu[4] = (uint8_t)((len + 1) >> 8);
+	adu[5] = (uint8_t)((len + 1) & 0xff);
+	adu[6] = unit;
+	return MB_MBAP_LEN + len;
+}
+
+/*
+ * mb_tcp_frame_len - length of the complete MBAP frame at the start of
+ * buf, 0 if more bytes are needed, -EPROTO if the header is invalid.
+ */
+int mb_tcp_frame_len(const uint8_t *buf, int len)
+{
+	int flen;
+
+	if (len < MB_MBAP_LEN)
+		return 0;
+
+	if (buf[2] || buf[3])
+		return -EPROTO;
+
+	flen = 6 + (buf[4] << 8 | buf[5]);
+	if (flen < MB_MBAP_LEN + 1 || flen > MODBUS_MAX_ADU_LENGTH)
+		return -EPROTO;
+
+	return len < flen ? 0 : flen;
+}
+
+/*
+ * mb_rtu_read_chars - characters an RTU read of block b puts on the line,
+ * request and response frame together
+ */
+int mb_rtu_read_chars(const struct read_block *b)
+{
+	int data = REG_IS_BIT(b->type) ? (b->count + 7) / 8 : b->count * 2;
+
+	/* response: address, function code, byte count, data, CRC */
+	return MB_RTU_READ_REQ_LEN + 3 + data + MB_RTU_CRC_LEN;
+}
@@ -1,9 +1,35 @@
 /*
  * modbus_if.c - per-IO-device modbus data aquisition implementation using libmodbus.
  *
- *  - creates a modbus_tcp context to the device ip:port
- *  - polls parameters per device->poll_interval_ms
- *  - creates JSON payload and enqueues to mqtt_publish()
+ *  - connects to the device ip:port through connmgr.c, which reconnects
+ *    with backoff whenever the link is lost; slots without a connection
+ *    are skipped like any other missed cycle
+ *  - devices sharing an ip:port are units behind one gateway: one worker
+ *    thread and one connection serve them all, interleaving their
+ *    requests round robin and waiting request_gap_ms between requests
+ *  - devices sharing a serial port are slaves on one RTU bus, and its
+ *    worker is the bus scheduler: one request on the line at a time, the
+ *    3.5 character silence kept between frames, slaves served earliest
+ *    deadline first, timeouts stretched by the frames' time on the wire
+ *    and the line's busy share reported as bus_utilization. Buses have a
+ *    worker with either engine.
+ *  - reads parameters through a per-device read plan (see readplan.c),
+ *    so adjacent parameters share one request
+ *  - parameters with their own poll_interval_ms are picked per slot by a
+ *    timing wheel and only those are planned and read
+ *  - with max_outstanding > 1 the plan's requests are pipelined and
+ *    responses matched by MBAP transaction id
+ *  - the response timeout follows each device's measured round trip
+ *    time (struct rtt_est) instead of libmodbus' fixed default
+ *  - a device that keeps not answering is quarantined (struct breaker):
+ *    its slots send a single register probe now and then instead of the
+ *    read plan until it answers, its state changes go out on .../state
+ *  - polls parameters every device->poll_interval_ms on an absolute
+ *    CLOCK_MONOTONIC grid (see pollsched.c), publishing schedule stats
+ *  - hands the decoded plan to telemetry_publish()
+ *
+ * With "engine": "epoll" the thread-per-device workers are not used and
+ * all devices are driven by evpoll.c instead.
  */
 
 #include <stdio.h>
@@ -13,184 +39,612 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include <modbus.h>
-#include "modbus.h"
+#include "modbus_if.h"
 #include "config.h"
-#include "cJSON.h"
-#include "mqtt.h"
+#include "readplan.h"
+#include "mbproto.h"
+#include "telemetry.h"
+#include "evpoll.h"
+#include "pollsched.h"
+#include "connmgr.h"
 
 #define MAX_WORKERS 64
 
-static pthread_t worker_threads[MAX_WORKERS];
+/* one device, polled on its own schedule over its gateway's connection */
+struct mb_unit {
+	const struct io_device *dev;
+	struct plan_cache plans;
+	struct read_plan *plan;
+	struct param_wheel wheel;
+	struct poll_sched sched;
+	uint64_t stats_due_ns;
+	struct rtt_est rtt;
+	struct breaker breaker;
+	struct read_plan probe;
+	uint64_t busy_mark_ns;	/* bus busy time at the last stats */
+	uint64_t mark_ns;
+	int active;		/* has requests in the running cycle */
+	struct device_worker *w;	/* NULL when not polled */
+};
+
+/* a request of the running cycle: one block of a unit's plan */
+struct mb_req {
+	struct mb_unit *u;
+	int block;
+};
+
+/* a connection and the thread that drives it */
+struct device_worker {
+	int gw;			/* conn_gateways() index of its units */
+	struct mb_unit **units;	/* sized from the gateway's membership */
+	struct mb_unit **order;	/* RTU bus: scratch of queue_bus_requests() */
+	int unit_count;
+	int rr;			/* unit that goes first next cycle */
+	struct mb_req *reqs;
+	int req_count;
+	int req_cap;
+	int window;
+	uint64_t gap_ns;
+	uint64_t last_io_ns;
+	uint64_t char_ns;	/* RTU bus: time of a character, 0 on TCP */
+	uint64_t busy_ns;	/* RTU bus: time the line was in use */
+	pthread_t thread;
+	int started;
+	uint16_t next_tid;
+	struct mb_conn conn;
+};
+
+static struct mb_unit units[MAX_IO_DEVICES];
+static struct device_worker workers[MAX_WORKERS];
+static int worker_count;
 static int worker_active;
+static int ev_engine;
 static const struct config *global_cfg;
 
-static void build_and_enqueue_reading(const struct io_device *dev)
+/* gap_wait - give the gateway its request_gap_ms since the last response */
+static void gap_wait(struct device_worker *w)
+{
+	if (w->gap_ns && w->last_io_ns)
+		sched_sleep_until(w->last_io_ns + w->gap_ns);
+}
+
+static void set_timeout(modbus_t *ctx, uint64_t ns)
+{
+	modbus_set_response_timeout(ctx, (uint32_t)(ns / 1000000000ull),
+				    (uint32_t)(ns % 1000000000ull / 1000));
+}
+
+/*
+ * read_bits_packed - coil or discrete input block through a raw request,
+ * so the packed bytes of the response land in the bit image as they are
+ * instead of being spread to a byte per bit by modbus_read_bits(). Fails
+ * with errno set like the libmodbus reads: an exception reply gives its
+ * EMBX code, a reply that does not fit EMBBADDATA.
+ */
+static int read_bits_packed(modbus_t *ctx, struct device_worker *w,
+			    struct read_plan *plan, const struct read_block *b)
+{
+	uint8_t req[1 + MB_READ_REQ_PDU_LEN];
+	uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+	int tid = w->next_tid++;
+	int hdr, rc;
+
+	req[0] = (uint8_t)modbus_get_slave(ctx);
+	rc = mb_build_read_pdu(req + 1, b);
+	if (rc < 0) {
+		errno = -rc;
+		return -1;
+	}
+
+	/* RTU: libmodbus adds the CRC, the slave address tells the reply */
+	if (w->char_ns) {
+		hdr = 1;
+		if (modbus_send_raw_request(ctx, req, sizeof(req)) < 0)
+			return -1;
+		rc = modbus_receive_confirmation(ctx, rsp);
+		if (rc >= hdr + 2 + MB_RTU_CRC_LEN && rsp[0] == req[0])
+			rc -= MB_RTU_CRC_LEN;
+		else
+			rc = rc < 0 ? -errno : -EMBBADDATA;
+	} else {
+		hdr = MB_MBAP_LEN;
+		if (modbus_send_raw_request_tid(ctx, req, sizeof(req), tid) < 0)
+			return -1;
+		rc = modbus_receive_confirmation(ctx, rsp);
+		/* a short frame, or a late reply to an earlier request */
+		if (rc >= 0 && (rc < hdr + 2 || (rsp[0] << 8 | rsp[1]) != tid))
+			rc = -EMBBADDATA;
+		else if (rc < 0)
+			rc = -errno;
+	}
+	if (rc < 0) {
+		/* nothing of it may be taken for the next reply */
+		modbus_flush(ctx);
+		errno = -rc;
+		return -1;
+	}
+
+	rc = mb_parse_read_pdu(rsp + hdr, rc - hdr, b, plan);
+	if (rc < 0) {
+		errno = -rc;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * execute_plan - issue every request of the cycle, filling the units'
+ * bit/register images. Each block records its own status so a failed
+ * request only blanks the parameters it covers. Returns 1 when a request
+ * failed because the connection is gone, the rest is skipped then.
+ *
+ * On an RTU bus the time the request and response frames take on the
+ * wire is added to the response timeout and taken off the round trip
+ * sample, so a long read at 9600 baud is not mistaken for a slow slave.
+ */
+static int execute_plan(modbus_t *ctx, struct device_worker *w)
+{
+	int link_err = 0;
+
+	for (int i = 0; i < w->req_count; i++) {
+		struct mb_unit *u = w->reqs[i].u;
+		struct read_plan *plan = u->plan;
+		struct read_block *b = &plan->blocks[w->reqs[i].block];
+		uint64_t t0, rtt;
+		uint64_t wire = w->char_ns * mb_rtu_read_chars(b);
+		int rc;
+
+		if (link_err) {
+			b->status = -1;
+			continue;
+		}
+
+		gap_wait(w);
+		modbus_set_slave(ctx, conn_unit(u->dev));
+		set_timeout(ctx, u->rtt.rto_ns + wire);
+		t0 = sched_now_ns();
+		switch (b->type) {
+		case REG_COIL:
+		case REG_DISCRETE:
+			rc = read_bits_packed(ctx, w, plan, b);
+			break;
+		case REG_HOLDING:
+			rc = modbus_read_registers(ctx, b->address, b->count,
+						   plan->regs + b->offset);
+			break;
+		case REG_INPUT:
+			rc = modbus_read_input_registers(ctx, b->address, b->count,
+							 plan->regs + b->offset);
+			break;
+		default:
+			errno = EINVAL;
+			rc = -1;
+			break;
+		}
+		w->last_io_ns = sched_now_ns();
+		rtt = w->last_io_ns - t0;
+		w->busy_ns += rtt + w->gap_ns;
+		b->status = rc < 0 ? -1 : 0;
+		if (rc >= 0) {
+			rtt_sample(&u->rtt, rtt > wire ? rtt - wire : 0);
+		} else if (errno == ETIMEDOUT) {
+			rtt_timeout(&u->rtt);
+			/* a late reply must not be taken for the next one's */
+			if (w->char_ns)
+				modbus_flush(ctx);
+		} else if (conn_link_error(errno)) {
+			link_err = 1;
+		}
+	}
+	return link_err;
+}
+
+struct inflight {
+	int tid;
+	int req;
+	uint64_t sent_ns;
+	uint64_t deadline_ns;
+};
+
+/*
+ * execute_plan_pipelined - keep up to w->window requests in flight on the
+ * connection and match responses by transaction id, so a cycle costs
+ * roughly one round trip instead of one per block. The receive timeout
+ * runs to the earliest deadline in flight. Returns 1 when the connection
+ * broke, as execute_plan().
+ */
+static int execute_plan_pipelined(modbus_t *ctx, struct device_worker *w)
+{
+	struct inflight pending[MAX_OUTSTANDING];
+	uint8_t req[1 + MB_READ_REQ_PDU_LEN];
+	uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+	struct mb_req *r;
+	struct read_block *b;
+	uint64_t now, first;
+	int npending = 0;
+	int next = 0;
+	int link_err = 0;
+	int i, rc, tid;
+
+	while (next < w->req_count || npending) {
+		while (npending < w->window && next < w->req_count) {
+			r = &w->reqs[next++];
+			b = &r->u->plan->blocks[r->block];
+
+			b->status = -1;
+			req[0] = (uint8_t)conn_unit(r->u->dev);
+			if (mb_build_read_pdu(req + 1, b) < 0)
+				continue;
+
+			tid = w->next_tid++;
+			if (modbus_send_raw_request_tid(ctx, req, sizeof(req),
+							tid) < 0) {
+				if (conn_link_error(errno)) {
+					link_err = 1;
+					break;
+				}
+				continue;
+			}
+
+			pending[npending].tid = tid;
+			pending[npending].req = (int)(r - w->reqs);
+			pending[npending].sent_ns = sched_now_ns();
+			pending[npending].deadline_ns = pending[npending].sent_ns +
+							r->u->rtt.rto_ns;
+			npending++;
+		}
+
+		if (link_err)
+			break;
+		if (!npending)
+			continue;
+
+		now = sched_now_ns();
+		first = pending[0].deadline_ns;
+		for (i = 1; i < npending; i++)
+			if (pending[i].deadline_ns < first)
+				first = pending[i].deadline_ns;
+		set_timeout(ctx, first > now + 1000000ull ? first - now : 1000000ull);
+
+		rc = modbus_receive_confirmation(ctx, rsp);
+		if (rc < 0) {
+			if (conn_link_error(errno)) {
+				link_err = 1;
+				break;
+			}
+			if (errno != ETIMEDOUT) {
+				/*
+				 * a garbled frame: what is left of it cannot
+				 * be told from the replies still to come, so
+				 * give up on the window
+				 */
+				npending = 0;
+				modbus_flush(ctx);
+				continue;
+			}
+			/* only the requests past their deadline are lost */
+			now = sched_now_ns();
+			for (i = 0; i < npending; ) {
+				if (pending[i].deadline_ns > now) {
+					i++;
+					continue;
+				}
+				rtt_timeout(&w->reqs[pending[i].req].u->rtt);
+				pending[i] = pending[--npending];
+			}
+			continue;
+		}
+		if (rc < MB_MBAP_LEN + 2)
+			continue;
+
+		tid = rsp[0] << 8 | rsp[1];
+		for (i = 0; i < npending; i++)
+			if (pending[i].tid == tid)
+				break;
+		if (i == npending)
+			continue;	/* stale reply from a timed out window */
+
+		r = &w->reqs[pending[i].req];
+		b = &r->u->plan->blocks[r->block];
+		b->status = mb_parse_read_pdu(rsp + MB_MBAP_LEN,
+					      rc - MB_MBAP_LEN, b, r->u->plan);
+		rtt_sample(&r->u->rtt, sched_now_ns() - pending[i].sent_ns);
+		pending[i] = pending[--npending];
+	}
+
+	/* blocks never sent after the link broke */
+	for (; next < w->req_count; next++)
+		w->reqs[next].u->plan->blocks[w->reqs[next].block].status = -1;
+	return link_err;
+}
+
+static void publish_stats_if_due(struct device_worker *w, struct mb_unit *u,
+				 uint64_t now)
 {
-	cJSON *root, *data_arr;
-	char *s;
-	char topic[256];
-	time_t now = time(NULL);
+	struct device_stats st;
 
-	root = cJSON_CreateObject();
-	if (!root)
+	if (global_cfg->stats_interval_ms <= 0 || now < u->stats_due_ns)
 		return;
 
-	cJSON_AddStringToObject(root, "edge_id", global_cfg->forge_edge_id);
-	cJSON_AddStringToObject(root, "io_device_id", dev->io_device_id);
-	cJSON_AddNumberToObject(root, "timestamp", (double)now);
+	memset(&st, 0, sizeof(st));
+	st.sched = u->sched.stats;
+	st.connected = w->conn.up;
+	st.connect_failures = w->conn.backoff.total;
+	st.rtt = u->rtt;
+	st.breaker = u->breaker;
+	if (w->char_ns) {
+		st.serial = 1;
+		if (now > u->mark_ns)
+			st.bus_utilization = (double)(w->busy_ns - u->busy_mark_ns) /
+					     (double)(now - u->mark_ns);
+		u->busy_mark_ns = w->busy_ns;
+		u->mark_ns = now;
+	}
+	telemetry_publish_stats(global_cfg, u->dev, &st);
+	u->sched.stats.max_lateness_ns = 0;
+	u->stats_due_ns = now + global_cfg->stats_interval_ms * 1000000ull;
+}
+
+/* unit_next - done with u's slot, on to its next one */
+static void unit_next(struct device_worker *w, struct mb_unit *u, uint64_t now)
+{
+	publish_stats_if_due(w, u, now);
+	sched_next(&u->sched, now);
+	u->active = 0;
+}
+
+/*
+ * plan_due - plan every unit whose slot has come, the probe for a
+ * quarantined one; returns how many read
+ */
+static int plan_due(struct device_worker *w, uint64_t now)
+{
+	int active = 0;
+	int k;
 
-	data_arr = cJSON_CreateArray();
-	cJSON_AddItemToObject(root, "data", data_arr);
+	for (k = 0; k < w->unit_count; k++) {
+		struct mb_unit *u = w->units[k];
+		uint32_t due;
 
-	for (int i = 0; i < dev->parameter_count; i++) {
-		const struct parameter *p = &dev->parameters[i];
-		cJSON *entry = cJSON_CreateObject();
-		if (!entry)
+		if (u->sched.due_ns > now)
 			continue;
-		cJSON_AddStringToObject(entry, "name", p->name);
-		cJSON_AddStringToObject(entry, "type", p->type);
 
-		if (strcmp(p->type, "coil") == 0) {
-			uint8_t bits[128];
-			int rc = modbus_read_bits(NULL, p->address, p->count, bits);
-			/* NOTE: above is placeholder. We must use a modbus context. */
-			/* In the real code below we use ctx for per-device connection. */
-			(void)rc;
+		switch (breaker_action(&u->breaker, now)) {
+		case BRK_POLL:
+			due = param_wheel_due(&u->wheel, u->sched.slot);
+			u->plan = due ? plan_cache_get(&u->plans, u->dev, due) :
+					NULL;
+			break;
+		case BRK_PROBE:
+			u->plan = &u->probe;
+			break;
+		default:
+			u->plan = NULL;
+			break;
+		}
+		if (!u->plan) {
+			unit_next(w, u, now);
+			continue;
 		}
+		u->active = 1;
+		active++;
+	}
+	return active;
+}
 
-		cJSON_AddItemToArray(data_arr, entry);
+static int queue_add(struct device_worker *w, struct mb_unit *u, int block)
+{
+	if (w->req_count == w->req_cap) {
+		int cap = w->req_cap ? w->req_cap * 2 : 16;
+		struct mb_req *r = realloc(w->reqs, cap * sizeof(*r));
+
+		if (!r)
+			return -1;
+		w->reqs = r;
+		w->req_cap = cap;
 	}
+	w->reqs[w->req_count].u = u;
+	w->reqs[w->req_count].block = block;
+	w->req_count++;
+	return 0;
+}
 
-	s = cJSON_PrintUnformatted(root);
-	if (s) {
-		snprintf(topic, sizeof(topic), "forgeedge/%s/%s/data",
-			 global_cfg->forge_edge_id, dev->io_device_id);
-		mqtt_publish(topic, s);
-		free(s);
+/* unit_deadline - end of the slot u is reading for */
+static uint64_t unit_deadline(const struct mb_unit *u)
+{
+	return u->sched.next_ns + u->sched.period_ns;
+}
+
+/*
+ * queue_bus_requests - on an RTU bus only one frame is on the line at a
+ * time, so interleaving buys nothing: each active slave's blocks in turn,
+ * the one whose slot ends first going first.
+ */
+static int queue_bus_requests(struct device_worker *w)
+{
+	struct mb_unit **order = w->order;
+	int n = 0;
+	int i, k;
+
+	for (k = 0; k < w->unit_count; k++) {
+		struct mb_unit *u = w->units[k];
+
+		if (!u->active)
+			continue;
+		for (i = n; i > 0 && unit_deadline(order[i - 1]) >
+				     unit_deadline(u); i--)
+			order[i] = order[i - 1];
+		order[i] = u;
+		n++;
+	}
+
+	w->req_count = 0;
+	for (k = 0; k < n; k++)
+		for (i = 0; i < order[k]->plan->block_count; i++)
+			if (queue_add(w, order[k], i))
+				return -1;
+	return 0;
+}
+
+/*
+ * queue_requests - the active units' blocks, one of each unit per round,
+ * so a unit with a long plan does not hold the others up. The unit going
+ * first rotates from cycle to cycle.
+ */
+static int queue_requests(struct device_worker *w)
+{
+	int round, k, left;
+
+	if (w->char_ns)
+		return queue_bus_requests(w);
+
+	w->req_count = 0;
+	for (round = 0, left = 1; left; round++) {
+		left = 0;
+		for (k = 0; k < w->unit_count; k++) {
+			struct mb_unit *u = w->units[(w->rr + k) % w->unit_count];
+
+			if (!u->active || round >= u->plan->block_count)
+				continue;
+			if (queue_add(w, u, round))
+				return -1;
+			left = 1;
+		}
 	}
-	cJSON_Delete(root);
+	w->rr = (w->rr + 1) % w->unit_count;
+	return 0;
+}
+
+static uint64_t next_due(const struct device_worker *w)
+{
+	uint64_t due = w->units[0]->sched.due_ns;
+	int k;
+
+	for (k = 1; k < w->unit_count; k++)
+		if (w->units[k]->sched.due_ns < due)
+			due = w->units[k]->sched.due_ns;
+	return due;
 }
 
 /*
- * device_thread - worker per device
+ * device_thread - worker per connection: one device, or every device
+ * behind a gateway
  */
 static void *device_thread(void *arg)
 {
-	const struct io_device *dev = (const struct io_device *)arg;
-	modbus_t *ctx = NULL;
-	int rc;
+	struct device_worker *w = (struct device_worker *)arg;
+	const struct io_device *dev = w->units[0]->dev;
+	modbus_t *ctx;
+	uint64_t now;
+	int answered;
+	int link_err;
+	int k;
 
-	ctx = modbus_new_tcp(dev->ip, dev->port);
-	if (!ctx) {
+	if (conn_init(&w->conn, dev, (uint32_t)(w - workers + 1) * 2654435761u)) {
 		fprintf(stderr, "[MODBUS] failed create ctx %s\n", dev->io_device_id);
+		conn_free(&w->conn);
 		return NULL;
 	}
 
-	if (dev->unit_id > 0)
-		modbus_set_slave(ctx, dev->unit_id);
+	now = sched_now_ns();
+	for (k = 0; k < w->unit_count; k++) {
+		struct mb_unit *u = w->units[k];
 
-	if (modbus_connect(ctx) == -1) {
-		fprintf(stderr, "[MODBUS] connect failed %s:%d\n", dev->ip, dev->port);
-		modbus_free(ctx);
-		return NULL;
+		sched_init(&u->sched, u->wheel.tick_ms,
+			   sched_policy_from_str(u->dev->overrun_policy), now);
+		u->stats_due_ns = u->sched.next_ns +
+				  global_cfg->stats_interval_ms * 1000000ull;
+		u->mark_ns = now;
 	}
 
 	while (worker_active) {
-		cJSON *root = cJSON_CreateObject();
-		cJSON *arr = cJSON_CreateArray();
-		char topic[256];
-		char *out;
-		time_t now = time(NULL);
-
-		cJSON_AddStringToObject(root, "edge_id", global_cfg->forge_edge_id);
-		cJSON_AddStringToObject(root, "io_device_id", dev->io_device_id);
-		cJSON_AddNumberToObject(root, "timestamp", (double)now);
-		cJSON_AddItemToObject(root, "data", arr);
-
-		for (int i = 0; i < dev->parameter_count; i++) {
-			const struct parameter *p = &dev->parameters[i];
-			cJSON *entry = cJSON_CreateObject();
-			cJSON_AddStringToObject(entry, "name", p->name);
-			cJSON_AddStringToObject(entry, "type", p->type);
-
-			if (strcmp(p->type, "coil") == 0) {
-				uint8_t *bits;
-				bits = calloc(p->count, sizeof(uint8_t));
-				if (!bits)
-					continue;
-				rc = modbus_read_bits(ctx, p->address, p->count, bits);
-				if (rc >= 0) {
-					if (p->count == 1)
-						cJSON_AddNumberToObject(entry, "raw", bits[0]);
-					else {
-						cJSON *a = cJSON_CreateArray();
-						for (int k = 0; k < p->count; k++)
-							cJSON_AddItemToArray(a,
-								cJSON_CreateNumber(bits[k]));
-						cJSON_AddItemToObject(entry, "raw", a);
-					}
-				}
-				free(bits);
-			} else if (strcmp(p->type, "holding") == 0 ||
-				   strcmp(p->type, "input") == 0) {
-				uint16_t *regs;
-				regs = calloc(p->count, sizeof(uint16_t));
-				if (!regs)
-					continue;
-				if (strcmp(p->type, "holding") == 0)
-					rc = modbus_read_registers(ctx, p->address,
-								  p->count, regs);
-				else
-					rc = modbus_read_input_registers(ctx, p->address,
-									 p->count, regs);
-				if (rc >= 0) {
-					if (p->count == 1) {
-						double v = regs[0] * p->scale;
-						if (strcmp(global_cfg->data_mode, "raw") == 0)
-							cJSON_AddNumberToObject(entry, "raw", regs[0]);
-						else
-							cJSON_AddNumberToObject(entry, "value", v);
-					} else {
-						cJSON *a = cJSON_CreateArray();
-						for (int k = 0; k < p->count; k++)
-							cJSON_AddItemToArray(a,
-								cJSON_CreateNumber(regs[k] * p->scale));
-						cJSON_AddItemToObject(entry, "value", a);
-					}
-				}
-				free(regs);
-			} else {
-				/* unknown type: skip */
-			}
+		sched_sleep_until(next_due(w));
+		if (!worker_active)
+			break;
 
-			cJSON_AddItemToArray(arr, entry);
-		}
+		now = sched_now_ns();
+		if (!plan_due(w, now))
+			continue;
 
-		out = cJSON_PrintUnformatted(root);
-		if (out) {
-			snprintf(topic, sizeof(topic), "forgeedge/%s/%s/data",
-				 global_cfg->forge_edge_id, dev->io_device_id);
-			mqtt_publish(topic, out);
-			free(out);
+		/* no connection and not yet time to retry: missed slots */
+		ctx = conn_get(&w->conn, now);
+		if (!ctx || queue_requests(w)) {
+			now = sched_now_ns();
+			for (k = 0; k < w->unit_count; k++)
+				if (w->units[k]->active)
+					unit_next(w, w->units[k], now);
+			continue;
 		}
-		cJSON_Delete(root);
 
-		/* sleep by poll interval, use nanosleep for better accuracy */
-		struct timespec ts;
-		ts.tv_sec = dev->poll_interval_ms / 1000;
-		ts.tv_nsec = (dev->poll_interval_ms % 1000) * 1000000;
-		nanosleep(&ts, NULL);
+		now = sched_now_ns();
+		for (k = 0; k < w->unit_count; k++)
+			if (w->units[k]->active)
+				sched_begin(&w->units[k]->sched, now);
+
+		if (w->window > 1)
+			link_err = execute_plan_pipelined(ctx, w);
+		else
+			link_err = execute_plan(ctx, w);
+
+		answered = 0;
+		for (k = 0; k < w->unit_count; k++)
+			if (w->units[k]->active &&
+			    read_plan_answered(w->units[k]->plan))
+				answered = 1;
+		conn_cycle_done(&w->conn, answered, link_err, sched_now_ns());
+
+		for (k = 0; k < w->unit_count; k++) {
+			struct mb_unit *u = w->units[k];
+
+			if (!u->active)
+				continue;
+			now = sched_now_ns();
+			if (!link_err && u->plan->block_count &&
+			    breaker_done(&u->breaker, read_plan_answered(u->plan),
+					 now)) {
+				fprintf(stderr, "[MODBUS] %s %s\n", u->dev->io_device_id,
+					breaker_state_str(u->breaker.state));
+				telemetry_publish_state(global_cfg, u->dev,
+							&u->breaker, now);
+			}
+			if (u->plan != &u->probe) {
+				read_plan_extract(u->plan);
+				telemetry_publish(global_cfg, u->dev, u->plan);
+			}
+			unit_next(w, u, now);
+		}
 	}
 
-	modbus_close(ctx);
-	modbus_free(ctx);
+	conn_free(&w->conn);
 	return NULL;
 }
 
+/* worker_for - the worker of gateway gw, a new one when it has none yet */
+static struct device_worker *worker_for(const struct config *cfg, int gw)
+{
+	struct device_worker *w;
+	int k;
+
+	for (k = 0; k < worker_count; k++)
+		if (workers[k].gw == gw)
+			return &workers[k];
+
+	if (worker_count == MAX_WORKERS)
+		return NULL;
+	w = &workers[worker_count++];
+	memset(w, 0, sizeof(*w));
+	w->gw = gw;
+	w->window = MAX_OUTSTANDING;
+	w->char_ns = conn_char_ns(&cfg->io_devices[gw]);
+	return w;
+}
+
 int start_modbus_process(const struct config *cfg)
 {
+	int *gw;
 	int i;
 	int rc;
 
@@ -198,25 +652,153 @@ int start_modbus_process(const struct config *cfg)
 		return -1;
 
 	global_cfg = cfg;
+
+	if (telemetry_init(cfg)) {
+		fprintf(stderr, "[MODBUS] failed to prepare telemetry\n");
+		return -1;
+	}
+
+	gw = malloc((cfg->io_device_count ? cfg->io_device_count : 1) *
+		    sizeof(*gw));
+	if (!gw || conn_gateways(cfg, gw)) {
+		fprintf(stderr, "[MODBUS] failed group devices by connection\n");
+		free(gw);
+		return -1;
+	}
+
+	/* evpoll.c drives sockets only, serial buses keep their worker */
+	if (strcmp(cfg->engine, "epoll") == 0) {
+		ev_engine = 1;
+		if (ev_engine_start(cfg)) {
+			free(gw);
+			return -1;
+		}
+	}
+
 	worker_active = 1;
+	worker_count = 0;
+
+	for (i = 0; i < cfg->io_device_count && i < (int)MAX_IO_DEVICES; i++) {
+		struct mb_unit *u = &units[i];
+		struct device_worker *w;
 
-	for (i = 0; i < cfg->io_device_count && i < MAX_WORKERS; i++) {
-		rc = pthread_create(&worker_threads[i], NULL,
-				    device_thread, (void *)&cfg->io_devices[i]);
+		u->dev = &cfg->io_devices[i];
+		u->w = NULL;
+		if (ev_engine && !u->dev->serial.port[0])
+			continue;
+		if (u->dev->serial.port[0] && !u->dev->unit_id) {
+			fprintf(stderr, "[MODBUS] %s on %s needs a unit_id\n",
+				u->dev->io_device_id, u->dev->serial.port);
+			continue;
+		}
+		param_wheel_init(&u->wheel, u->dev);
+		rtt_init(&u->rtt, u->dev);
+
+		/* every parameter is due in the first slot, plan that up front */
+		u->plan = plan_cache_get(&u->plans, u->dev,
+					 read_plan_all_mask(u->dev));
+		if (!u->plan) {
+			fprintf(stderr, "[MODBUS] failed plan reads %s\n",
+				u->dev->io_device_id);
+			continue;
+		}
+		/* without a probe there is no way back from quarantine */
+		breaker_init(&u->breaker, u->dev, (uint32_t)(i + 1) * 2246822519u);
+		if (read_plan_probe(&u->probe, u->dev))
+			u->breaker.threshold = 0;
+
+		w = worker_for(cfg, gw[i]);
+		if (!w) {
+			fprintf(stderr, "[MODBUS] too many connections, %s not polled\n",
+				u->dev->io_device_id);
+			plan_cache_free(&u->plans);
+			read_plan_free(&u->probe);
+			continue;
+		}
+		conn_pacing(u->dev, &w->window, &w->gap_ns);
+		w->unit_count++;
+		u->w = w;
+	}
+	free(gw);
+
+	/* counted above, now each worker's units get a list of their size */
+	for (i = 0; i < worker_count; i++) {
+		struct device_worker *w = &workers[i];
+
+		w->units = calloc(w->unit_count, sizeof(*w->units));
+		if (w->char_ns)
+			w->order = calloc(w->unit_count, sizeof(*w->order));
+		if (!w->units || (w->char_ns && !w->order)) {
+			free(w->units);
+			free(w->order);
+			w->units = NULL;
+			w->order = NULL;
+		}
+		w->unit_count = 0;
+	}
+	for (i = 0; i < cfg->io_device_count && i < (int)MAX_IO_DEVICES; i++) {
+		struct mb_unit *u = &units[i];
+
+		if (!u->w)
+			continue;
+		if (!u->w->units) {
+			fprintf(stderr, "[MODBUS] out of memory, %s not polled\n",
+				u->dev->io_device_id);
+			plan_cache_free(&u->plans);
+			read_plan_free(&u->probe);
+			continue;
+		}
+		u->w->units[u->w->unit_count++] = u;
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		struct device_worker *w = &workers[i];
+
+		if (!w->unit_count)
+			continue;
+		if (w->char_ns)
+			fprintf(stderr, "[MODBUS] %d devices on bus %s, %d baud\n",
+				w->unit_count, w->units[0]->dev->serial.port,
+				w->units[0]->dev->serial.baud);
+		else if (w->unit_count > 1)
+			fprintf(stderr, "[MODBUS] %d devices share %s:%d\n",
+				w->unit_count, w->units[0]->dev->ip,
+				w->units[0]->dev->port);
+
+		rc = pthread_create(&w->thread, NULL, device_thread, (void *)w);
 		if (rc) {
 			fprintf(stderr, "[MODBUS] failed create thread %d\n", i);
+			continue;
 		}
+		w->started = 1;
 	}
 	return 0;
 }
 
 void stop_modbus_process(void)
 {
-	int i;
+	int i, k;
+
+	if (ev_engine) {
+		ev_engine_stop();
+		ev_engine = 0;
+	}
 
 	worker_active = 0;
-	for (i = 0; i < MAX_WORKERS; i++) {
-		pthread_join(worker_threads[i], NULL);
+	for (i = 0; i < worker_count; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		for (k = 0; k < workers[i].unit_count; k++) {
+			plan_cache_free(&workers[i].units[k]->plans);
+			read_plan_free(&workers[i].units[k]->probe);
+		}
+		free(workers[i].reqs);
+		free(workers[i].units);
+		free(workers[i].order);
+		workers[i].reqs = NULL;
+		workers[i].units = NULL;
+		workers[i].order = NULL;
 	}
+	worker_count = 0;
+	telemetry_cleanup();
 }
-
@@ -0,0 +1,797 @@
+/*
+ * modbus_sim.c - Modbus TCP and RTU slave simulator, the "modbus_sim"
+ * target: a local stand-in for a plant full of PLCs, to measure the
+ * client's polling throughput and scheduler behaviour without hardware.
+ *
+ *  - simulates the slaves of a JSON file (see simcfg.c), hundreds of them
+ *    on consecutive local ports if asked, driven by "threads" epoll loops
+ *  - register tables are libmodbus mappings built with
+ *    modbus_mapping_new_start_address(); requests are read with
+ *    modbus_receive() and answered with modbus_reply(), so addressing and
+ *    the illegal address exception are libmodbus' own
+ *  - a slave with "units" answers unit ids 1..units from separate tables,
+ *    like a gateway, and others with a gateway target exception
+ *  - registers follow scripted waveforms, evaluated when a reply goes out
+ *  - replies wait latency_ms +- jitter_ms, in order per connection; a
+ *    drop_pct share of requests gets no reply at all, an exception_pct
+ *    share exception_code
+ *  - max_connections caps the clients of a slave, connections beyond it
+ *    are closed as soon as they are accepted, as small PLCs do
+ *  - a slave with "serial" is an RTU bus instead: a pseudo terminal linked
+ *    at that path, framed by function code and CRC. The pty moves bytes
+ *    at once, so each reply is held back for the request's and its own
+ *    time on the wire at the configured baud rate, and a request starting
+ *    less than 3.5 characters after the line went quiet, or while a reply
+ *    is still due, is counted as a short silence. Units without tables
+ *    stay silent, as on a real bus, and "trace" logs every request with
+ *    its unit id to show the order the master serves them in
+ *  - the request rate and request, reply, drop, exception and connection
+ *    totals go to stderr every stats_interval_s and on exit
+ *
+ * usage: modbus_sim <config.json>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <pty.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <modbus.h>
+#include "simcfg.h"
+
+#define SIM_MAX_EVENTS		64
+#define SIM_MAX_QUEUED		16	/* delayed replies per connection */
+#define SIM_BACKLOG		16
+
+enum sim_kind {
+	SIM_LISTENER,
+	SIM_CONN,
+	SIM_BUS,
+};
+
+struct sim_loop;
+
+struct sim_slave {
+	int kind;
+	const struct sim_group *g;
+	struct sim_loop *loop;
+	int port;
+	int fd;
+	modbus_t *ctx;		/* owns the listening socket */
+	modbus_mapping_t **maps;	/* one per unit id, or a single one */
+	int nmaps;
+	int connections;
+	uint32_t seed;
+};
+
+struct sim_reply {
+	uint64_t due_ns;
+	int len;
+	int exception;		/* code to answer with, 0 = the data */
+	uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+};
+
+/* the line of an RTU bus: request framing and time on the wire */
+struct sim_line {
+	int pty;		/* held open so the bus outlives its clients */
+	uint64_t char_ns;
+	uint64_t silence_ns;	/* t3.5 */
+	uint64_t idle_ns;	/* when the line last went quiet */
+	int len;
+	uint8_t frame[MODBUS_RTU_MAX_ADU_LENGTH];
+};
+
+/* a client connection, or the master side of an RTU bus */
+struct sim_conn {
+	int kind;
+	struct sim_slave *s;
+	modbus_t *ctx;
+	int fd;
+	int head;
+	int count;
+	struct sim_reply q[SIM_MAX_QUEUED];
+	struct sim_line *line;	/* RTU bus only */
+	struct sim_conn *next;
+};
+
+struct sim_stats {
+	atomic_uint_fast64_t requests;
+	atomic_uint_fast64_t replies;
+	atomic_uint_fast64_t dropped;
+	atomic_uint_fast64_t exceptions;
+	atomic_uint_fast64_t accepted;
+	atomic_uint_fast64_t rejected;
+	atomic_uint_fast64_t short_silences;	/* RTU buses only */
+	atomic_int open;
+};
+
+struct sim_loop {
+	int epfd;
+	pthread_t thread;
+	int started;
+	struct sim_conn *conns;
+};
+
+static struct sim_config cfg;
+static struct sim_slave *slaves;
+static int slave_count;
+static struct sim_loop *loops;
+static int bus_count;
+static struct sim_stats stats;
+static uint64_t start_ns;
+static volatile sig_atomic_t running = 1;
+
+static void sigint_handler(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* percent - true for a pct share of the calls */
+static int percent(struct sim_slave *s, double pct)
+{
+	return pct > 0 && sim_rand(&s->seed) % 1000000u < pct * 10000;
+}
+
+static void conn_close(struct sim_conn *c)
+{
+	struct sim_loop *l = c->s->loop;
+	struct sim_conn **pp;
+
+	for (pp = &l->conns; *pp; pp = &(*pp)->next) {
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	}
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	if (c->line) {
+		/* the RTU context never opened a device, only borrowed the pty */
+		close(c->fd);
+		close(c->line->pty);
+		free(c->line);
+	} else {
+		modbus_close(c->ctx);
+	}
+	modbus_free(c->ctx);
+	c->s->connections--;
+	atomic_fetch_sub(&stats.open, 1);
+	free(c);
+}
+
+static void slave_accept(struct sim_slave *s)
+{
+	struct epoll_event ev;
+	struct sim_conn *c;
+	int one = 1;
+	int fd;
+
+	for (;;) {
+		fd = accept(s->fd, NULL, NULL);
+		if (fd < 0)
+			return;
+
+		if (s->g->max_connections &&
+		    s->connections >= s->g->max_connections) {
+			close(fd);
+			atomic_fetch_add(&stats.rejected, 1);
+			continue;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (c)
+			c->ctx = modbus_new_tcp(cfg.listen, s->port);
+		if (!c || !c->ctx) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->kind = SIM_CONN;
+		c->s = s;
+		c->fd = fd;
+		modbus_set_socket(c->ctx, fd);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(s->loop->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			modbus_free(c->ctx);
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = s->loop->conns;
+		s->loop->conns = c;
+		s->connections++;
+		atomic_fetch_add(&stats.accepted, 1);
+		atomic_fetch_add(&stats.open, 1);
+	}
+}
+
+/* reply_delay - latency_ms +- jitter_ms, in ns */
+static uint64_t reply_delay(struct sim_slave *s)
+{
+	const struct sim_group *g = s->g;
+	int64_t delay = (int64_t)g->latency_ms * 1000000;
+
+	if (g->jitter_ms)
+		delay += (int64_t)(sim_rand(&s->seed) %
+				   (2u * g->jitter_ms * 1000u + 1)) * 1000 -
+			 (int64_t)g->jitter_ms * 1000000;
+	return delay > 0 ? (uint64_t)delay : 0;
+}
+
+/*
+ * conn_request - one request from the client: dropped, or queued to be
+ * answered once its latency has passed. Replies never overtake each
+ * other, jitter or not.
+ */
+static void conn_request(struct sim_conn *c, uint64_t now)
+{
+	const struct sim_group *g = c->s->g;
+	struct sim_reply *r;
+	int len;
+
+	if (c->count == SIM_MAX_QUEUED) {
+		uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+
+		/* the client pipelines deeper than we queue: shed the request */
+		if (modbus_receive(c->ctx, req) < 0)
+			conn_close(c);
+		else
+			atomic_fetch_add(&stats.dropped, 1);
+		return;
+	}
+
+	r = &c->q[(c->head + c->count) % SIM_MAX_QUEUED];
+	len = modbus_receive(c->ctx, r->req);
+	if (len < 0) {
+		conn_close(c);
+		return;
+	}
+	if (!len)
+		return;
+
+	atomic_fetch_add(&stats.requests, 1);
+	if (percent(c->s, g->drop_pct)) {
+		atomic_fetch_add(&stats.dropped, 1);
+		return;
+	}
+
+	r->len = len;
+	r->exception = percent(c->s, g->exception_pct) ? g->exception_code : 0;
+
+	r->due_ns = now + reply_delay(c->s);
+	if (c->count) {
+		struct sim_reply *prev = &c->q[(c->head + c->count - 1) %
+					       SIM_MAX_QUEUED];
+
+		if (r->due_ns < prev->due_ns)
+			r->due_ns = prev->due_ns;
+	}
+	c->count++;
+}
+
+/* rtu_crc - the Modbus CRC-16, 0 over a frame that ends in its own CRC */
+static uint16_t rtu_crc(const uint8_t *p, int n)
+{
+	uint16_t crc = 0xffff;
+	int k;
+
+	while (n--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+	}
+	return crc;
+}
+
+/*
+ * rtu_request_len - length of the request at the start of an RTU frame,
+ * 0 while too little of it is in to tell, -1 for a function not served
+ */
+static int rtu_request_len(const uint8_t *f, int len)
+{
+	if (len < 2)
+		return 0;
+	switch (f[1]) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+	case MODBUS_FC_WRITE_SINGLE_COIL:
+	case MODBUS_FC_WRITE_SINGLE_REGISTER:
+		return 8;
+	case MODBUS_FC_WRITE_MULTIPLE_COILS:
+	case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+		if (len < 7)
+			return 0;
+		return 9 + f[6] <= MODBUS_RTU_MAX_ADU_LENGTH ? 9 + f[6] : -1;
+	default:
+		return -1;
+	}
+}
+
+/* rtu_reply_len - length of the reply to a request, for its wire time */
+static int rtu_reply_len(const uint8_t *f, int exception)
+{
+	int count = f[4] << 8 | f[5];
+
+	if (exception)
+		return 5;
+	switch (f[1]) {
+	case MODBUS_FC_READ_COILS:
+	case MODBUS_FC_READ_DISCRETE_INPUTS:
+		return 5 + (count + 7) / 8;
+	case MODBUS_FC_READ_HOLDING_REGISTERS:
+	case MODBUS_FC_READ_INPUT_REGISTERS:
+		return 5 + 2 * count;
+	default:
+		return 8;
+	}
+}
+
+/*
+ * bus_frame - one request off the bus, len bytes at the start of the
+ * line's frame: answered by the unit it addresses after both frames' time
+ * on the wire and the unit's latency, or met with silence
+ */
+static void bus_frame(struct sim_conn *c, int len, uint64_t now)
+{
+	const struct sim_group *g = c->s->g;
+	struct sim_line *l = c->line;
+	uint64_t wire = (uint64_t)len * l->char_ns;
+	const uint8_t *f = l->frame;
+	struct sim_reply *r;
+
+	atomic_fetch_add(&stats.requests, 1);
+	if (g->trace)
+		fprintf(stderr, "[SIM] %s: %.3f ms unit %d function %d address %d count %d\n",
+			g->name, (now - start_ns) / 1e6, f[0], f[1],
+			f[2] << 8 | f[3], f[4] << 8 | f[5]);
+
+	/* a garbled frame, an absent unit or a dropped request: silence */
+	if (rtu_crc(f, len) || (g->units && (f[0] < 1 || f[0] > g->units)) ||
+	    percent(c->s, g->drop_pct) || c->count == SIM_MAX_QUEUED) {
+		atomic_fetch_add(&stats.dropped, 1);
+		if (!c->count)
+			l->idle_ns = now + wire;
+		return;
+	}
+
+	r = &c->q[(c->head + c->count) % SIM_MAX_QUEUED];
+	memcpy(r->req, f, len);
+	r->len = len;
+	r->exception = percent(c->s, g->exception_pct) ? g->exception_code : 0;
+	r->due_ns = now + wire + reply_delay(c->s) +
+		    (uint64_t)rtu_reply_len(f, r->exception) * l->char_ns;
+	c->count++;
+}
+
+/*
+ * bus_request - bytes from the master: check the silence before a new
+ * frame, then take every complete request off the line
+ */
+static void bus_request(struct sim_conn *c, uint64_t now)
+{
+	struct sim_line *l = c->line;
+	ssize_t n;
+	int len;
+
+	if (!l->len && (c->count || now < l->idle_ns + l->silence_ns))
+		atomic_fetch_add(&stats.short_silences, 1);
+
+	n = read(c->fd, l->frame + l->len, sizeof(l->frame) - l->len);
+	if (n <= 0)
+		return;
+	l->len += n;
+
+	while ((len = rtu_request_len(l->frame, l->len)) > 0 && len <= l->len) {
+		bus_frame(c, len, now);
+		l->len -= len;
+		memmove(l->frame, l->frame + len, l->len);
+	}
+	if (len < 0) {
+		/* lost the frame boundary: drop what is there */
+		atomic_fetch_add(&stats.dropped, 1);
+		l->len = 0;
+	}
+}
+
+/* conn_reply - answer r from the table of the unit it addresses */
+static int conn_reply(struct sim_conn *c, struct sim_reply *r, uint64_t now)
+{
+	struct sim_slave *s = c->s;
+	modbus_mapping_t *map;
+	int unit = r->req[modbus_get_header_length(c->ctx) - 1];
+	double t = (now - start_ns) / 1e9;
+	int i;
+
+	if (r->exception) {
+		atomic_fetch_add(&stats.exceptions, 1);
+		return modbus_reply_exception(c->ctx, r->req, r->exception);
+	}
+
+	if (s->nmaps == 1) {
+		map = s->maps[0];
+	} else if (unit >= 1 && unit <= s->nmaps) {
+		map = s->maps[unit - 1];
+	} else {
+		atomic_fetch_add(&stats.exceptions, 1);
+		return modbus_reply_exception(c->ctx, r->req,
+					      MODBUS_EXCEPTION_GATEWAY_TARGET);
+	}
+
+	for (i = 0; i < s->g->wave_count; i++)
+		sim_wave_apply(&s->g->waves[i], map, t, &s->seed);
+	atomic_fetch_add(&stats.replies, 1);
+	return modbus_reply(c->ctx, r->req, r->len, map);
+}
+
+/*
+ * loop_flush - send every reply that is due; returns the time the next
+ * one is, 0 when none is waiting
+ */
+static uint64_t loop_flush(struct sim_loop *l, uint64_t now)
+{
+	struct sim_conn *c, *next;
+	uint64_t first = 0;
+
+	for (c = l->conns; c; c = next) {
+		int closed = 0;
+
+		next = c->next;
+		while (c->count && c->q[c->head].due_ns <= now) {
+			struct sim_reply *r = &c->q[c->head];
+
+			c->head = (c->head + 1) % SIM_MAX_QUEUED;
+			c->count--;
+			if (c->line) {
+				/* a bus stays up, a failed write is a lost reply */
+				conn_reply(c, r, now);
+				c->line->idle_ns = now;
+				continue;
+			}
+			if (conn_reply(c, r, now) < 0) {
+				conn_close(c);
+				closed = 1;
+				break;
+			}
+		}
+		if (closed || !c->count)
+			continue;
+		if (!first || c->q[c->head].due_ns < first)
+			first = c->q[c->head].due_ns;
+	}
+	return first;
+}
+
+static void *loop_thread(void *arg)
+{
+	struct sim_loop *l = arg;
+	struct epoll_event ev[SIM_MAX_EVENTS];
+	uint64_t now, next = 0;
+	int timeout, n, i;
+
+	while (running) {
+		timeout = 200;
+		if (next) {
+			now = now_ns();
+			timeout = next > now ? (int)((next - now + 999999) / 1000000) : 0;
+			if (timeout > 200)
+				timeout = 200;
+		}
+
+		n = epoll_wait(l->epfd, ev, SIM_MAX_EVENTS, timeout);
+		now = now_ns();
+		for (i = 0; i < n; i++) {
+			int kind = *(int *)ev[i].data.ptr;
+
+			if (kind == SIM_LISTENER)
+				slave_accept(ev[i].data.ptr);
+			else if (kind == SIM_BUS)
+				bus_request(ev[i].data.ptr, now);
+			else
+				conn_request(ev[i].data.ptr, now);
+		}
+		next = loop_flush(l, now_ns());
+	}
+
+	while (l->conns)
+		conn_close(l->conns);
+	return NULL;
+}
+
+/* bus_free - undo a bus_init() that got as far as c, which may be NULL */
+static void bus_free(struct sim_conn *c, int master, int pty)
+{
+	if (c) {
+		if (c->ctx)
+			modbus_free(c->ctx);
+		free(c->line);
+		free(c);
+	}
+	close(master);
+	close(pty);
+}
+
+/*
+ * bus_init - the RTU bus of a serial group: a pty whose slave side is
+ * linked at g->serial for the client to open, served from the master side
+ * through an RTU context that only borrows it
+ */
+static int bus_init(struct sim_slave *s, struct sim_loop *l)
+{
+	const struct sim_group *g = s->g;
+	struct epoll_event ev;
+	struct termios tio;
+	struct sim_conn *c;
+	struct stat st;
+	const char *name;
+	int master, pty;
+	int bits;
+
+	/* only ever replace a link a previous run left behind */
+	if (!lstat(g->serial, &st) && !S_ISLNK(st.st_mode))
+		return -EEXIST;
+	if (openpty(&master, &pty, NULL, NULL, NULL))
+		return -errno;
+	if (!tcgetattr(pty, &tio)) {
+		cfmakeraw(&tio);
+		tcsetattr(pty, TCSANOW, &tio);
+	}
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+	c = calloc(1, sizeof(*c));
+	if (c)
+		c->line = calloc(1, sizeof(*c->line));
+	if (c && c->line)
+		c->ctx = modbus_new_rtu(g->serial, g->baud, g->parity, 8, 1);
+	if (!c || !c->line || !c->ctx) {
+		bus_free(c, master, pty);
+		return -ENOMEM;
+	}
+	name = ttyname(pty);
+	unlink(g->serial);
+	if (!name || symlink(name, g->serial)) {
+		int err = -errno;
+
+		bus_free(c, master, pty);
+		return err;
+	}
+	modbus_set_socket(c->ctx, master);
+
+	c->kind = SIM_BUS;
+	c->s = s;
+	c->fd = master;
+	c->line->pty = pty;
+	/* start, data, parity and stop bits, as connmgr.c counts them */
+	bits = 1 + 8 + (g->parity != 'N') + 1;
+	c->line->char_ns = (uint64_t)bits * 1000000000ull / g->baud;
+	c->line->silence_ns = g->baud > 19200 ? 1750000 :
+			      c->line->char_ns * 7 / 2;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev)) {
+		int err = -errno;
+
+		bus_free(c, master, pty);
+		return err;
+	}
+	c->next = l->conns;
+	l->conns = c;
+	s->connections++;
+	atomic_fetch_add(&stats.open, 1);
+	bus_count++;
+	return 0;
+}
+
+static int slave_init(struct sim_slave *s, const struct sim_group *g,
+		      int port, struct sim_loop *l)
+{
+	const struct sim_range *t = g->tables;
+	struct epoll_event ev;
+	int k;
+
+	s->kind = SIM_LISTENER;
+	s->g = g;
+	s->loop = l;
+	s->port = port;
+	s->fd = -1;
+	s->seed = (uint32_t)port * 2654435761u;
+	if (!s->seed)
+		s->seed = 1;
+
+	s->nmaps = g->units ? g->units : 1;
+	s->maps = calloc(s->nmaps, sizeof(*s->maps));
+	if (!s->maps)
+		return -ENOMEM;
+	for (k = 0; k < s->nmaps; k++) {
+		s->maps[k] = modbus_mapping_new_start_address(
+			t[SIM_COILS].start, t[SIM_COILS].count,
+			t[SIM_DISCRETE].start, t[SIM_DISCRETE].count,
+			t[SIM_HOLDING].start, t[SIM_HOLDING].count,
+			t[SIM_INPUT].start, t[SIM_INPUT].count);
+		if (!s->maps[k])
+			return -ENOMEM;
+	}
+	if (g->serial[0])
+		return bus_init(s, l);
+
+	s->ctx = modbus_new_tcp(cfg.listen, port);
+	if (!s->ctx)
+		return -ENOMEM;
+	s->fd = modbus_tcp_listen(s->ctx, SIM_BACKLOG);
+	if (s->fd < 0)
+		return -errno;
+	fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, s->fd, &ev))
+		return -errno;
+	return 0;
+}
+
+static void slave_free(struct sim_slave *s)
+{
+	int k;
+
+	if (s->ctx) {
+		if (s->fd >= 0)
+			close(s->fd);
+		modbus_free(s->ctx);
+	}
+	for (k = 0; s->maps && k < s->nmaps; k++)
+		modbus_mapping_free(s->maps[k]);
+	free(s->maps);
+	if (s->g && s->g->serial[0])
+		unlink(s->g->serial);
+}
+
+static void print_stats(double rate)
+{
+	fprintf(stderr, "[SIM] %.0f req/s, requests %llu replies %llu dropped %llu exceptions %llu connections %d accepted %llu rejected %llu\n",
+		rate, (unsigned long long)atomic_load(&stats.requests),
+		(unsigned long long)atomic_load(&stats.replies),
+		(unsigned long long)atomic_load(&stats.dropped),
+		(unsigned long long)atomic_load(&stats.exceptions),
+		atomic_load(&stats.open),
+		(unsigned long long)atomic_load(&stats.accepted),
+		(unsigned long long)atomic_load(&stats.rejected));
+	if (bus_count)
+		fprintf(stderr, "[SIM] RTU buses %d, short silences %llu\n",
+			bus_count,
+			(unsigned long long)atomic_load(&stats.short_silences));
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t last_ns, last_requests = 0;
+	int i, k, n, rc;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <config.json>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	rc = sim_load_config(argv[1], &cfg);
+	if (rc) {
+		fprintf(stderr, "[SIM] failed to load %s (%d)\n", argv[1], rc);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, sigint_handler);
+	signal(SIGTERM, sigint_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < cfg.group_count; i++)
+		slave_count += cfg.groups[i].count;
+	slaves = calloc(slave_count ? slave_count : 1, sizeof(*slaves));
+	loops = calloc(cfg.threads, sizeof(*loops));
+	if (!slaves || !loops)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < cfg.threads; i++) {
+		loops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (loops[i].epfd < 0) {
+			fprintf(stderr, "[SIM] failed create loop %d\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* slaves go round robin over the loops */
+	start_ns = now_ns();
+	for (i = 0, n = 0; i < cfg.group_count; i++) {
+		const struct sim_group *g = &cfg.groups[i];
+
+		for (k = 0; k < g->count; k++, n++) {
+			rc = slave_init(&slaves[n], g, g->port + k,
+					&loops[n % cfg.threads]);
+			if (rc && g->serial[0]) {
+				fprintf(stderr, "[SIM] %s: cannot serve %s (%d)\n",
+					g->name, g->serial, rc);
+				running = 0;
+				break;
+			}
+			if (rc) {
+				fprintf(stderr, "[SIM] %s: cannot serve %s:%d (%d)\n",
+					g->name, cfg.listen, g->port + k, rc);
+				running = 0;
+				break;
+			}
+		}
+		if (!running)
+			break;
+		if (g->serial[0]) {
+			fprintf(stderr, "[SIM] %s: RTU bus on %s, %d baud %c\n",
+				g->name, g->serial, g->baud, g->parity);
+			continue;
+		}
+		fprintf(stderr, "[SIM] %s: %d slave%s on %s:%d-%d\n", g->name,
+			g->count, g->count > 1 ? "s" : "", cfg.listen, g->port,
+			g->port + g->count - 1);
+	}
+
+	for (i = 0; running && i < cfg.threads; i++) {
+		if (pthread_create(&loops[i].thread, NULL, loop_thread,
+				   &loops[i])) {
+			fprintf(stderr, "[SIM] failed create thread %d\n", i);
+			running = 0;
+			break;
+		}
+		loops[i].started = 1;
+	}
+
+	last_ns = now_ns();
+	while (running) {
+		uint64_t now, requests;
+
+		sleep(1);
+		now = now_ns();
+		if (cfg.stats_interval_s <= 0 ||
+		    now - last_ns < (uint64_t)cfg.stats_interval_s * 1000000000ull)
+			continue;
+		requests = atomic_load(&stats.requests);
+		print_stats((requests - last_requests) / ((now - last_ns) / 1e9));
+		last_requests = requests;
+		last_ns = now;
+	}
+
+	for (i = 0; i < cfg.threads; i++) {
+		if (loops[i].started)
+			pthread_join(loops[i].thread, NULL);
+		close(loops[i].epfd);
+	}
+	/* over the whole run */
+	print_stats(atomic_load(&stats.requests) / ((now_ns() - start_ns) / 1e9));
+
+	for (i = 0; i < slave_count; i++)
+		slave_free(&slaves[i]);
+	free(slaves);
+	free(loops);
+	return EXIT_SUCCESS;
+}
@@ -5,7 +5,15 @@
  *  - This code expects Paho Async API (MQTTAsync_*) headers available.
  *  - TLS is supported via MQTTAsync_SSLOptions when security_mode == "tls".
  *  - Paho has internal persistence/queueing if configured; here we enqueue
- *    strings in userspace and call MQTTAsync_sendMessage.
+ *    pooled message buffers in userspace and call MQTTAsync_sendMessage.
+ *  - With mqtt.spool_dir set, messages that cannot go out are kept in a
+ *    disk log (spool.c) and sent again at a limited rate after reconnect.
+ *  - With mqtt.coalesce_bytes set, JSON messages sharing a topic prefix
+ *    are packed into one publish (coalesce.c).
+ *  - On an MQTT 5 connection every publish carries the content type of
+ *    its payload (JSON, CBOR or MessagePack, see msg_fmt).
+ *  - With data_mode "sparkplug" this thread also runs the Sparkplug B node
+ *    life cycle: NDEATH as will, NBIRTH on every connect, NCMD rebirth.
  */
 
 #include <stdio.h>
@@ -13,21 +21,46 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include "mqtt.h"
 #include "dataq.h"
 #include "config.h"
+#include "spool.h"
+#include "coalesce.h"
+#include "pollsched.h"
+#include "sparkplug.h"
 
 #include "MQTTAsync.h" /* paho async header; adjust include path as needed */
 
 #define Q_CAPACITY 1024
+#define MSG_POOL_SPARE 64	/* buffers being filled while the queue is full */
 #define CLIENT_KEEPALIVE 60
+#define MQTT_PUMP_MS 100	/* longest the thread sleeps on an empty queue */
+#define SPOOL_PUMP_MS 10	/* ... while a spooled backlog is draining */
+#define MQTT_BATCH 32		/* messages taken from the queue per pass */
+#define MQTT_RETRY_MS 2000	/* between connect attempts */
+
+/* token bucket limiting the backlog drain rate */
+struct spool_drain {
+	uint64_t last_ns;
+	double tokens;
+	int rate;		/* records per second */
+};
 
 static const struct config *global_cfg;
 static pthread_t mqtt_thread;
 static volatile int mqtt_running;
 static volatile int connected = 0;
+static volatile uint64_t retry_ns;	/* no connect attempt before this */
 static MQTTAsync client;
+static int link_up;		/* mqtt thread: broker reachable this pass */
+static size_t spill_mark;	/* lane depth above which messages spool */
+static struct coalescer coal;
+static int mqtt_v5;		/* connected with MQTT 5 */
+static MQTTProperties fmt_props[MSG_FMT_COUNT];	/* content type per msg_fmt */
+static int sparkplug_mode;	/* data_mode "sparkplug" */
 
 /* forward */
 static void *mqtt_thread_fn(void *arg);
@@ -64,11 +97,64 @@ static void on_connect_failure(void *context, MQTTAsync_failureData *response)
 {
 	(void)context;
 	(void)response;
-	fprintf(stderr, "[MQTT] connect failed\n");
+	fprintf(stderr, "[MQTT] connect failed, retrying in %d ms\n",
+		MQTT_RETRY_MS);
+	retry_ns = sched_now_ns() + MQTT_RETRY_MS * 1000000ull;
+	connected = 0;
+}
+
+static void on_connect_success5(void *context, MQTTAsync_successData5 *response)
+{
+	(void)context;
+	(void)response;
+	fprintf(stderr, "[MQTT] connected (MQTT 5)\n");
+}
+
+static void on_connect_failure5(void *context, MQTTAsync_failureData5 *response)
+{
+	(void)context;
+	fprintf(stderr, "[MQTT] connect failed, reason code %d, retrying in %d ms\n",
+		response ? (int)response->reasonCode : -1, MQTT_RETRY_MS);
+	retry_ns = sched_now_ns() + MQTT_RETRY_MS * 1000000ull;
+	connected = 0;
+}
+
+/*
+ * fmt_props_init - one content-type property list per payload encoding,
+ * built once; sendMessage copies the list it is given.
+ */
+static int fmt_props_init(void)
+{
+	MQTTProperty prop;
+	int fmt;
+
+	for (fmt = 0; fmt < MSG_FMT_COUNT; fmt++) {
+		const char *ctype = msg_fmt_content_type(fmt);
+
+		memset(&prop, 0, sizeof(prop));
+		prop.identifier = MQTTPROPERTY_CODE_CONTENT_TYPE;
+		prop.value.data.data = (char *)ctype;
+		prop.value.data.len = (int)strlen(ctype);
+		if (MQTTProperties_add(&fmt_props[fmt], &prop))
+			return -1;
+	}
+	return 0;
+}
+
+static void fmt_props_free(void)
+{
+	int fmt;
+
+	for (fmt = 0; fmt < MSG_FMT_COUNT; fmt++)
+		MQTTProperties_free(&fmt_props[fmt]);
 }
 
 static int message_arrived(void *context, char *topicName, int topicLen, MQTTAsync_message *message)
 {
+    /* the only subscription is the Sparkplug NCMD topic */
+    if (sparkplug_mode)
+        sparkplug_command(message->payload, (size_t)message->payloadlen);
+
     // Just free the message and return 1 to indicate success
     MQTTAsync_freeMessage(&message);
     MQTTAsync_free(topicName);
@@ -103,18 +189,26 @@ static int build_connect_options(MQTTAsync_connectOptions *conn_opts,
 	return 0;
 }
 
-static int mqtt_publish_msg(const char *topic, const char *payload)
+/*
+ * mqtt_publish_payload - Paho copies the payload before sendMessage
+ * returns, so the caller may release it as soon as this returns.
+ */
+static int mqtt_publish_payload(const char *topic, const void *data,
+				size_t len, int fmt)
 {
 	MQTTAsync_message pubmsg = MQTTAsync_message_initializer;
 	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
 	int rc;
 
-	pubmsg.payload = (void *)payload;
-	pubmsg.payloadlen = (int)strlen(payload);
-	pubmsg.qos = 1;
+	pubmsg.payload = (void *)data;
+	pubmsg.payloadlen = (int)len;
+	/* Sparkplug B births and data go out at QoS 0, the spec requires it */
+	pubmsg.qos = fmt == MSG_FMT_SPARKPLUG ? 0 : 1;
 	pubmsg.retained = 0;
+	if (mqtt_v5)
+		pubmsg.properties = fmt_props[fmt];
 
-	opts.onSuccess = on_send;
+	opts.onSuccess = mqtt_v5 ? NULL : on_send;
 	opts.onFailure = NULL;
 	opts.context = NULL;
 
@@ -126,15 +220,178 @@ static int mqtt_publish_msg(const char *topic, const char *payload)
 	return 0;
 }
 
+static int mqtt_publish_msg(const struct msg_buf *m)
+{
+	const void *data = m->data;
+	size_t len = m->len;
+
+	if (m->fmt == MSG_FMT_SPARKPLUG) {
+		/* stamped with seq now; stale sessions are dropped, not retried */
+		data = sparkplug_seal(m, &len);
+		if (!data)
+			return 0;
+	}
+	return mqtt_publish_payload(m->topic, data, len, m->fmt);
+}
+
+/*
+ * drain_backlog - send spooled records at no more than drain->rate per
+ * second so live data keeps flowing while a backlog is worked off.
+ */
+static void drain_backlog(struct spool_drain *drain)
+{
+	uint64_t now = sched_now_ns();
+	struct msg_buf *msg;
+	int rc;
+
+	drain->tokens += (now - drain->last_ns) * (double)drain->rate / 1e9;
+	if (drain->tokens > drain->rate)
+		drain->tokens = drain->rate;	/* at most one second of burst */
+	drain->last_ns = now;
+
+	/* a queued control message goes first, see mqtt_send() */
+	while (drain->tokens >= 1.0 && !data_queue_depth(Q_PRIO_CONTROL) &&
+	       spool_peek(&msg) == 0) {
+		rc = mqtt_publish_msg(msg);
+		msg_put(msg);
+		if (rc)
+			break;
+		spool_advance();
+		drain->tokens -= 1.0;
+	}
+}
+
+/*
+ * mqtt_send - last hop for one (possibly coalesced) message. With the
+ * spool enabled the message goes to disk instead while the link is down,
+ * while its lane is close to full, or when the publish fails.
+ */
+static void mqtt_send(struct msg_buf *m)
+{
+	int spill;
+
+	/* Sparkplug state is resent by the next birth, never spooled */
+	if (!spool_enabled() || m->fmt == MSG_FMT_SPARKPLUG) {
+		mqtt_publish_msg(m);
+		return;
+	}
+
+	spill = !link_up || (m->prio != Q_PRIO_CONTROL &&
+			     data_queue_depth(m->prio) > spill_mark);
+	if (spill || mqtt_publish_msg(m))
+		spool_append(m);
+}
+
+/*
+ * mqtt_pump - one pass of the publish path: drain a batch from the queue,
+ * let the coalescer pack what it can, send the rest, ship batches that
+ * are due and work off some spooled backlog.
+ */
+static void mqtt_pump(struct spool_drain *drain)
+{
+	struct msg_buf *batch[MQTT_BATCH];
+	uint64_t now = sched_now_ns();
+	uint64_t due = coalesce_next_deadline(&coal);
+	int timeout = link_up && spool_pending() ? SPOOL_PUMP_MS : MQTT_PUMP_MS;
+	int n, i;
+
+	/* wake up in time for the oldest open batch */
+	if (due) {
+		uint64_t left = due > now ? (due - now + 999999) / 1000000 : 0;
+
+		if (left < (uint64_t)timeout)
+			timeout = (int)left;
+	}
+
+	n = data_queue_dequeue_batch(batch, MQTT_BATCH, timeout);
+	now = sched_now_ns();
+	for (i = 0; i < n; i++) {
+		/* control messages never wait for a batch */
+		if (batch[i]->prio == Q_PRIO_CONTROL ||
+		    coalesce_add(&coal, batch[i], now))
+			mqtt_send(batch[i]);
+		msg_put(batch[i]);
+	}
+	coalesce_flush(&coal, now, 0);
+
+	if (n == -1)
+		usleep(MQTT_PUMP_MS * 1000);	/* queue stopped */
+
+	if (link_up)
+		drain_backlog(drain);
+}
+
+/* sparkplug_arm_will - register a fresh NDEATH (next bdSeq) as the will */
+static void sparkplug_arm_will(const struct config *cfg,
+			       MQTTAsync_connectOptions *conn_opts,
+			       MQTTAsync_willOptions *will,
+			       struct msg_buf **death)
+{
+	struct msg_buf *m = sparkplug_death(cfg);
+
+	if (!m)
+		return;		/* keep the previous will */
+
+	msg_put(*death);
+	*death = m;
+	will->topicName = m->topic;
+	will->message = NULL;
+	will->payload.data = m->data;
+	will->payload.len = (int)m->len;
+	will->qos = 1;
+	will->retained = 0;
+	conn_opts->will = will;
+}
+
+/*
+ * sparkplug_node - follow the link: NBIRTH and the NCMD subscription when
+ * it comes up, a new NBIRTH on a rebirth request, offline when it drops.
+ */
+static void sparkplug_node(const struct config *cfg, int *node_up)
+{
+	int up = connected && MQTTAsync_isConnected(client);
+	char topic[MSG_TOPIC_LEN];
+	struct msg_buf *birth;
+
+	if (!up) {
+		if (*node_up)
+			sparkplug_offline();
+		*node_up = 0;
+		return;
+	}
+	if (*node_up && !sparkplug_rebirth_pending())
+		return;
+
+	if (!*node_up) {
+		sparkplug_command_topic(cfg, topic, sizeof(topic));
+		MQTTAsync_subscribe(client, topic, 1, NULL);
+	}
+
+	birth = sparkplug_online(cfg);
+	if (!birth)
+		return;
+	if (mqtt_publish_msg(birth) == 0) {
+		*node_up = 1;
+	} else {
+		sparkplug_offline();
+		*node_up = 0;
+	}
+	msg_put(birth);
+}
+
 static void *mqtt_thread_fn(void *arg)
 {
 	const struct config *cfg = (const struct config *)arg;
 	char address[256];
 	int rc;
 	MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+	MQTTAsync_createOptions create_opts = MQTTAsync_createOptions_initializer;
 	MQTTAsync_SSLOptions ssl_opts = MQTTAsync_SSLOptions_initializer;
-	char *topic = NULL;
-	char *payload = NULL;
+	MQTTAsync_willOptions will_opts = MQTTAsync_willOptions_initializer;
+	struct msg_buf *msg = NULL;
+	struct msg_buf *death = NULL;
+	int node_up = 0;
+	struct spool_drain drain;
 
 	if (strcmp(cfg->mqtt.security_mode, "tls") == 0)
 		snprintf(address, sizeof(address), "ssl://%s:%d", cfg->mqtt.broker, cfg->mqtt.port);
@@ -143,13 +400,32 @@ static void *mqtt_thread_fn(void *arg)
 
 	printf("uri:%s\n", address);
 
-	rc = MQTTAsync_create(&client, address, cfg->mqtt.client_id,
-			      MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	/*
+	 * MQTT 5 by default for CBOR and MessagePack, to carry their content
+	 * type; Sparkplug B is identified by its topic namespace instead.
+	 */
+	sparkplug_mode = msg_fmt_from_mode(cfg->data_mode) == MSG_FMT_SPARKPLUG;
+	if (cfg->mqtt.protocol_version)
+		mqtt_v5 = cfg->mqtt.protocol_version == MQTTVERSION_5;
+	else
+		mqtt_v5 = msg_fmt_from_mode(cfg->data_mode) != MSG_FMT_JSON &&
+			  !sparkplug_mode;
+	if (mqtt_v5)
+		create_opts.MQTTVersion = MQTTVERSION_5;
+
+	rc = MQTTAsync_createWithOptions(&client, address, cfg->mqtt.client_id,
+					 MQTTCLIENT_PERSISTENCE_NONE, NULL,
+					 &create_opts);
 	if (rc != MQTTASYNC_SUCCESS) {
 		fprintf(stderr, "[MQTT] MQTTAsync_create failed: %d\n", rc);
 		mqtt_running = 0;
 		return NULL;
 	}
+	if (mqtt_v5 && fmt_props_init()) {
+		fprintf(stderr, "[MQTT] cannot build MQTT 5 properties, using 3.1.1\n");
+		fmt_props_free();
+		mqtt_v5 = 0;
+	}
 	fprintf(stderr, "Connecting to broker '%s' on port %d with client ID '%s'\n",
         cfg->mqtt.broker, cfg->mqtt.port, cfg->mqtt.client_id);
 
@@ -160,34 +436,89 @@ static void *mqtt_thread_fn(void *arg)
 	conn_opts.onSuccess = on_connect_success;
 	conn_opts.onFailure = on_connect_failure;
 	conn_opts.context = client;
+	if (mqtt_v5) {
+		/* MQTT 5 uses clean start and the *5 callbacks */
+		conn_opts.MQTTVersion = MQTTVERSION_5;
+		conn_opts.cleansession = 0;
+		conn_opts.cleanstart = 1;
+		conn_opts.onSuccess = NULL;
+		conn_opts.onFailure = NULL;
+		conn_opts.onSuccess5 = on_connect_success5;
+		conn_opts.onFailure5 = on_connect_failure5;
+	}
+
+	if (cfg->mqtt.spool_dir[0] &&
+	    spool_open(cfg->mqtt.spool_dir,
+		       (uint64_t)cfg->mqtt.spool_max_mb << 20) == 0)
+		fprintf(stderr, "[MQTT] store-and-forward spool in %s\n",
+			cfg->mqtt.spool_dir);
 
-	/* attempt connect with retries */
+	drain.rate = cfg->mqtt.spool_drain_rate > 0 ?
+		     cfg->mqtt.spool_drain_rate : DEFAULT_SPOOL_DRAIN_RATE;
+	drain.last_ns = sched_now_ns();
+	drain.tokens = 0;
+
+	coalesce_init(&coal, cfg->mqtt.coalesce_bytes,
+		      cfg->mqtt.coalesce_delay_ms, cfg->mqtt.coalesce_levels,
+		      mqtt_send);
+
+	/*
+	 * attempt connect with retries; a failed attempt clears connected
+	 * from its callback, so an outage of any length ends in a reconnect
+	 */
+	retry_ns = 0;
 	while (mqtt_running) {
-		if (!connected) {
+		if (!connected && sched_now_ns() >= retry_ns) {
+			if (sparkplug_mode)
+				sparkplug_arm_will(cfg, &conn_opts, &will_opts,
+						   &death);
+			/*
+			 * set before the attempt, its failure callback may run
+			 * before MQTTAsync_connect() returns; meanwhile give the
+			 * onSuccess callback a moment
+			 */
+			connected = 1;
+			retry_ns = sched_now_ns() + 1000000000ull;
 			rc = MQTTAsync_connect(client, &conn_opts);
 			if (rc == MQTTASYNC_SUCCESS) {
-				connected = 1;
 				fprintf(stderr, "[MQTT] connect in progress\n");
-				/* wait briefly for onSuccess callback or assume connected */
-				sleep(1);
 			} else {
-				fprintf(stderr, "[MQTT] connect failed rc=%d, retrying in 2s\n", rc);
-				sleep(2);
-				continue;
+				connected = 0;
+				fprintf(stderr, "[MQTT] connect failed rc=%d, retrying in %d ms\n",
+					rc, MQTT_RETRY_MS);
+				retry_ns = sched_now_ns() + MQTT_RETRY_MS * 1000000ull;
 			}
 		}
 
-		/* publish any queued messages */
-		if (data_queue_dequeue(&topic, &payload) == 0) {
-			if (topic && payload) {
-				mqtt_publish_msg(topic, payload);
-				free(topic);
-				free(payload);
-			}
-		} else {
-			/* queue stopped or interrupted; wait briefly */
-			sleep(1);
+		if (sparkplug_mode)
+			sparkplug_node(cfg, &node_up);
+
+		/* without a spool, messages wait in RAM while disconnected */
+		if (!spool_enabled() &&
+		    (!connected || sched_now_ns() < retry_ns)) {
+			usleep(MQTT_PUMP_MS * 1000);
+			continue;
 		}
+
+		link_up = connected && MQTTAsync_isConnected(client);
+		mqtt_pump(&drain);
+	}
+
+	coalesce_flush(&coal, 0, 1);
+
+	/* keep what is still queued in RAM for the next run */
+	while (spool_enabled() &&
+	       data_queue_dequeue_msg_timed(&msg, 0) == 0) {
+		spool_append(msg);
+		msg_put(msg);
+	}
+	spool_close();
+
+	/* a clean disconnect does not fire the will: send the NDEATH now */
+	if (sparkplug_mode && death && node_up) {
+		sparkplug_offline();
+		mqtt_publish_payload(death->topic, death->data, death->len,
+				     death->fmt);
 	}
 
 	/* disconnect cleanly */
@@ -197,21 +528,38 @@ static void *mqtt_thread_fn(void *arg)
 	}
 
 	MQTTAsync_destroy(&client);
+	msg_put(death);
+	fmt_props_free();
+	mqtt_v5 = 0;
 	return NULL;
 }
 
 int mqtt_start(const struct config *cfg)
 {
-	int rc;
+	int rc, policy;
 
 	if (!cfg)
 		return -1;
 
-	/* init queue */
-	rc = data_queue_init(Q_CAPACITY);
+	policy = q_overflow_from_str(cfg->mqtt.queue_overflow);
+	if (policy < 0) {
+		fprintf(stderr, "[MQTT] unknown queue_overflow '%s', using drop_oldest\n",
+			cfg->mqtt.queue_overflow);
+		policy = Q_OVERFLOW_DROP_OLDEST;
+	}
+
+	/* init buffer pool and queue */
+	rc = msg_pool_init(Q_CAPACITY + MSG_POOL_SPARE);
 	if (rc)
 		return -1;
 
+	rc = data_queue_init(Q_CAPACITY, policy);
+	if (rc) {
+		msg_pool_destroy();
+		return -1;
+	}
+	spill_mark = data_queue_capacity() / 4 * 3;
+
 	global_cfg = cfg;
 	mqtt_running = 1;
 
@@ -219,6 +567,7 @@ int mqtt_start(const struct config *cfg)
 	if (rc) {
 		mqtt_running = 0;
 		data_queue_destroy();
+		msg_pool_destroy();
 		return -1;
 	}
 	return 0;
@@ -230,10 +579,28 @@ void mqtt_stop(void)
 	data_queue_stop();
 	pthread_join(mqtt_thread, NULL);
 	data_queue_destroy();
+	msg_pool_destroy();
+}
+
+/*
+ * mqtt_publish - queue a copy of payload on the lane for prio (enum
+ * q_prio); control messages overtake any telemetry backlog.
+ */
+int mqtt_publish(const char *topic, const char *payload, int prio)
+{
+	return data_queue_enqueue(topic, payload, prio);
 }
 
-int mqtt_publish(const char *topic, const char *payload)
+/*
+ * mqtt_publish_buf - queue a message built in a pool buffer. Ownership of
+ * the caller's reference always passes to this function.
+ */
+int mqtt_publish_buf(struct msg_buf *m, int prio)
 {
-	return data_queue_enqueue(topic, payload);
+	if (data_queue_enqueue_msg(m, prio)) {
+		msg_put(m);
+		return -1;
+	}
+	return 0;
 }
 
@@ -0,0 +1,181 @@
+/*
+ * msgpool.c - fixed slab of publish buffers.
+ *
+ * All pooled buffers come from one allocation made at startup. Free
+ * buffers sit on a lock-free index stack whose head carries a generation
+ * tag against ABA, so producers on any thread can allocate without
+ * locking and the mqtt thread can release without locking. Requests larger
+ * than MSG_BUF_SIZE, or made while the pool is empty, fall back to malloc.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "msgpool.h"
+
+#define MSG_ALIGN	64
+
+static char *pool_mem;
+static size_t pool_stride;
+static _Atomic uint32_t *pool_next;
+static _Atomic uint64_t pool_head;	/* tag << 32 | (index + 1) */
+
+static struct msg_buf *pool_buf(size_t idx)
+{
+	return (struct msg_buf *)(pool_mem + idx * pool_stride);
+}
+
+static void pool_push(size_t idx)
+{
+	uint64_t old = atomic_load(&pool_head);
+	uint64_t new;
+
+	do {
+		atomic_store_explicit(&pool_next[idx], (uint32_t)old,
+				      memory_order_relaxed);
+		new = ((old >> 32) + 1) << 32 | (uint64_t)(idx + 1);
+	} while (!atomic_compare_exchange_weak(&pool_head, &old, new));
+}
+
+static struct msg_buf *pool_pop(void)
+{
+	uint64_t old = atomic_load(&pool_head);
+	uint64_t new;
+	uint32_t idx;
+
+	do {
+		idx = (uint32_t)old;
+		if (!idx)
+			return NULL;
+		new = ((old >> 32) + 1) << 32 |
+		      atomic_load_explicit(&pool_next[idx - 1],
+					   memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak(&pool_head, &old, new));
+
+	return pool_buf(idx - 1);
+}
+
+int msg_pool_init(size_t count)
+{
+	size_t i;
+
+	pool_stride = (sizeof(struct msg_buf) + MSG_BUF_SIZE + MSG_ALIGN - 1) &
+		      ~(size_t)(MSG_ALIGN - 1);
+
+	pool_mem = aligned_alloc(MSG_ALIGN, pool_stride * count);
+	pool_next = calloc(count, sizeof(*pool_next));
+	if (!pool_mem || !pool_next) {
+		msg_pool_destroy();
+		return -1;
+	}
+
+	atomic_store(&pool_head, 0);
+	for (i = 0; i < count; i++) {
+		struct msg_buf *m = pool_buf(i);
+
+		m->slot = (int)i + 1;
+		m->cap = MSG_BUF_SIZE;
+		pool_push(i);
+	}
+	return 0;
+}
+
+void msg_pool_destroy(void)
+{
+	free(pool_mem);
+	free((void *)pool_next);
+	pool_mem = NULL;
+	pool_next = NULL;
+	atomic_store(&pool_head, 0);
+}
+
+/*
+ * msg_alloc - buffer with room for at least size payload bytes (including
+ * the NUL), holding one reference.
+ */
+struct msg_buf *msg_alloc(size_t size)
+{
+	struct msg_buf *m = NULL;
+
+	if (size <= MSG_BUF_SIZE)
+		m = pool_pop();
+
+	if (!m) {
+		if (size < MSG_BUF_SIZE)
+			size = MSG_BUF_SIZE;
+		m = malloc(sizeof(*m) + size);
+		if (!m)
+			return NULL;
+		m->slot = 0;
+		m->cap = size;
+	}
+
+	atomic_init(&m->refs, 1);
+	m->len = 0;
+	m->prio = -1;
+	m->fmt = MSG_FMT_JSON;
+	m->session = 0;
+	m->topic[0] = '\0';
+	m->data[0] = '\0';
+	return m;
+}
+
+struct msg_buf *msg_from_strings(const char *topic, const char *payload)
+{
+	size_t len = strlen(payload);
+	struct msg_buf *m;
+
+	m = msg_alloc(len + 1);
+	if (!m)
+		return NULL;
+
+	strncpy(m->topic, topic, sizeof(m->topic) - 1);
+	m->topic[sizeof(m->topic) - 1] = '\0';
+	memcpy(m->data, payload, len + 1);
+	m->len = len;
+	return m;
+}
+
+void msg_get(struct msg_buf *m)
+{
+	atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+void msg_put(struct msg_buf *m)
+{
+	if (!m || atomic_fetch_sub_explicit(&m->refs, 1,
+					    memory_order_acq_rel) != 1)
+		return;
+
+	if (m->slot)
+		pool_push(m->slot - 1);
+	else
+		free(m);
+}
+
+static const char *const fmt_content_types[MSG_FMT_COUNT] = {
+	[MSG_FMT_JSON]		= "application/json",
+	[MSG_FMT_CBOR]		= "application/cbor",
+	[MSG_FMT_MSGPACK]	= "application/msgpack",
+	[MSG_FMT_SPARKPLUG]	= "application/protobuf",
+};
+
+/* msg_fmt_from_mode - telemetry encoding for a config data_mode */
+int msg_fmt_from_mode(const char *data_mode)
+{
+	if (strcmp(data_mode, "cbor") == 0)
+		return MSG_FMT_CBOR;
+	if (strcmp(data_mode, "msgpack") == 0)
+		return MSG_FMT_MSGPACK;
+	if (strcmp(data_mode, "sparkplug") == 0)
+		return MSG_FMT_SPARKPLUG;
+	return MSG_FMT_JSON;	/* "processed" and "raw" */
+}
+
+const char *msg_fmt_content_type(int fmt)
+{
+	if (fmt < 0 || fmt >= MSG_FMT_COUNT)
+		fmt = MSG_FMT_JSON;
+	return fmt_content_types[fmt];
+}
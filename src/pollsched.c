@@ -0,0 +1,201 @@
+/*
+ * pollsched.c - drift-free poll scheduling shared by both poll engines.
+ *
+ * Cycles are placed on a fixed grid (start + k * period) instead of
+ * sleeping a period after each cycle, so read and publish time no longer
+ * stretch the real sampling interval. When a cycle runs past its next
+ * slot the configured overrun policy decides what happens to the slots
+ * that were missed, and the counters say how often that happened.
+ *
+ * Parameters may poll at their own rate. The device then ticks at the
+ * GCD of the rates and a timing wheel picks the parameters due per slot.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pollsched.h"
+
+int sched_policy_from_str(const char *policy)
+{
+	if (strcmp(policy, "catchup") == 0)
+		return OVERRUN_CATCHUP;
+	if (strcmp(policy, "coalesce") == 0)
+		return OVERRUN_COALESCE;
+	return OVERRUN_SKIP;
+}
+
+const char *sched_policy_str(int policy)
+{
+	switch (policy) {
+	case OVERRUN_CATCHUP:
+		return "catchup";
+	case OVERRUN_COALESCE:
+		return "coalesce";
+	default:
+		return "skip";
+	}
+}
+
+uint64_t sched_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void sched_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+void sched_init(struct poll_sched *s, int period_ms, int policy,
+		uint64_t start_ns)
+{
+	memset(s, 0, sizeof(*s));
+	s->period_ns = (uint64_t)(period_ms > 0 ? period_ms : 1) * 1000000ull;
+	s->policy = policy;
+	s->next_ns = start_ns;
+	s->due_ns = start_ns;
+}
+
+/*
+ * sched_begin - a cycle is starting now; record how late it is against
+ * the grid slot it stands for.
+ */
+void sched_begin(struct poll_sched *s, uint64_t now)
+{
+	int64_t late = (int64_t)(now - s->next_ns);
+
+	s->stats.cycles++;
+	s->stats.lateness_ns = late;
+	if (late > s->stats.max_lateness_ns)
+		s->stats.max_lateness_ns = late;
+}
+
+/*
+ * sched_next - advance to the next slot after a cycle (or a skipped cycle)
+ * and return the absolute time the next one should start.
+ */
+uint64_t sched_next(struct poll_sched *s, uint64_t now)
+{
+	uint64_t missed;
+
+	s->next_ns += s->period_ns;
+	if (s->next_ns > now) {
+		s->slot++;
+		s->due_ns = s->next_ns;
+		return s->due_ns;
+	}
+
+	/* overrun: slots next_ns .. now have already passed */
+	s->stats.overruns++;
+	missed = (now - s->next_ns) / s->period_ns + 1;
+	s->slot++;
+
+	switch (s->policy) {
+	case OVERRUN_CATCHUP:
+		if (missed <= SCHED_MAX_CATCHUP) {
+			s->due_ns = s->next_ns;
+			break;
+		}
+		/* too far behind to ever catch up: realign */
+		/* fall through */
+	case OVERRUN_SKIP:
+	default:
+		s->stats.skipped += missed;
+		s->slot += missed;
+		s->next_ns += missed * s->period_ns;
+		s->due_ns = s->next_ns;
+		break;
+	case OVERRUN_COALESCE:
+		s->stats.skipped += missed - 1;
+		s->slot += missed - 1;
+		s->next_ns += (missed - 1) * s->period_ns;
+		s->due_ns = now;
+		break;
+	}
+	return s->due_ns;
+}
+
+struct wheel_due {
+	struct param_wheel *pw;
+	uint32_t mask;
+};
+
+static int gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static int param_interval_ms(const struct io_device *dev, int i)
+{
+	int ms = dev->parameters[i].poll_interval_ms;
+
+	if (ms <= 0)
+		ms = dev->poll_interval_ms;
+	return ms > 0 ? ms : 1;
+}
+
+/*
+ * param_wheel_init - place every parameter on the wheel, due in the first
+ * slot. Returns the tick the device has to be scheduled at.
+ */
+int param_wheel_init(struct param_wheel *pw, const struct io_device *dev)
+{
+	int tick = dev->poll_interval_ms > 0 ? dev->poll_interval_ms : 1;
+	int i;
+
+	for (i = 0; i < dev->parameter_count; i++)
+		tick = gcd(tick, param_interval_ms(dev, i));
+	if (tick < WHEEL_MIN_TICK_MS)
+		tick = WHEEL_MIN_TICK_MS;
+
+	tw_init(&pw->wheel, 0);
+	pw->tick_ms = tick;
+	pw->count = dev->parameter_count;
+
+	for (i = 0; i < pw->count; i++) {
+		uint64_t ticks = (param_interval_ms(dev, i) + tick / 2) / tick;
+
+		pw->interval[i] = ticks ? ticks : 1;
+		pw->timers[i].id = i;
+		pw->timers[i].expires = 1;
+		tw_add(&pw->wheel, &pw->timers[i]);
+	}
+	return tick;
+}
+
+static void param_wheel_expire(struct tw_timer *t, void *arg)
+{
+	struct wheel_due *due = arg;
+
+	due->mask |= 1u << t->id;
+	t->expires += due->pw->interval[t->id];
+	tw_add(&due->pw->wheel, t);
+}
+
+/*
+ * param_wheel_due - parameters due in schedule slot "slot", including any
+ * that fell due in slots the scheduler skipped.
+ */
+uint32_t param_wheel_due(struct param_wheel *pw, uint64_t slot)
+{
+	struct wheel_due due = { pw, 0 };
+
+	tw_advance(&pw->wheel, slot + 1, param_wheel_expire, &due);
+	return due.mask;
+}
@@ -0,0 +1,147 @@
+/*
+ * rbe.c - report by exception.
+ *
+ * Keeps the raw values a device last reported and decides, per poll cycle,
+ * which parameters are worth reporting again: a failed read or a recovery,
+ * a coil that flipped, or a register value whose scaled value moved past
+ * the parameter's deadband. The threshold is the larger of the absolute
+ * deadband and deadband_pct percent of the last reported value; with
+ * neither set any change counts. Values spanning several registers are
+ * decoded first, as the deadband applies to the value and not to its
+ * words. Comparisons are against the last value reported, not the last
+ * value read, so a slow drift still gets out once it adds up.
+ *
+ * A shadow belongs to the thread polling its device.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rbe.h"
+#include "bitpack.h"
+#include "regdecode.h"
+
+/* param_words - shadow words of a parameter, bit strings stay packed */
+static size_t param_words(const struct parameter *p)
+{
+	int n = param_span(p);
+
+	if (n && REG_IS_BIT(reg_type_from_str(p->type)))
+		return (p->count + 15) / 16;
+	return n;
+}
+
+int rbe_init(struct rbe_shadow *s, const struct io_device *dev)
+{
+	size_t words = 0;
+	int k;
+
+	memset(s, 0, sizeof(*s));
+	for (k = 0; k < dev->parameter_count; k++)
+		words += param_words(&dev->parameters[k]);
+	s->vals = calloc(words ? words : 1, sizeof(*s->vals));
+	if (!s->vals)
+		return -1;
+
+	words = 0;
+	for (k = 0; k < dev->parameter_count; k++) {
+		s->params[k].valid = -1;
+		s->params[k].vals = s->vals + words;
+		words += param_words(&dev->parameters[k]);
+	}
+	s->refresh_ns = (uint64_t)(dev->full_refresh_s > 0 ?
+				   dev->full_refresh_s : 0) * 1000000000ull;
+	return 0;
+}
+
+void rbe_free(struct rbe_shadow *s)
+{
+	free(s->vals);
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * moved - whether the value decoded from the registers in was and the one
+ * decoded from now differ by more than the deadband
+ */
+static int moved(const struct parameter *p, const struct param_slot *slot,
+		 const uint16_t *was, const uint16_t *now)
+{
+	double last, cur, thr;
+
+	if (!memcmp(was, now, data_type_words(slot->dtype) * sizeof(*now)))
+		return 0;
+	if (p->deadband <= 0 && p->deadband_pct <= 0)
+		return 1;
+
+	regs_decode(&last, was, 1, slot->dtype, slot->order, p->scale,
+		    p->offset);
+	regs_decode(&cur, now, 1, slot->dtype, slot->order, p->scale,
+		    p->offset);
+	thr = fabs(last) * p->deadband_pct / 100.0;
+	if (p->deadband > thr)
+		thr = p->deadband;
+	/* a NaN compares false, report rather than go silent */
+	return !(fabs(cur - last) <= thr);
+}
+
+/*
+ * rbe_update - fold a poll cycle into the shadow. Returns the due
+ * parameters to report, all of them when a full refresh is due at now
+ * (CLOCK_MONOTONIC ns), and records their values as reported.
+ */
+uint32_t rbe_update(struct rbe_shadow *s, const struct io_device *dev,
+		    const struct read_plan *plan, uint64_t now)
+{
+	uint32_t report = 0;
+	int full = 0;
+	int i, k;
+
+	if (s->refresh_ns && now >= s->next_full_ns) {
+		full = 1;
+		s->next_full_ns = now + s->refresh_ns;
+	}
+
+	for (i = 0; i < dev->parameter_count; i++) {
+		const struct parameter *p = &dev->parameters[i];
+		const struct param_slot *slot = &plan->slots[i];
+		struct rbe_param *rp = &s->params[i];
+		int diff = full || rp->valid != 1;
+
+		if (!(plan->mask & (1u << i)))
+			continue;
+
+		if (!read_plan_param_ok(plan, i)) {
+			if (rp->valid != 0 || full)
+				report |= 1u << i;	/* now null */
+			rp->valid = 0;
+			continue;
+		}
+
+		if (REG_IS_BIT(slot->type)) {
+			uint8_t *packed = (uint8_t *)rp->vals;
+
+			diff = diff || bits_differ(packed, plan->bits,
+						   slot->offset, p->count);
+			if (diff)
+				bits_extract(packed, plan->bits, slot->offset,
+					     p->count);
+		} else {
+			const uint16_t *regs = plan->regs + slot->offset;
+			int words = data_type_words(slot->dtype);
+
+			for (k = 0; k < p->count && !diff; k++)
+				diff = moved(p, slot, rp->vals + k * words,
+					     regs + k * words);
+			if (diff)
+				memcpy(rp->vals, regs,
+				       (size_t)param_span(p) * sizeof(*regs));
+		}
+		if (diff) {
+			rp->valid = 1;
+			report |= 1u << i;
+		}
+	}
+	return report;
+}
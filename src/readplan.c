@@ -0,0 +1,433 @@
+/*
+ * readplan.c - groups the parameters of one io_device into the fewest
+ * legal Modbus read requests.
+ *
+ *  - runs once per device and parameter subset, see plan_cache_get()
+ *  - parameters of the same type are merged when they overlap, touch, or
+ *    are separated by at most io_device.max_gap unused addresses
+ *  - every block honours the 125 register / 2000 coil request limits;
+ *    a parameter bigger than that is split over consecutive blocks
+ *  - the bit image is packed; a new bit block starts on a byte boundary
+ *    and 2000 being a multiple of 8 keeps split blocks contiguous
+ *  - a register parameter of count values spans count times the
+ *    registers of its data_type; a value may straddle two blocks
+ *  - a bitfield ("bits") is read with the holding registers around it,
+ *    so any number of flags in one status word cost one read; a table of
+ *    per-register masks copies them into the bit image afterwards
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "readplan.h"
+#include "bitpack.h"
+#include "regdecode.h"
+
+struct span {
+	int param;
+	int type;
+	int address;
+	int count;
+};
+
+static int type_limit(int type)
+{
+	return REG_IS_BIT(type) ? PLAN_MAX_READ_BITS : PLAN_MAX_READ_REGS;
+}
+
+int reg_type_from_str(const char *type)
+{
+	if (strcmp(type, "coil") == 0)
+		return REG_COIL;
+	if (strcmp(type, "holding") == 0)
+		return REG_HOLDING;
+	if (strcmp(type, "input") == 0)
+		return REG_INPUT;
+	if (strcmp(type, "input_bits") == 0)
+		return REG_DISCRETE;
+	if (strcmp(type, "bits") == 0)
+		return REG_BITFIELD;
+	return REG_UNKNOWN;
+}
+
+/*
+ * param_span - bits or registers a parameter reads, 0 if it cannot be
+ * read (unknown type, data_type or word_order, no count, bad bit).
+ */
+int param_span(const struct parameter *p)
+{
+	int type = reg_type_from_str(p->type);
+	int dtype = data_type_from_str(p->data_type);
+
+	if (type == REG_UNKNOWN || p->count <= 0)
+		return 0;
+	if (type == REG_BITFIELD)
+		return p->bit < 0 || p->bit > 15 ? 0 : (p->bit + p->count + 15) / 16;
+	if (REG_IS_BIT(type))
+		return p->count;
+	if (dtype == DTYPE_UNKNOWN ||
+	    word_order_from_str(p->word_order) == WO_UNKNOWN)
+		return 0;
+	return p->count * data_type_words(dtype);
+}
+
+static int span_cmp(const void *a, const void *b)
+{
+	const struct span *x = a;
+	const struct span *y = b;
+
+	if (x->type != y->type)
+		return x->type - y->type;
+	if (x->address != y->address)
+		return x->address - y->address;
+	return y->count - x->count;
+}
+
+static struct read_block *plan_new_block(struct read_plan *plan, int *cap,
+					 int type, int address, int offset)
+{
+	struct read_block *b;
+
+	if (plan->block_count == *cap) {
+		int ncap = *cap ? *cap * 2 : 8;
+
+		b = realloc(plan->blocks, ncap * sizeof(*b));
+		if (!b)
+			return NULL;
+		plan->blocks = b;
+		*cap = ncap;
+	}
+
+	b = &plan->blocks[plan->block_count++];
+	b->type = type;
+	b->address = address;
+	b->count = 0;
+	b->offset = offset;
+	b->status = -1;
+	return b;
+}
+
+/*
+ * plan_grow - extend the open (last) block up to address end, chaining
+ * adjacent blocks whenever the request limit is reached.
+ */
+static int plan_grow(struct read_plan *plan, int *cap, int end)
+{
+	struct read_block *b = &plan->blocks[plan->block_count - 1];
+	int limit = type_limit(b->type);
+
+	while (b->address + b->count < end) {
+		int room = limit - b->count;
+		int need = end - (b->address + b->count);
+
+		if (room == 0) {
+			b = plan_new_block(plan, cap, b->type,
+					   b->address + b->count,
+					   b->offset + b->count);
+			if (!b)
+				return -ENOMEM;
+			continue;
+		}
+		b->count += need < room ? need : room;
+	}
+	return 0;
+}
+
+/*
+ * plan_fields - give every planned bitfield its place in the bit image
+ * and its mask table entries, one per register it covers. Until here
+ * its slot offset is that of its first register.
+ */
+static int plan_fields(struct read_plan *plan, const struct io_device *dev)
+{
+	int n = 0;
+	int i;
+
+	for (i = 0; i < dev->parameter_count; i++)
+		if (plan->slots[i].type == REG_BITFIELD &&
+		    plan->slots[i].first_block >= 0)
+			n += param_span(&dev->parameters[i]);
+	if (!n)
+		return 0;
+
+	plan->fields = calloc(n, sizeof(*plan->fields));
+	if (!plan->fields)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->parameter_count; i++) {
+		const struct parameter *p = &dev->parameters[i];
+		struct param_slot *slot = &plan->slots[i];
+		int bit = p->bit;
+		int done = 0;
+		int reg = slot->offset;
+
+		if (slot->type != REG_BITFIELD || slot->first_block < 0)
+			continue;
+
+		slot->offset = plan->bit_count;
+		for (; done < p->count; reg++, bit = 0) {
+			struct bit_field *f = &plan->fields[plan->field_count++];
+			int width = 16 - bit < p->count - done ?
+				    16 - bit : p->count - done;
+
+			f->reg = reg;
+			f->shift = (uint8_t)bit;
+			f->width = (uint8_t)width;
+			f->mask = (uint16_t)(((1u << width) - 1) << bit);
+			f->dst = slot->offset + done;
+			done += width;
+		}
+		plan->bit_count += p->count;
+	}
+	return 0;
+}
+
+int read_plan_build(struct read_plan *plan, const struct io_device *dev,
+		    uint32_t mask)
+{
+	struct span spans[MAX_PARAMETERS];
+	int nspans = 0;
+	int cap = 0;
+	int open = -1;
+	int i, k;
+
+	memset(plan, 0, sizeof(*plan));
+	plan->mask = mask;
+
+	for (i = 0; i < dev->parameter_count; i++) {
+		const struct parameter *p = &dev->parameters[i];
+
+		plan->slots[i].type = reg_type_from_str(p->type);
+		plan->slots[i].dtype = data_type_from_str(p->data_type);
+		plan->slots[i].order = word_order_from_str(p->word_order);
+		plan->slots[i].first_block = -1;
+		if (!(mask & (1u << i)) || !param_span(p) || p->address < 0)
+			continue;
+
+		spans[nspans].param = i;
+		spans[nspans].type = plan->slots[i].type == REG_BITFIELD ?
+				     REG_HOLDING : plan->slots[i].type;
+		spans[nspans].address = p->address;
+		spans[nspans].count = param_span(p);
+		nspans++;
+	}
+
+	qsort(spans, nspans, sizeof(spans[0]), span_cmp);
+
+	for (i = 0; i < nspans; i++) {
+		const struct span *s = &spans[i];
+		struct param_slot *slot = &plan->slots[s->param];
+		int end = s->address + s->count;
+		int *img_len;
+		struct read_block *b = NULL;
+
+		img_len = REG_IS_BIT(s->type) ? &plan->bit_count : &plan->reg_count;
+
+		if (open >= 0) {
+			b = &plan->blocks[open];
+			if (b->type != s->type) {
+				b = NULL;
+			} else if (s->address > b->address + b->count) {
+				int gap = s->address - (b->address + b->count);
+
+				if (gap > dev->max_gap ||
+				    end - b->address > type_limit(s->type))
+					b = NULL;
+			}
+		}
+
+		if (!b) {
+			if (REG_IS_BIT(s->type))
+				*img_len = (*img_len + 7) & ~7;
+			b = plan_new_block(plan, &cap, s->type, s->address,
+					   *img_len);
+			if (!b)
+				goto nomem;
+		}
+
+		/* walk back to the block of the run holding the start address */
+		k = plan->block_count - 1;
+		while (plan->blocks[k].address > s->address)
+			k--;
+		slot->first_block = k;
+		slot->offset = plan->blocks[k].offset +
+			       (s->address - plan->blocks[k].address);
+
+		if (plan_grow(plan, &cap, end))
+			goto nomem;
+		open = plan->block_count - 1;
+		*img_len = plan->blocks[open].offset + plan->blocks[open].count;
+
+		k = slot->first_block;
+		while (plan->blocks[k].address + plan->blocks[k].count < end)
+			k++;
+		slot->nblocks = k - slot->first_block + 1;
+	}
+
+	if (plan_fields(plan, dev))
+		goto nomem;
+
+	if (plan->reg_count) {
+		plan->regs = calloc(plan->reg_count, sizeof(*plan->regs));
+		if (!plan->regs)
+			goto nomem;
+	}
+	if (plan->bit_count) {
+		plan->bits = calloc(BITS_BYTES(plan->bit_count), 1);
+		if (!plan->bits)
+			goto nomem;
+	}
+	return 0;
+
+nomem:
+	read_plan_free(plan);
+	return -ENOMEM;
+}
+
+/*
+ * read_plan_probe - the cheapest request that shows a device is alive: one
+ * register (or bit) at the start of its first readable parameter. Nothing
+ * is decoded from it, its slots map no parameter. Returns -1 when the
+ * device has no readable parameter.
+ */
+int read_plan_probe(struct read_plan *plan, const struct io_device *dev)
+{
+	int i, k;
+
+	for (i = 0; i < dev->parameter_count; i++) {
+		if (!param_span(&dev->parameters[i]) ||
+		    dev->parameters[i].address < 0)
+			continue;
+		if (read_plan_build(plan, dev, 1u << i))
+			return -1;
+
+		plan->mask = 0;
+		plan->block_count = 1;
+		plan->blocks[0].count = 1;
+		plan->field_count = 0;
+		for (k = 0; k < (int)MAX_PARAMETERS; k++)
+			plan->slots[k].first_block = -1;
+		return 0;
+	}
+	memset(plan, 0, sizeof(*plan));
+	return -1;
+}
+
+void read_plan_free(struct read_plan *plan)
+{
+	free(plan->blocks);
+	free(plan->regs);
+	free(plan->bits);
+	free(plan->fields);
+	plan->blocks = NULL;
+	plan->regs = NULL;
+	plan->bits = NULL;
+	plan->fields = NULL;
+	plan->block_count = 0;
+	plan->field_count = 0;
+}
+
+/*
+ * read_plan_extract - copy the bitfields out of the register image into
+ * the bit image. Call once a cycle's blocks are read; the fields of a
+ * failed read copy stale bits nobody looks at (read_plan_param_ok()).
+ */
+void read_plan_extract(struct read_plan *plan)
+{
+	const struct bit_field *f = plan->fields;
+	const struct bit_field *end = f + plan->field_count;
+
+	for (; f < end; f++) {
+		unsigned int v = (plan->regs[f->reg] & f->mask) >> f->shift;
+
+		if (f->width == 1) {
+			uint8_t m = (uint8_t)(1u << (f->dst % 8));
+
+			if (v)
+				plan->bits[f->dst / 8] |= m;
+			else
+				plan->bits[f->dst / 8] &= (uint8_t)~m;
+		} else {
+			bits_put(plan->bits, f->dst, v, f->width);
+		}
+	}
+}
+
+/*
+ * read_plan_param_ok - true when every block covering parameter idx was
+ * read successfully in the last cycle.
+ */
+int read_plan_param_ok(const struct read_plan *plan, int idx)
+{
+	const struct param_slot *slot = &plan->slots[idx];
+	int k;
+
+	if (slot->first_block < 0)
+		return 0;
+
+	for (k = 0; k < slot->nblocks; k++)
+		if (plan->blocks[slot->first_block + k].status)
+			return 0;
+	return 1;
+}
+
+/* read_plan_answered - true when any block got a response last cycle */
+int read_plan_answered(const struct read_plan *plan)
+{
+	int i;
+
+	for (i = 0; i < plan->block_count; i++)
+		if (!plan->blocks[i].status)
+			return 1;
+	return 0;
+}
+
+uint32_t read_plan_all_mask(const struct io_device *dev)
+{
+	if (dev->parameter_count >= 32)
+		return 0xffffffffu;
+	return (1u << dev->parameter_count) - 1;
+}
+
+/*
+ * plan_cache_get - plan for the parameters in mask, built on first use.
+ * Returns NULL when the plan cannot be built.
+ */
+struct read_plan *plan_cache_get(struct plan_cache *c,
+				 const struct io_device *dev, uint32_t mask)
+{
+	struct read_plan *plan;
+	int i;
+
+	for (i = 0; i < c->count; i++)
+		if (c->plans[i].mask == mask)
+			return &c->plans[i];
+
+	if (c->count < PLAN_CACHE_SIZE) {
+		plan = &c->plans[c->count];
+	} else {
+		plan = &c->plans[c->next_victim];
+		c->next_victim = (c->next_victim + 1) % PLAN_CACHE_SIZE;
+		read_plan_free(plan);
+	}
+
+	if (read_plan_build(plan, dev, mask)) {
+		plan->mask = 0;
+		return NULL;
+	}
+
+	if (c->count < PLAN_CACHE_SIZE)
+		c->count++;
+	return plan;
+}
+
+void plan_cache_free(struct plan_cache *c)
+{
+	int i;
+
+	for (i = 0; i < c->count; i++)
+		read_plan_free(&c->plans[i]);
+	c->count = 0;
+	c->next_victim = 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * regdecode.c - typed values out of a block of registers.
+ *
+ * regs_decode() turns a run of register values as they sit in a read
+ * plan's image into doubles in one pass: reassemble each value from its
+ * registers in the parameter's word order, convert it, then scale and add
+ * the offset. With SSE2 four 32-bit values (eight 16-bit, two float64)
+ * are reordered with shifts and shuffles and converted two doubles per
+ * instruction. NEON on the 32-bit ARM targets has no double lanes, so
+ * there it only swaps bytes and the scalar loops convert with VFP.
+ * Whatever a vector loop leaves over goes through the scalar loops, one
+ * per type, which also are the reference the vector paths are checked
+ * against.
+ */
+
+#include <string.h>
+
+#include "regdecode.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define REGS_NEON
+#endif
+
+static const char *const dtype_names[] = {
+	[DTYPE_UINT16] = "uint16",
+	[DTYPE_INT16] = "int16",
+	[DTYPE_UINT32] = "uint32",
+	[DTYPE_INT32] = "int32",
+	[DTYPE_FLOAT32] = "float32",
+	[DTYPE_UINT64] = "uint64",
+	[DTYPE_INT64] = "int64",
+	[DTYPE_FLOAT64] = "float64",
+};
+
+static const char *const order_names[] = {
+	[WO_ABCD] = "ABCD",
+	[WO_CDAB] = "CDAB",
+	[WO_BADC] = "BADC",
+	[WO_DCBA] = "DCBA",
+};
+
+/* data_type_from_str - "" is the plain register, "float"/"double" alias */
+int data_type_from_str(const char *s)
+{
+	int i;
+
+	if (!s[0])
+		return DTYPE_UINT16;
+	if (strcmp(s, "float") == 0)
+		return DTYPE_FLOAT32;
+	if (strcmp(s, "double") == 0)
+		return DTYPE_FLOAT64;
+	for (i = 0; i < (int)(sizeof(dtype_names) / sizeof(dtype_names[0])); i++)
+		if (strcmp(s, dtype_names[i]) == 0)
+			return i;
+	return DTYPE_UNKNOWN;
+}
+
+int word_order_from_str(const char *s)
+{
+	int i;
+
+	if (!s[0])
+		return WO_ABCD;
+	for (i = 0; i < (int)(sizeof(order_names) / sizeof(order_names[0])); i++)
+		if (strcmp(s, order_names[i]) == 0)
+			return i;
+	return WO_UNKNOWN;
+}
+
+/* data_type_words - registers per value */
+int data_type_words(int type)
+{
+	switch (type) {
+	case DTYPE_UINT32:
+	case DTYPE_INT32:
+	case DTYPE_FLOAT32:
+		return 2;
+	case DTYPE_UINT64:
+	case DTYPE_INT64:
+	case DTYPE_FLOAT64:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+static uint16_t raw16(const uint16_t *r, int order)
+{
+	return order & WO_BYTE_SWAP ? (uint16_t)(r[0] >> 8 | r[0] << 8) : r[0];
+}
+
+static uint32_t raw32(const uint16_t *r, int order)
+{
+	uint32_t v = order & WO_WORD_SWAP ? (uint32_t)r[1] << 16 | r[0] :
+					    (uint32_t)r[0] << 16 | r[1];
+
+	if (order & WO_BYTE_SWAP)
+		v = (v & 0x00ff00ffu) << 8 | (v >> 8 & 0x00ff00ffu);
+	return v;
+}
+
+static uint64_t raw64(const uint16_t *r, int order)
+{
+	uint64_t v = order & WO_WORD_SWAP ?
+		     (uint64_t)raw32(r + 2, order) << 32 | raw32(r, order) :
+		     (uint64_t)raw32(r, order) << 32 | raw32(r + 2, order);
+
+	return v;
+}
+
+static float f32_from_bits(uint32_t u)
+{
+	float f;
+
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static double f64_from_bits(uint64_t u)
+{
+	double d;
+
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+/* regs_raw - the bits of the value at regs, most significant word first */
+uint64_t regs_raw(const uint16_t *regs, int type, int order)
+{
+	switch (data_type_words(type)) {
+	case 2:
+		return raw32(regs, order);
+	case 4:
+		return raw64(regs, order);
+	default:
+		return raw16(regs, order);
+	}
+}
+
+/*
+ * decode_scalar - values i to n, one loop per type so that nothing is
+ * decided per value
+ */
+static void decode_scalar(double *out, const uint16_t *regs, int i, int n,
+			  int type, int order, double scale, double offset)
+{
+	switch (type) {
+	case DTYPE_INT16:
+		for (; i < n; i++)
+			out[i] = (int16_t)raw16(regs + i, order) * scale + offset;
+		break;
+	case DTYPE_UINT32:
+		for (; i < n; i++)
+			out[i] = raw32(regs + 2 * i, order) * scale + offset;
+		break;
+	case DTYPE_INT32:
+		for (; i < n; i++)
+			out[i] = (int32_t)raw32(regs + 2 * i, order) * scale +
+				 offset;
+		break;
+	case DTYPE_FLOAT32:
+		for (; i < n; i++)
+			out[i] = f32_from_bits(raw32(regs + 2 * i, order)) *
+				 scale + offset;
+		break;
+	case DTYPE_UINT64:
+		for (; i < n; i++)
+			out[i] = (double)raw64(regs + 4 * i, order) * scale +
+				 offset;
+		break;
+	case DTYPE_INT64:
+		for (; i < n; i++)
+			out[i] = (double)(int64_t)raw64(regs + 4 * i, order) *
+				 scale + offset;
+		break;
+	case DTYPE_FLOAT64:
+		for (; i < n; i++)
+			out[i] = f64_from_bits(raw64(regs + 4 * i, order)) *
+				 scale + offset;
+		break;
+	default:
+		for (; i < n; i++)
+			out[i] = raw16(regs + i, order) * scale + offset;
+		break;
+	}
+}
+
+#if defined(__SSE2__)
+static __m128i swap_bytes16(__m128i x)
+{
+	return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static void store_scaled(double *out, __m128d d, __m128d vs, __m128d vo)
+{
+	_mm_storeu_pd(out, _mm_add_pd(_mm_mul_pd(d, vs), vo));
+}
+
+/* decode_simd - values done, the caller finishes the rest */
+static int decode_simd(double *out, const uint16_t *regs, int n, int type,
+		       int order, double scale, double offset)
+{
+	const __m128d vs = _mm_set1_pd(scale);
+	const __m128d vo = _mm_set1_pd(offset);
+	int i = 0;
+
+	switch (type) {
+	case DTYPE_UINT16:
+	case DTYPE_INT16:
+		for (; i + 8 <= n; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(regs + i));
+			__m128i lo, hi;
+
+			if (order & WO_BYTE_SWAP)
+				x = swap_bytes16(x);
+			if (type == DTYPE_INT16) {
+				lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+				hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+			} else {
+				lo = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+				hi = _mm_unpackhi_epi16(x, _mm_setzero_si128());
+			}
+			store_scaled(out + i, _mm_cvtepi32_pd(lo), vs, vo);
+			store_scaled(out + i + 2,
+				     _mm_cvtepi32_pd(_mm_srli_si128(lo, 8)), vs, vo);
+			store_scaled(out + i + 4, _mm_cvtepi32_pd(hi), vs, vo);
+			store_scaled(out + i + 6,
+				     _mm_cvtepi32_pd(_mm_srli_si128(hi, 8)), vs, vo);
+		}
+		break;
+
+	case DTYPE_UINT32:
+	case DTYPE_INT32:
+	case DTYPE_FLOAT32:
+		for (; i + 4 <= n; i += 4) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(regs + 2 * i));
+			__m128d lo, hi;
+
+			/* a lane holds its first register in the low half */
+			if (order & WO_BYTE_SWAP)
+				x = swap_bytes16(x);
+			if (!(order & WO_WORD_SWAP))
+				x = _mm_or_si128(_mm_slli_epi32(x, 16),
+						 _mm_srli_epi32(x, 16));
+
+			if (type == DTYPE_FLOAT32) {
+				__m128 f = _mm_castsi128_ps(x);
+
+				lo = _mm_cvtps_pd(f);
+				hi = _mm_cvtps_pd(_mm_movehl_ps(f, f));
+			} else if (type == DTYPE_INT32) {
+				lo = _mm_cvtepi32_pd(x);
+				hi = _mm_cvtepi32_pd(_mm_srli_si128(x, 8));
+			} else {
+				/* bias into int32 range and back, exact */
+				const __m128d bias = _mm_set1_pd(2147483648.0);
+
+				x = _mm_xor_si128(x, _mm_set1_epi32(INT32_MIN));
+				lo = _mm_add_pd(_mm_cvtepi32_pd(x), bias);
+				hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)),
+						bias);
+			}
+			store_scaled(out + i, lo, vs, vo);
+			store_scaled(out + i + 2, hi, vs, vo);
+		}
+		break;
+
+	case DTYPE_FLOAT64:
+		/* no 64-bit integer conversion before AVX-512, only float64 */
+		for (; i + 2 <= n; i += 2) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(regs + 4 * i));
+
+			if (order & WO_BYTE_SWAP)
+				x = swap_bytes16(x);
+			if (!(order & WO_WORD_SWAP)) {
+				x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+				x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+			}
+			store_scaled(out + i, _mm_castsi128_pd(x), vs, vo);
+		}
+		break;
+	}
+	return i;
+}
+#elif defined(REGS_NEON)
+static uint16x8_t swap_bytes16(uint16x8_t x)
+{
+	return vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(x)));
+}
+
+/*
+ * decode_simd - byte swap with NEON, eight registers at a time, into a
+ * stack copy the scalar loops convert; word order costs them nothing
+ */
+static int decode_simd(double *out, const uint16_t *regs, int n, int type,
+		       int order, double scale, double offset)
+{
+	uint16_t tmp[REGS_DECODE_BATCH];
+	int words = data_type_words(type);
+	int per = REGS_DECODE_BATCH / words;
+	int i, k, m;
+
+	if (!(order & WO_BYTE_SWAP))
+		return 0;
+
+	for (i = 0; i < n; i += m) {
+		/* whole vectors only, the caller does the rest */
+		m = (n - i < per ? n - i : per) & ~(8 / words - 1);
+		if (!m)
+			break;
+		for (k = 0; k < m * words; k += 8)
+			vst1q_u16(tmp + k,
+				  swap_bytes16(vld1q_u16(regs + words * i + k)));
+		decode_scalar(out + i, tmp, 0, m, type, order & ~WO_BYTE_SWAP,
+			      scale, offset);
+	}
+	return i;
+}
+#else
+static int decode_simd(double *out, const uint16_t *regs, int n, int type,
+		       int order, double scale, double offset)
+{
+	(void)out; (void)regs; (void)n; (void)type;
+	(void)order; (void)scale; (void)offset;
+	return 0;
+}
+#endif
+
+/*
+ * regs_decode - n values of type stored at regs in word order order, each
+ * times scale plus offset, into out.
+ */
+void regs_decode(double *out, const uint16_t *regs, int n, int type,
+		 int order, double scale, double offset)
+{
+	int i = decode_simd(out, regs, n, type, order, scale, offset);
+
+	decode_scalar(out, regs, i, n, type, order, scale, offset);
+}
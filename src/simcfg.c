@@ -0,0 +1,339 @@
+/*
+ * simcfg.c - configuration of the modbus_sim slave simulator and the
+ * waveforms its registers follow.
+ *
+ * {
+ *   "listen": "127.0.0.1", "threads": 2, "stats_interval_s": 5,
+ *   "slaves": [
+ *     { "name": "plc", "port": 15020, "count": 200, "units": 0,
+ *       "holding": { "start": 0, "count": 1000 }, "input": ..., "coils": ...,
+ *       "input_bits": ...,
+ *       "latency_ms": 5, "jitter_ms": 2, "drop_pct": 0.5,
+ *       "exception_pct": 0.1, "exception_code": 6, "max_connections": 1,
+ *       "waveforms": [
+ *         { "table": "holding", "address": 0, "type": "sine",
+ *           "period_ms": 10000, "amplitude": 1000, "offset": 1000,
+ *           "data_type": "uint16" }   // "int16" or "float32" (2 registers)
+ *       ] },
+ *     { "name": "bus", "serial": "/tmp/ttyRTU", "baud": 19200,
+ *       "parity": "E", "units": 4, "trace": true, ... }
+ *   ]
+ * }
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "simcfg.h"
+#include "cJSON.h"
+
+static const char *const table_names[SIM_TABLES] = {
+	[SIM_COILS] = "coils",
+	[SIM_DISCRETE] = "input_bits",
+	[SIM_HOLDING] = "holding",
+	[SIM_INPUT] = "input",
+};
+
+static const char *const wave_names[] = {
+	[WAVE_SINE] = "sine",
+	[WAVE_SAWTOOTH] = "sawtooth",
+	[WAVE_SQUARE] = "square",
+	[WAVE_RANDOM] = "random",
+	[WAVE_COUNTER] = "counter",
+};
+
+static int lookup(const char *const *names, int n, const char *s)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(names[i], s) == 0)
+			return i;
+	return -1;
+}
+
+static int get_int(cJSON *obj, const char *name, int dflt)
+{
+	cJSON *item = cJSON_GetObjectItem(obj, name);
+
+	return item && cJSON_IsNumber(item) ? item->valueint : dflt;
+}
+
+static double get_double(cJSON *obj, const char *name, double dflt)
+{
+	cJSON *item = cJSON_GetObjectItem(obj, name);
+
+	return item && cJSON_IsNumber(item) ? item->valuedouble : dflt;
+}
+
+static int parse_wave(cJSON *obj, struct sim_wave *w)
+{
+	cJSON *p;
+
+	memset(w, 0, sizeof(*w));
+	w->table = SIM_HOLDING;
+	p = cJSON_GetObjectItem(obj, "table");
+	if (p && cJSON_IsString(p))
+		w->table = lookup(table_names, SIM_TABLES, p->valuestring);
+
+	p = cJSON_GetObjectItem(obj, "type");
+	w->type = p && cJSON_IsString(p) ?
+		  lookup(wave_names, sizeof(wave_names) / sizeof(wave_names[0]),
+			 p->valuestring) : WAVE_SINE;
+
+	p = cJSON_GetObjectItem(obj, "data_type");
+	if (p && cJSON_IsString(p)) {
+		w->float32 = strcmp(p->valuestring, "float32") == 0;
+		w->is_signed = strcmp(p->valuestring, "int16") == 0;
+	}
+
+	w->address = get_int(obj, "address", 0);
+	w->period_s = get_int(obj, "period_ms", 10000) / 1000.0;
+	w->amplitude = get_double(obj, "amplitude", 100);
+	w->offset = get_double(obj, "offset", 0);
+
+	if (w->table < 0 || w->type < 0 || w->period_s <= 0 || w->address < 0)
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_group(cJSON *obj, struct sim_group *g)
+{
+	cJSON *p, *it;
+	int t;
+
+	memset(g, 0, sizeof(*g));
+	p = cJSON_GetObjectItem(obj, "name");
+	snprintf(g->name, sizeof(g->name), "%s",
+		 p && cJSON_IsString(p) ? p->valuestring : "slave");
+
+	g->port = get_int(obj, "port", 0);
+	g->count = get_int(obj, "count", 1);
+	g->units = get_int(obj, "units", 0);
+	g->trace = cJSON_IsTrue(cJSON_GetObjectItem(obj, "trace"));
+
+	p = cJSON_GetObjectItem(obj, "serial");
+	if (p && cJSON_IsString(p) &&
+	    snprintf(g->serial, sizeof(g->serial), "%s", p->valuestring) >=
+	    (int)sizeof(g->serial))
+		return -ENAMETOOLONG;
+	g->baud = get_int(obj, "baud", SIM_DEFAULT_BAUD);
+	p = cJSON_GetObjectItem(obj, "parity");
+	g->parity = p && cJSON_IsString(p) ? p->valuestring[0] : 'E';
+	if (g->serial[0]) {
+		/* a bus is one line, whatever port and count say */
+		g->port = 0;
+		g->count = 1;
+		if (g->baud <= 0 || !g->parity || !strchr("NEO", g->parity))
+			return -EINVAL;
+	} else if (g->port <= 0 || g->count < 1 || g->port + g->count > 65536) {
+		return -EINVAL;
+	}
+	if (g->units < 0 || g->units > SIM_MAX_UNITS)
+		return -EINVAL;
+
+	for (t = 0; t < SIM_TABLES; t++) {
+		p = cJSON_GetObjectItem(obj, table_names[t]);
+		g->tables[t].start = p ? get_int(p, "start", 0) : 0;
+		g->tables[t].count = p ? get_int(p, "count", 0) :
+					 SIM_DEFAULT_TABLE;
+		if (g->tables[t].start < 0 || g->tables[t].count < 0 ||
+		    g->tables[t].start + g->tables[t].count > 65536)
+			return -EINVAL;
+	}
+
+	g->latency_ms = get_int(obj, "latency_ms", 0);
+	g->jitter_ms = get_int(obj, "jitter_ms", 0);
+	g->drop_pct = get_double(obj, "drop_pct", 0);
+	g->exception_pct = get_double(obj, "exception_pct", 0);
+	g->exception_code = get_int(obj, "exception_code",
+				    MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+	g->max_connections = get_int(obj, "max_connections", 0);
+	if (g->latency_ms < 0 || g->jitter_ms < 0 || g->exception_code < 1 ||
+	    g->exception_code >= MODBUS_EXCEPTION_MAX)
+		return -EINVAL;
+
+	p = cJSON_GetObjectItem(obj, "waveforms");
+	if (p && cJSON_IsArray(p)) {
+		cJSON_ArrayForEach(it, p) {
+			if (g->wave_count == SIM_MAX_WAVES)
+				break;
+			if (parse_wave(it, &g->waves[g->wave_count]))
+				return -EINVAL;
+			g->wave_count++;
+		}
+	}
+	return 0;
+}
+
+int sim_load_config(const char *path, struct sim_config *cfg)
+{
+	FILE *fp;
+	long size;
+	char *buf;
+	cJSON *root, *p, *it;
+	int ports = 0;
+	int rc = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+	if (fseek(fp, 0, SEEK_END) < 0 || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) < 0) {
+		rc = -errno;
+		fclose(fp);
+		return rc;
+	}
+
+	buf = malloc(size + 1);
+	if (!buf) {
+		fclose(fp);
+		return -ENOMEM;
+	}
+	if (fread(buf, 1, size, fp) != (size_t)size) {
+		free(buf);
+		fclose(fp);
+		return -EIO;
+	}
+	buf[size] = '\0';
+	fclose(fp);
+
+	root = cJSON_Parse(buf);
+	free(buf);
+	if (!root)
+		return -EINVAL;
+
+	memset(cfg, 0, sizeof(*cfg));
+	p = cJSON_GetObjectItem(root, "listen");
+	snprintf(cfg->listen, sizeof(cfg->listen), "%s",
+		 p && cJSON_IsString(p) ? p->valuestring : "127.0.0.1");
+	cfg->threads = get_int(root, "threads", 1);
+	if (cfg->threads < 1)
+		cfg->threads = 1;
+	cfg->stats_interval_s = get_int(root, "stats_interval_s",
+					SIM_DEFAULT_STATS_S);
+
+	p = cJSON_GetObjectItem(root, "slaves");
+	if (p && cJSON_IsArray(p)) {
+		cJSON_ArrayForEach(it, p) {
+			struct sim_group *g = &cfg->groups[cfg->group_count];
+
+			if (cfg->group_count == SIM_MAX_GROUPS)
+				break;
+			rc = parse_group(it, g);
+			if (rc)
+				break;
+			ports += g->count;
+			if (ports > SIM_MAX_PORTS) {
+				rc = -E2BIG;
+				break;
+			}
+			cfg->group_count++;
+		}
+	}
+
+	cJSON_Delete(root);
+	return rc;
+}
+
+/* sim_rand - xorshift32, each slave has its own state */
+uint32_t sim_rand(uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static void put_register(modbus_mapping_t *map, int table, int address,
+			 uint16_t v)
+{
+	uint16_t *tab;
+	int idx;
+
+	if (table == SIM_HOLDING) {
+		tab = map->tab_registers;
+		idx = address - map->start_registers;
+		if (idx < 0 || idx >= map->nb_registers)
+			return;
+	} else {
+		tab = map->tab_input_registers;
+		idx = address - map->start_input_registers;
+		if (idx < 0 || idx >= map->nb_input_registers)
+			return;
+	}
+	tab[idx] = v;
+}
+
+static void put_bit(modbus_mapping_t *map, int table, int address, int v)
+{
+	uint8_t *tab;
+	int idx;
+
+	if (table == SIM_COILS) {
+		tab = map->tab_bits;
+		idx = address - map->start_bits;
+		if (idx < 0 || idx >= map->nb_bits)
+			return;
+	} else {
+		tab = map->tab_input_bits;
+		idx = address - map->start_input_bits;
+		if (idx < 0 || idx >= map->nb_input_bits)
+			return;
+	}
+	tab[idx] = v ? 1 : 0;
+}
+
+/*
+ * sim_wave_apply - store the value waveform w has t seconds after start.
+ * Addresses outside the slave's tables are ignored.
+ */
+void sim_wave_apply(const struct sim_wave *w, modbus_mapping_t *map,
+		    double t, uint32_t *seed)
+{
+	double phase = fmod(t / w->period_s, 1.0);
+	double f, v;
+
+	switch (w->type) {
+	case WAVE_SINE:
+		f = sin(2 * M_PI * phase);
+		break;
+	case WAVE_SAWTOOTH:
+		f = 2 * phase - 1;
+		break;
+	case WAVE_SQUARE:
+		f = phase < 0.5 ? 1 : -1;
+		break;
+	case WAVE_RANDOM:
+		f = sim_rand(seed) / 2147483647.5 - 1;
+		break;
+	case WAVE_COUNTER:
+	default:
+		f = floor(t / w->period_s);
+		break;
+	}
+	v = w->offset + w->amplitude * f;
+
+	if (w->table == SIM_COILS || w->table == SIM_DISCRETE) {
+		put_bit(map, w->table, w->address, v > w->offset);
+	} else if (w->float32) {
+		union {
+			float f;
+			uint32_t u;
+		} u = { .f = (float)v };
+
+		put_register(map, w->table, w->address, (uint16_t)(u.u >> 16));
+		put_register(map, w->table, w->address + 1, (uint16_t)u.u);
+	} else if (w->is_signed) {
+		v = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+		put_register(map, w->table, w->address, (uint16_t)(int16_t)lrint(v));
+	} else {
+		if (w->type == WAVE_COUNTER)
+			v = fmod(v, 65536.0);
+		v = v < 0 ? 0 : v > 65535 ? 65535 : v;
+		put_register(map, w->table, w->address, (uint16_t)lrint(v));
+	}
+}
@@ -0,0 +1,684 @@
+/*
+ * sparkplug.c - Sparkplug B payloads with a built-in protobuf encoder.
+ *
+ * Every MQTT session of the edge node starts with an NBIRTH, published by
+ * the mqtt thread as soon as the link is up, and ends with the NDEATH it
+ * registered as its will; both carry the same bdSeq. Once the node is
+ * born, each device announces itself with a DBIRTH holding every
+ * parameter as a metric with its name, alias and datatype, then sends
+ * DDATA holding only the aliases of metrics whose value changed past their
+ * deadband (rbe.c), and every metric each full_refresh_s. A device
+ * keeps its last values while the node is offline; its next DBIRTH
+ * carries them, so nothing is queued or spooled across a disconnect.
+ *
+ * The sequence number is added when a message is actually sent
+ * (sparkplug_seal), which keeps it gapless in send order. Messages from an
+ * earlier session are dropped there instead of reaching a host that has
+ * not seen the matching birth.
+ *
+ * Only what the payloads need is encoded: Payload.timestamp, metrics and
+ * seq; Metric.name, alias, datatype, is_null and the int, long, float,
+ * double, boolean and bytes values. An unscaled register value keeps its
+ * data_type (Int32, Float, ...), anything scaled becomes a Double. A
+ * "Node Control/Rebirth" NCMD starts a new session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "sparkplug.h"
+#include "mqtt.h"
+#include "dataq.h"
+#include "dtoa.h"
+#include "rbe.h"
+#include "bitpack.h"
+#include "regdecode.h"
+#include "pollsched.h"
+
+/* protobuf wire types */
+#define PB_VARINT	0
+#define PB_FIXED64	1
+#define PB_LEN		2
+#define PB_FIXED32	5
+
+/* Payload fields */
+#define PL_TIMESTAMP	1
+#define PL_METRIC	2
+#define PL_SEQ		3
+
+/* Metric fields */
+#define MT_NAME		1
+#define MT_ALIAS	2
+#define MT_DATATYPE	4
+#define MT_IS_NULL	7
+#define MT_INT		10
+#define MT_LONG		11
+#define MT_FLOAT	12
+#define MT_DOUBLE	13
+#define MT_BOOLEAN	14
+#define MT_BYTES	16
+
+/* Sparkplug DataType values */
+#define DT_INT16		2
+#define DT_INT32		3
+#define DT_INT64		4
+#define DT_UINT16		6
+#define DT_UINT32		7
+#define DT_UINT64		8
+#define DT_FLOAT		9
+#define DT_DOUBLE		10
+#define DT_BOOLEAN		11
+#define DT_UINT16_ARRAY		27
+#define DT_DOUBLE_ARRAY		31
+#define DT_BOOLEAN_ARRAY	32
+
+#define REBIRTH_METRIC	"Node Control/Rebirth"
+#define SEQ_MAX_BYTES	3	/* tag + two byte varint */
+
+struct pbw {
+	uint8_t *buf;
+	size_t cap;
+	size_t len;		/* keeps counting past cap, like struct jw */
+};
+
+struct spb_param {
+	uint64_t alias;
+	int datatype;
+	int dtype;		/* how its registers decode, regdecode.h */
+	int order;
+};
+
+/* Sparkplug datatype of an unscaled register value, by enum data_type */
+static const int dt_native[] = {
+	[DTYPE_UINT16] = DT_UINT16,
+	[DTYPE_INT16] = DT_INT16,
+	[DTYPE_UINT32] = DT_UINT32,
+	[DTYPE_INT32] = DT_INT32,
+	[DTYPE_FLOAT32] = DT_FLOAT,
+	[DTYPE_UINT64] = DT_UINT64,
+	[DTYPE_INT64] = DT_INT64,
+	[DTYPE_FLOAT64] = DT_DOUBLE,
+};
+
+struct spb_dev {
+	char birth_topic[MSG_TOPIC_LEN];
+	char data_topic[MSG_TOPIC_LEN];
+	unsigned int born;	/* session the last DBIRTH was sent in */
+	struct rbe_shadow shadow;	/* last values reported */
+	struct spb_param params[MAX_PARAMETERS];
+};
+
+static struct spb_dev spb_devs[MAX_IO_DEVICES];
+
+/* current session, 0 while the node is offline */
+static atomic_uint spb_session;
+static atomic_int rebirth;
+
+/* mqtt thread only */
+static unsigned int sessions;	/* sessions started so far */
+static uint64_t bd_seq;		/* bdSeq of the will registered last */
+static uint64_t next_bd_seq;
+static unsigned int seq;
+static uint8_t *seal_buf;
+static size_t seal_cap;
+
+static void pb_raw(struct pbw *w, const void *p, size_t n)
+{
+	if (w->len < w->cap) {
+		size_t room = w->cap - w->len;
+
+		memcpy(w->buf + w->len, p, n < room ? n : room);
+	}
+	w->len += n;
+}
+
+static void pb_varint(struct pbw *w, uint64_t v)
+{
+	uint8_t tmp[10];
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		tmp[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	tmp[n++] = (uint8_t)v;
+	pb_raw(w, tmp, n);
+}
+
+static void pb_tag(struct pbw *w, int field, int wire)
+{
+	pb_varint(w, (uint64_t)field << 3 | wire);
+}
+
+static void pb_uint(struct pbw *w, int field, uint64_t v)
+{
+	pb_tag(w, field, PB_VARINT);
+	pb_varint(w, v);
+}
+
+static void pb_le(struct pbw *w, uint64_t v, int size)
+{
+	uint8_t tmp[8];
+	int i;
+
+	for (i = 0; i < size; i++) {
+		tmp[i] = (uint8_t)v;
+		v >>= 8;
+	}
+	pb_raw(w, tmp, size);
+}
+
+static void pb_double(struct pbw *w, int field, double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	pb_tag(w, field, PB_FIXED64);
+	pb_le(w, u, 8);
+}
+
+static void pb_string(struct pbw *w, int field, const char *s)
+{
+	size_t n = strlen(s);
+
+	pb_tag(w, field, PB_LEN);
+	pb_varint(w, n);
+	pb_raw(w, s, n);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * value_write - the value of one parameter metric from its reported words:
+ * booleans and unscaled integers as varints (signed ones two's complement,
+ * as wide as the field), floats as they are, scaled values as doubles,
+ * arrays packed little endian into bytes_value.
+ */
+static void value_write(struct pbw *w, const struct parameter *p,
+			const struct spb_param *sp, const uint16_t *vals)
+{
+	uint64_t raw = regs_raw(vals, sp->dtype, sp->order);
+	double v[REGS_DECODE_BATCH];
+	int done, n, k;
+
+	switch (sp->datatype) {
+	case DT_BOOLEAN:
+		pb_uint(w, MT_BOOLEAN, BITS_TEST((const uint8_t *)vals, 0));
+		break;
+	case DT_UINT16:
+	case DT_UINT32:
+		pb_uint(w, MT_INT, raw);
+		break;
+	case DT_INT16:
+		pb_uint(w, MT_INT, (uint32_t)(int32_t)(int16_t)raw);
+		break;
+	case DT_INT32:
+		pb_uint(w, MT_INT, (uint32_t)raw);
+		break;
+	case DT_UINT64:
+	case DT_INT64:
+		pb_uint(w, MT_LONG, raw);
+		break;
+	case DT_FLOAT:
+		pb_tag(w, MT_FLOAT, PB_FIXED32);
+		pb_le(w, raw, 4);
+		break;
+	case DT_DOUBLE:
+		regs_decode(v, vals, 1, sp->dtype, sp->order, p->scale,
+			    p->offset);
+		pb_double(w, MT_DOUBLE, dtoa_round(v[0], p->decimals));
+		break;
+	case DT_BOOLEAN_ARRAY: {
+		/* element count, then the bits packed MSB first */
+		const uint8_t *bits = (const uint8_t *)vals;
+
+		pb_tag(w, MT_BYTES, PB_LEN);
+		pb_varint(w, 4 + BITS_BYTES(p->count));
+		pb_le(w, p->count, 4);
+		for (k = 0; k < (int)BITS_BYTES(p->count); k++) {
+			/* reverse the bits of the LSB first byte */
+			uint8_t byte = (uint8_t)(((bits[k] * 0x0802u & 0x22110u) |
+						  (bits[k] * 0x8020u & 0x88440u)) *
+						 0x10101u >> 16);
+
+			pb_raw(w, &byte, 1);
+		}
+		break;
+	}
+	case DT_UINT16_ARRAY:
+		pb_tag(w, MT_BYTES, PB_LEN);
+		pb_varint(w, 2 * p->count);
+		for (k = 0; k < p->count; k++)
+			pb_le(w, regs_raw(vals + k, DTYPE_UINT16, sp->order), 2);
+		break;
+	case DT_DOUBLE_ARRAY:
+		pb_tag(w, MT_BYTES, PB_LEN);
+		pb_varint(w, 8 * p->count);
+		for (done = 0; done < p->count; done += n) {
+			n = p->count - done < REGS_DECODE_BATCH ?
+			    p->count - done : REGS_DECODE_BATCH;
+			regs_decode(v, vals + done * data_type_words(sp->dtype),
+				    n, sp->dtype, sp->order, p->scale,
+				    p->offset);
+			for (k = 0; k < n; k++) {
+				double d = dtoa_round(v[k], p->decimals);
+				uint64_t u;
+
+				memcpy(&u, &d, sizeof(u));
+				pb_le(w, u, 8);
+			}
+		}
+		break;
+	}
+}
+
+/* metric_body - name and datatype only in a birth certificate */
+static void metric_body(struct pbw *w, const struct parameter *p,
+			const struct spb_param *sp, const struct rbe_param *rp,
+			int birth)
+{
+	if (birth)
+		pb_string(w, MT_NAME, p->name);
+	pb_uint(w, MT_ALIAS, sp->alias);
+	if (birth)
+		pb_uint(w, MT_DATATYPE, sp->datatype);
+	if (rp->valid > 0)
+		value_write(w, p, sp, rp->vals);
+	else
+		pb_uint(w, MT_IS_NULL, 1);
+}
+
+static void metric_write(struct pbw *w, const struct parameter *p,
+			 const struct spb_param *sp, const struct rbe_param *rp,
+			 int birth)
+{
+	struct pbw size = { NULL, 0, 0 };
+
+	metric_body(&size, p, sp, rp, birth);
+	pb_tag(w, PL_METRIC, PB_LEN);
+	pb_varint(w, size.len);
+	metric_body(w, p, sp, rp, birth);
+}
+
+/* payload_write - DBIRTH or DDATA for the parameters in mask */
+static size_t payload_write(const struct io_device *dev,
+			    const struct spb_dev *d, uint32_t mask, int birth,
+			    uint64_t ts, char *buf, size_t cap)
+{
+	struct pbw w = { (uint8_t *)buf, cap, 0 };
+	int k;
+
+	pb_uint(&w, PL_TIMESTAMP, ts);
+	for (k = 0; k < dev->parameter_count; k++)
+		if (mask & (1u << k))
+			metric_write(&w, &dev->parameters[k], &d->params[k],
+				     &d->shadow.params[k], birth);
+	return w.len;
+}
+
+static void node_metric_body(struct pbw *w, const char *name, int datatype,
+			     int field, uint64_t v)
+{
+	pb_string(w, MT_NAME, name);
+	pb_uint(w, MT_DATATYPE, datatype);
+	pb_uint(w, field, v);
+}
+
+static void node_metric(struct pbw *w, const char *name, int datatype,
+			int field, uint64_t v)
+{
+	struct pbw size = { NULL, 0, 0 };
+
+	node_metric_body(&size, name, datatype, field, v);
+	pb_tag(w, PL_METRIC, PB_LEN);
+	pb_varint(w, size.len);
+	node_metric_body(w, name, datatype, field, v);
+}
+
+/*
+ * node_write - NBIRTH (birth set) or NDEATH for bdSeq. Both carry bdSeq;
+ * the birth also offers the rebirth control and a timestamp. The NDEATH
+ * is registered long before it is sent, so it has no timestamp.
+ */
+static size_t node_write(uint64_t bd, int birth, char *buf, size_t cap)
+{
+	struct pbw w = { (uint8_t *)buf, cap, 0 };
+
+	if (birth)
+		pb_uint(&w, PL_TIMESTAMP, now_ms());
+	node_metric(&w, "bdSeq", DT_UINT64, MT_LONG, bd);
+	if (birth)
+		node_metric(&w, REBIRTH_METRIC, DT_BOOLEAN, MT_BOOLEAN, 0);
+	return w.len;
+}
+
+/* node_topic - returns the length it needed, as snprintf() does */
+static int node_topic(const struct config *cfg, const char *type, char *buf,
+		      size_t len)
+{
+	return snprintf(buf, len, SPARKPLUG_NAMESPACE "/%s/%s/%s",
+			cfg->mqtt.sparkplug_group, type, cfg->forge_edge_id);
+}
+
+/*
+ * sparkplug_init - per device topics, aliases, datatypes and
+ * report-by-exception shadows. Aliases are unique across the edge node,
+ * as Sparkplug requires.
+ */
+int sparkplug_init(const struct config *cfg)
+{
+	char topic[MSG_TOPIC_LEN];
+	int i, k;
+
+	sparkplug_cleanup();
+
+	/* NBIRTH and NDEATH are the longest node topics */
+	if (node_topic(cfg, "NBIRTH", topic, sizeof(topic)) >=
+	    (int)sizeof(topic)) {
+		fprintf(stderr, "[SPARKPLUG] node topic is longer than %d\n",
+			MSG_TOPIC_LEN - 1);
+		return -1;
+	}
+
+	for (i = 0; i < cfg->io_device_count && i < (int)MAX_IO_DEVICES; i++) {
+		const struct io_device *dev = &cfg->io_devices[i];
+		struct spb_dev *d = &spb_devs[i];
+
+		if (snprintf(d->birth_topic, sizeof(d->birth_topic),
+			     SPARKPLUG_NAMESPACE "/%s/DBIRTH/%s/%s",
+			     cfg->mqtt.sparkplug_group, cfg->forge_edge_id,
+			     dev->io_device_id) >= (int)sizeof(d->birth_topic) ||
+		    snprintf(d->data_topic, sizeof(d->data_topic),
+			     SPARKPLUG_NAMESPACE "/%s/DDATA/%s/%s",
+			     cfg->mqtt.sparkplug_group, cfg->forge_edge_id,
+			     dev->io_device_id) >= (int)sizeof(d->data_topic)) {
+			fprintf(stderr, "[SPARKPLUG] topics of %s are longer than %d\n",
+				dev->io_device_id, MSG_TOPIC_LEN - 1);
+			sparkplug_cleanup();
+			return -1;
+		}
+
+		if (rbe_init(&d->shadow, dev) < 0) {
+			sparkplug_cleanup();
+			return -1;
+		}
+
+		for (k = 0; k < dev->parameter_count; k++) {
+			const struct parameter *p = &dev->parameters[k];
+			struct spb_param *sp = &d->params[k];
+			int array = p->count > 1;
+			int plain = p->scale == 1.0 && p->offset == 0;
+
+			sp->alias = (uint64_t)i * MAX_PARAMETERS + k + 1;
+			sp->dtype = data_type_from_str(p->data_type);
+			sp->order = word_order_from_str(p->word_order);
+			if (REG_IS_BIT(reg_type_from_str(p->type)))
+				sp->datatype = array ? DT_BOOLEAN_ARRAY : DT_BOOLEAN;
+			else if (plain && sp->dtype == DTYPE_UINT16)
+				sp->datatype = array ? DT_UINT16_ARRAY : DT_UINT16;
+			else if (plain && !array && sp->dtype != DTYPE_UNKNOWN)
+				sp->datatype = dt_native[sp->dtype];
+			else
+				sp->datatype = array ? DT_DOUBLE_ARRAY : DT_DOUBLE;
+		}
+	}
+	return 0;
+}
+
+void sparkplug_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < (int)MAX_IO_DEVICES; i++) {
+		rbe_free(&spb_devs[i].shadow);
+		memset(&spb_devs[i], 0, sizeof(spb_devs[i]));
+	}
+}
+
+/*
+ * sparkplug_publish - DBIRTH on the first cycle of a session, DDATA with
+ * the changed metrics after that, nothing while the node is offline.
+ */
+void sparkplug_publish(const struct config *cfg, const struct io_device *dev,
+		       const struct read_plan *plan)
+{
+	struct spb_dev *d = &spb_devs[dev - cfg->io_devices];
+	unsigned int session;
+	struct msg_buf *m;
+	uint32_t mask;
+	uint64_t ts;
+	size_t len;
+	int birth;
+
+	if (!d->shadow.vals)
+		return;
+
+	mask = rbe_update(&d->shadow, dev, plan, sched_now_ns());
+	session = atomic_load_explicit(&spb_session, memory_order_acquire);
+	if (!session)
+		return;
+
+	birth = d->born != session;
+	if (birth)
+		mask = read_plan_all_mask(dev);
+	if (!mask)
+		return;
+
+	ts = now_ms();
+	m = msg_alloc(MSG_BUF_SIZE);
+	if (!m)
+		return;
+
+	len = payload_write(dev, d, mask, birth, ts, m->data, m->cap);
+	if (len >= m->cap) {
+		msg_put(m);
+		m = msg_alloc(len + 1);
+		if (!m)
+			return;
+		payload_write(dev, d, mask, birth, ts, m->data, m->cap);
+	}
+	m->len = len;
+	m->fmt = MSG_FMT_SPARKPLUG;
+	m->session = session;
+	memcpy(m->topic, birth ? d->birth_topic : d->data_topic,
+	       sizeof(m->topic));
+
+	/* a birth overtakes queued data; retried next cycle if it is refused */
+	if (mqtt_publish_buf(m, birth ? Q_PRIO_CONTROL : Q_PRIO_TELEMETRY) == 0 &&
+	    birth)
+		d->born = session;
+}
+
+static struct msg_buf *node_msg(const struct config *cfg, uint64_t bd,
+				int birth)
+{
+	size_t len = node_write(bd, birth, NULL, 0);
+	struct msg_buf *m = msg_alloc(len + 1);
+
+	if (!m)
+		return NULL;
+	m->len = node_write(bd, birth, m->data, m->cap);
+	m->fmt = MSG_FMT_SPARKPLUG;
+	/* sparkplug_init() refuses a node topic that does not fit */
+	if (node_topic(cfg, birth ? "NBIRTH" : "NDEATH", m->topic,
+		       sizeof(m->topic)) >= (int)sizeof(m->topic)) {
+		msg_put(m);
+		return NULL;
+	}
+	return m;
+}
+
+/*
+ * sparkplug_death - the NDEATH to register as will on the next connect.
+ * Each connect gets a new bdSeq, echoed by the NBIRTH of that session.
+ */
+struct msg_buf *sparkplug_death(const struct config *cfg)
+{
+	bd_seq = next_bd_seq;
+	next_bd_seq = (next_bd_seq + 1) & 0xff;
+	return node_msg(cfg, bd_seq, 0);
+}
+
+/*
+ * sparkplug_online - start a session: returns the NBIRTH, which must be
+ * sent before anything else. Devices send their DBIRTH on their next
+ * cycle.
+ */
+struct msg_buf *sparkplug_online(const struct config *cfg)
+{
+	struct msg_buf *m = node_msg(cfg, bd_seq, 1);
+
+	if (!m)
+		return NULL;
+
+	if (++sessions == 0)
+		sessions = 1;
+	seq = 0;
+	atomic_store(&rebirth, 0);
+	m->session = sessions;
+	atomic_store_explicit(&spb_session, sessions, memory_order_release);
+	return m;
+}
+
+void sparkplug_offline(void)
+{
+	atomic_store_explicit(&spb_session, 0, memory_order_release);
+}
+
+int sparkplug_rebirth_pending(void)
+{
+	return atomic_load(&rebirth);
+}
+
+/*
+ * sparkplug_seal - payload of m with the next seq appended, in a buffer
+ * owned by the mqtt thread. NULL when m belongs to an earlier session.
+ */
+const void *sparkplug_seal(const struct msg_buf *m, size_t *len)
+{
+	struct pbw w;
+	size_t need = m->len + SEQ_MAX_BYTES;
+
+	if (!m->session ||
+	    m->session != atomic_load_explicit(&spb_session,
+					       memory_order_relaxed))
+		return NULL;
+
+	if (need > seal_cap) {
+		uint8_t *p = realloc(seal_buf, need);
+
+		if (!p)
+			return NULL;
+		seal_buf = p;
+		seal_cap = need;
+	}
+
+	w = (struct pbw){ seal_buf, seal_cap, 0 };
+	pb_raw(&w, m->data, m->len);
+	pb_uint(&w, PL_SEQ, seq);
+	seq = (seq + 1) & 0xff;
+	*len = w.len;
+	return seal_buf;
+}
+
+void sparkplug_command_topic(const struct config *cfg, char *buf, size_t len)
+{
+	node_topic(cfg, "NCMD", buf, len);
+}
+
+static int pb_read_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		uint8_t b = *(*p)++;
+
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+/*
+ * pb_next - step over one field, returning its number and, for length
+ * delimited fields, the contents. -1 on malformed input.
+ */
+static int pb_next(const uint8_t **p, const uint8_t *end, uint64_t *value,
+		   const uint8_t **data)
+{
+	uint64_t key;
+
+	if (pb_read_varint(p, end, &key))
+		return -1;
+
+	switch (key & 7) {
+	case PB_VARINT:
+		if (pb_read_varint(p, end, value))
+			return -1;
+		break;
+	case PB_FIXED64:
+	case PB_FIXED32:
+		*value = (key & 7) == PB_FIXED64 ? 8 : 4;
+		if ((uint64_t)(end - *p) < *value)
+			return -1;
+		*p += *value;
+		break;
+	case PB_LEN:
+		if (pb_read_varint(p, end, value) ||
+		    (uint64_t)(end - *p) < *value)
+			return -1;
+		*data = *p;
+		*p += *value;
+		break;
+	default:
+		return -1;
+	}
+	return (int)(key >> 3);
+}
+
+/* sparkplug_command - an NCMD arrived; honour "Node Control/Rebirth" */
+void sparkplug_command(const void *payload, size_t len)
+{
+	const uint8_t *p = payload, *end = p + len;
+	const uint8_t *data = NULL;
+	uint64_t v;
+	int field;
+
+	while (p < end && (field = pb_next(&p, end, &v, &data)) >= 0) {
+		const uint8_t *mp, *mend;
+		int named = 0, set = 0;
+
+		if (field != PL_METRIC || !data)
+			continue;
+
+		mp = data;
+		mend = data + v;
+		data = NULL;
+		while (mp < mend && (field = pb_next(&mp, mend, &v, &data)) >= 0) {
+			if (field == MT_NAME && data)
+				named = v == strlen(REBIRTH_METRIC) &&
+					memcmp(data, REBIRTH_METRIC, v) == 0;
+			else if (field == MT_BOOLEAN)
+				set = v != 0;
+			data = NULL;
+		}
+		if (named && set) {
+			fprintf(stderr, "[SPARKPLUG] rebirth requested\n");
+			atomic_store(&rebirth, 1);
+		}
+		data = NULL;
+	}
+}
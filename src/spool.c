@@ -0,0 +1,639 @@
+/*
+ * spool.c - disk-backed store-and-forward log for the mqtt thread.
+ *
+ * Messages that cannot be published right away (link down, or the RAM
+ * queue close to full) are appended to fixed-size, memory-mapped segment
+ * files and sent later at a bounded rate:
+ *  - segments are named by a 64-bit sequence number, preallocated with
+ *    posix_fallocate() so a full disk fails the append instead of raising
+ *    SIGBUS on a page fault, and deleted once fully drained
+ *  - every record carries a CRC32 over its header and body; a torn or
+ *    corrupt record ends the segment for the reader
+ *  - the read position is kept in a small cursor file, rewritten with
+ *    write + fdatasync + rename after SPOOL_SYNC_RECORDS sends or
+ *    SPOOL_SYNC_MS, so a restart replays at most one batch
+ *  - a restart always opens a fresh segment for writing, so appends never
+ *    land behind a partially written record
+ *  - when the log would exceed its size limit the oldest segment is
+ *    dropped and its records are counted
+ *
+ * Records are handed to Paho at least once; what Paho does with them
+ * after MQTTAsync_sendMessage() returns is outside the log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+#include "pollsched.h"
+
+#define SEG_MAGIC	0x47455346u	/* "FSEG" */
+#define REC_MAGIC	0x43455246u	/* "FREC" */
+#define CUR_MAGIC	0x52554346u	/* "FCUR" */
+#define SEG_VERSION	1
+#define REC_ALIGN	8
+
+struct seg_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seq;
+};
+
+/* followed by topic_len topic bytes and the payload, no terminators */
+struct spool_rec {
+	uint32_t magic;
+	uint32_t crc;		/* over len, topic_len, fmt and the body */
+	uint32_t len;		/* topic + payload bytes */
+	uint16_t topic_len;
+	uint16_t fmt;		/* enum msg_fmt, 0 (JSON) in older spools */
+};
+
+struct spool_cursor {
+	uint32_t magic;
+	uint32_t crc;		/* over seq and off */
+	uint64_t seq;
+	uint64_t off;
+};
+
+#define SEG_DATA_START	sizeof(struct seg_hdr)
+#define REC_SIZE(len)	((sizeof(struct spool_rec) + (len) + REC_ALIGN - 1) & \
+			 ~(size_t)(REC_ALIGN - 1))
+
+struct spool_counters {
+	atomic_uint_fast64_t spooled;
+	atomic_uint_fast64_t drained;
+	atomic_uint_fast64_t dropped;
+	atomic_uint_fast64_t corrupt;
+	atomic_uint_fast64_t pending_bytes;
+};
+
+static char sp_dir[256];
+static int sp_on;
+static uint64_t sp_max_segs;
+
+/* writer: always the newest segment */
+static uint64_t w_seq;
+static char *w_map;
+static size_t w_off;
+
+/* reader: oldest segment still on disk, may be the writer's */
+static uint64_t r_seq;
+static char *r_map;
+static size_t r_len;
+static size_t r_off;
+static size_t r_next;	/* end of the record returned by spool_peek() */
+
+static unsigned int unsynced;
+static uint64_t last_sync_ns;
+static struct spool_counters sp_stats;
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+	uint32_t i, k, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t rec_crc(const struct spool_rec *rec)
+{
+	uint32_t crc;
+
+	crc = crc32_update(0, &rec->len, sizeof(*rec) -
+			   offsetof(struct spool_rec, len));
+	return crc32_update(crc, rec + 1, rec->len);
+}
+
+static void seg_path(char *buf, size_t len, uint64_t seq)
+{
+	snprintf(buf, len, "%s/%016llx.seg", sp_dir, (unsigned long long)seq);
+}
+
+static void update_pending(void)
+{
+	uint64_t bytes;
+
+	bytes = (w_seq - r_seq) * (uint64_t)SPOOL_SEGMENT_SIZE + w_off - r_off;
+	atomic_store_explicit(&sp_stats.pending_bytes, bytes,
+			      memory_order_relaxed);
+}
+
+static char *seg_create(uint64_t seq)
+{
+	char path[sizeof(sp_dir) + 32];
+	struct seg_hdr *hdr;
+	char *map;
+	int fd, rc;
+
+	seg_path(path, sizeof(path), seq);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		fprintf(stderr, "[SPOOL] create %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	rc = posix_fallocate(fd, 0, SPOOL_SEGMENT_SIZE);
+	if (rc) {
+		fprintf(stderr, "[SPOOL] allocate %s: %s\n", path, strerror(rc));
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	map = mmap(NULL, SPOOL_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(path);
+		return NULL;
+	}
+
+	hdr = (struct seg_hdr *)map;
+	hdr->magic = SEG_MAGIC;
+	hdr->version = SEG_VERSION;
+	hdr->seq = seq;
+	return map;
+}
+
+static char *seg_open(uint64_t seq, size_t *len)
+{
+	char path[sizeof(sp_dir) + 32];
+	const struct seg_hdr *hdr;
+	struct stat st;
+	char *map;
+	int fd;
+
+	seg_path(path, sizeof(path), seq);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)SEG_DATA_START ||
+	    st.st_size > SPOOL_SEGMENT_SIZE) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (const struct seg_hdr *)map;
+	if (hdr->magic != SEG_MAGIC || hdr->version != SEG_VERSION ||
+	    hdr->seq != seq) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*len = st.st_size;
+	return map;
+}
+
+/*
+ * rec_at - validated record at off, NULL at the end of the segment data.
+ * *bad is set when the bytes there are a damaged record.
+ */
+static const struct spool_rec *rec_at(const char *map, size_t len,
+				      size_t off, int *bad)
+{
+	const struct spool_rec *rec;
+
+	*bad = 0;
+	if (off + sizeof(*rec) > len)
+		return NULL;
+
+	rec = (const struct spool_rec *)(map + off);
+	if (rec->magic != REC_MAGIC) {
+		*bad = rec->magic != 0;
+		return NULL;
+	}
+
+	if (rec->len > len - off - sizeof(*rec) ||
+	    rec->topic_len >= MSG_TOPIC_LEN || rec->topic_len > rec->len ||
+	    rec_crc(rec) != rec->crc) {
+		*bad = 1;
+		return NULL;
+	}
+	return rec;
+}
+
+static void reader_unmap(void)
+{
+	if (r_map && r_map != w_map)
+		munmap(r_map, r_len);
+	r_map = NULL;
+}
+
+/*
+ * reader_retire - the reader is done with its segment: delete it and move
+ * on to the next one.
+ */
+static void reader_retire(void)
+{
+	char path[sizeof(sp_dir) + 32];
+
+	reader_unmap();
+	seg_path(path, sizeof(path), r_seq);
+	unlink(path);
+	r_seq++;
+	r_off = SEG_DATA_START;
+	r_next = r_off;
+}
+
+/*
+ * drop_oldest - make room by discarding the reader's segment, counting
+ * the records that were still unsent in it.
+ */
+static void drop_oldest(void)
+{
+	const struct spool_rec *rec;
+	uint64_t lost = 0;
+	size_t off = r_off;
+	int bad;
+
+	if (!r_map)
+		r_map = seg_open(r_seq, &r_len);
+
+	if (r_map) {
+		while ((rec = rec_at(r_map, r_len, off, &bad))) {
+			lost++;
+			off += REC_SIZE(rec->len);
+		}
+	}
+
+	atomic_fetch_add_explicit(&sp_stats.dropped, lost, memory_order_relaxed);
+	fprintf(stderr, "[SPOOL] size limit reached, dropped segment %llu (%llu records)\n",
+		(unsigned long long)r_seq, (unsigned long long)lost);
+	reader_retire();
+}
+
+static int cursor_save(void)
+{
+	char path[sizeof(sp_dir) + 16], tmp[sizeof(sp_dir) + 16];
+	struct spool_cursor cur;
+	int fd, rc = 0;
+
+	cur.magic = CUR_MAGIC;
+	cur.seq = r_seq;
+	cur.off = r_off;
+	cur.crc = crc32_update(0, &cur.seq, sizeof(cur.seq) + sizeof(cur.off));
+
+	snprintf(path, sizeof(path), "%s/cursor", sp_dir);
+	snprintf(tmp, sizeof(tmp), "%s/cursor.tmp", sp_dir);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0)
+		return -errno;
+	if (write(fd, &cur, sizeof(cur)) != (ssize_t)sizeof(cur) ||
+	    fdatasync(fd))
+		rc = -EIO;
+	close(fd);
+
+	if (!rc && rename(tmp, path))
+		rc = -errno;
+	return rc;
+}
+
+static int cursor_load(uint64_t *seq, uint64_t *off)
+{
+	char path[sizeof(sp_dir) + 16];
+	struct spool_cursor cur;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/cursor", sp_dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, &cur, sizeof(cur));
+	close(fd);
+
+	if (n != (ssize_t)sizeof(cur) || cur.magic != CUR_MAGIC ||
+	    cur.crc != crc32_update(0, &cur.seq,
+				    sizeof(cur.seq) + sizeof(cur.off)))
+		return -1;
+
+	*seq = cur.seq;
+	*off = cur.off;
+	return 0;
+}
+
+/*
+ * scan_segments - sequence range of the segment files in the spool
+ * directory. Returns 0 when there are none.
+ */
+static int scan_segments(uint64_t *first, uint64_t *last)
+{
+	struct dirent *de;
+	int found = 0;
+	DIR *d;
+
+	d = opendir(sp_dir);
+	if (!d)
+		return 0;
+
+	while ((de = readdir(d))) {
+		unsigned long long seq;
+		char tail[8];
+
+		if (strlen(de->d_name) != 20 ||
+		    sscanf(de->d_name, "%16llx%7s", &seq, tail) != 2 ||
+		    strcmp(tail, ".seg") != 0)
+			continue;
+
+		if (!found || seq < *first)
+			*first = seq;
+		if (!found || seq > *last)
+			*last = seq;
+		found = 1;
+	}
+	closedir(d);
+	return found;
+}
+
+int spool_open(const char *dir, uint64_t max_bytes)
+{
+	uint64_t first = 0, last = 0, cseq, coff;
+
+	if (!dir || !dir[0] || strlen(dir) >= sizeof(sp_dir))
+		return -1;
+
+	if (mkdir(dir, 0750) && errno != EEXIST) {
+		fprintf(stderr, "[SPOOL] mkdir %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	crc32_init();
+	strcpy(sp_dir, dir);
+	memset(&sp_stats, 0, sizeof(sp_stats));
+
+	sp_max_segs = max_bytes / SPOOL_SEGMENT_SIZE;
+	if (sp_max_segs < 2)
+		sp_max_segs = 2;
+
+	if (scan_segments(&first, &last)) {
+		r_seq = first;
+		r_off = SEG_DATA_START;
+		if (cursor_load(&cseq, &coff) == 0 && cseq >= first &&
+		    cseq <= last && coff >= SEG_DATA_START &&
+		    coff < SPOOL_SEGMENT_SIZE && coff % REC_ALIGN == 0) {
+			r_seq = cseq;
+			r_off = coff;
+		}
+		w_seq = last + 1;
+	} else {
+		w_seq = 1;
+		r_seq = w_seq;
+		r_off = SEG_DATA_START;
+	}
+
+	w_map = seg_create(w_seq);
+	if (!w_map)
+		return -1;
+	w_off = SEG_DATA_START;
+
+	/* segments older than the cursor were drained but not yet deleted */
+	while (first && first < r_seq) {
+		char path[sizeof(sp_dir) + 32];
+
+		seg_path(path, sizeof(path), first++);
+		unlink(path);
+	}
+
+	r_map = NULL;
+	r_next = r_off;
+	unsynced = 0;
+	last_sync_ns = sched_now_ns();
+	update_pending();
+	sp_on = 1;
+
+	fprintf(stderr, "[SPOOL] up to %llu segment(s), %llu MiB, in %s\n",
+		(unsigned long long)sp_max_segs,
+		(unsigned long long)(sp_max_segs * SPOOL_SEGMENT_SIZE >> 20),
+		sp_dir);
+	if (spool_pending())
+		fprintf(stderr, "[SPOOL] %llu segment(s) of backlog in %s\n",
+			(unsigned long long)(w_seq - r_seq), sp_dir);
+	return 0;
+}
+
+void spool_close(void)
+{
+	if (!sp_on)
+		return;
+
+	spool_sync();
+	reader_unmap();
+	munmap(w_map, SPOOL_SEGMENT_SIZE);
+	w_map = NULL;
+	sp_on = 0;
+}
+
+int spool_enabled(void)
+{
+	return sp_on;
+}
+
+/*
+ * spool_append - copy m to the end of the log. Returns 0 on success or a
+ * negative errno when the record cannot be stored; m is not consumed.
+ */
+int spool_append(const struct msg_buf *m)
+{
+	struct spool_rec *rec;
+	size_t topic_len, len, need;
+
+	if (!sp_on)
+		return -ENODEV;
+
+	topic_len = strlen(m->topic);
+	len = topic_len + m->len;
+	need = REC_SIZE(len);
+	if (need > SPOOL_SEGMENT_SIZE - SEG_DATA_START) {
+		atomic_fetch_add_explicit(&sp_stats.dropped, 1,
+					  memory_order_relaxed);
+		return -EMSGSIZE;
+	}
+
+	if (w_off + need > SPOOL_SEGMENT_SIZE) {
+		char *map = seg_create(w_seq + 1);
+
+		if (!map) {
+			atomic_fetch_add_explicit(&sp_stats.dropped, 1,
+						  memory_order_relaxed);
+			return -ENOSPC;
+		}
+
+		msync(w_map, w_off, MS_ASYNC);
+		if (r_map == w_map)
+			r_len = SPOOL_SEGMENT_SIZE;	/* reader keeps it */
+		else
+			munmap(w_map, SPOOL_SEGMENT_SIZE);
+		w_map = map;
+		w_seq++;
+		w_off = SEG_DATA_START;
+
+		while (w_seq - r_seq + 1 > sp_max_segs)
+			drop_oldest();
+	}
+
+	rec = (struct spool_rec *)(w_map + w_off);
+	rec->len = len;
+	rec->topic_len = topic_len;
+	rec->fmt = (uint16_t)m->fmt;
+	memcpy(rec + 1, m->topic, topic_len);
+	memcpy((char *)(rec + 1) + topic_len, m->data, m->len);
+	rec->crc = rec_crc(rec);
+	/* a record only becomes visible once its magic is in place */
+	atomic_signal_fence(memory_order_release);
+	rec->magic = REC_MAGIC;
+
+	w_off += need;
+	atomic_fetch_add_explicit(&sp_stats.spooled, 1, memory_order_relaxed);
+	update_pending();
+	return 0;
+}
+
+int spool_pending(void)
+{
+	return sp_on && (r_seq != w_seq || r_off < w_off);
+}
+
+/*
+ * spool_peek - oldest unsent record as a new message, without consuming
+ * it; call spool_advance() once it has been handed off. Returns 0 with
+ * *m set, 1 when the log is empty, or a negative errno.
+ */
+int spool_peek(struct msg_buf **m)
+{
+	const struct spool_rec *rec;
+	struct msg_buf *msg;
+	size_t plen;
+	int bad;
+
+	if (!sp_on)
+		return 1;
+
+	for (;;) {
+		if (r_seq == w_seq && r_off >= w_off)
+			return 1;
+
+		if (!r_map) {
+			if (r_seq == w_seq) {
+				r_map = w_map;
+				r_len = SPOOL_SEGMENT_SIZE;
+			} else {
+				r_map = seg_open(r_seq, &r_len);
+				if (!r_map) {
+					fprintf(stderr, "[SPOOL] segment %llu unreadable, skipped\n",
+						(unsigned long long)r_seq);
+					reader_retire();
+					continue;
+				}
+			}
+		}
+
+		rec = rec_at(r_map, r_len, r_off, &bad);
+		if (rec)
+			break;
+
+		if (bad)
+			atomic_fetch_add_explicit(&sp_stats.corrupt, 1,
+						  memory_order_relaxed);
+		if (r_seq == w_seq) {
+			/* cannot happen for our own writes, but never spin */
+			r_off = w_off;
+			return 1;
+		}
+		reader_retire();
+	}
+
+	plen = rec->len - rec->topic_len;
+	msg = msg_alloc(plen + 1);
+	if (!msg)
+		return -ENOMEM;
+
+	memcpy(msg->topic, rec + 1, rec->topic_len);
+	msg->topic[rec->topic_len] = '\0';
+	memcpy(msg->data, (const char *)(rec + 1) + rec->topic_len, plen);
+	msg->data[plen] = '\0';
+	msg->len = plen;
+	msg->fmt = rec->fmt < MSG_FMT_COUNT ? rec->fmt : MSG_FMT_JSON;
+
+	r_next = r_off + REC_SIZE(rec->len);
+	*m = msg;
+	return 0;
+}
+
+void spool_advance(void)
+{
+	if (!sp_on || r_next <= r_off)
+		return;
+
+	r_off = r_next;
+	atomic_fetch_add_explicit(&sp_stats.drained, 1, memory_order_relaxed);
+	update_pending();
+
+	if (++unsynced >= SPOOL_SYNC_RECORDS ||
+	    sched_now_ns() - last_sync_ns >= SPOOL_SYNC_MS * 1000000ull)
+		spool_sync();
+}
+
+/*
+ * spool_sync - start writeback of appended records and make the read
+ * cursor durable.
+ */
+void spool_sync(void)
+{
+	int rc;
+
+	if (!sp_on)
+		return;
+
+	msync(w_map, w_off, MS_ASYNC);
+	rc = cursor_save();
+	if (rc)
+		fprintf(stderr, "[SPOOL] cursor save failed: %s\n", strerror(-rc));
+	unsynced = 0;
+	last_sync_ns = sched_now_ns();
+}
+
+void spool_get_stats(struct spool_stats *st)
+{
+	st->spooled = atomic_load_explicit(&sp_stats.spooled,
+					   memory_order_relaxed);
+	st->drained = atomic_load_explicit(&sp_stats.drained,
+					   memory_order_relaxed);
+	st->dropped = atomic_load_explicit(&sp_stats.dropped,
+					   memory_order_relaxed);
+	st->corrupt = atomic_load_explicit(&sp_stats.corrupt,
+					   memory_order_relaxed);
+	st->pending_bytes = atomic_load_explicit(&sp_stats.pending_bytes,
+						 memory_order_relaxed);
+}
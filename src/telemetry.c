@@ -0,0 +1,676 @@
+/*
+ * telemetry.c - turns the result of one poll cycle into the device
+ * telemetry message and hands it to mqtt_publish_buf().
+ *
+ * Shared by every poller so the payload format is defined in one place.
+ * Device telemetry is written with the streaming writers in jsonw.c (JSON)
+ * or binw.c (CBOR, MessagePack, same document structure) over templates
+ * rendered at startup; the low-rate stats and device state messages stay
+ * JSON via cJSON.
+ * Coils and discrete inputs wider than one bit go out as one bit string,
+ * hex or base64 text in JSON (bit_format) and a byte string in CBOR and
+ * MessagePack, plus the names of the bits that are set when the
+ * parameter names them. Register values are decoded a batch at a time
+ * by regdecode.c; an unscaled float32 prints with float precision.
+ * A device with report_by_exception set only publishes the parameters
+ * rbe.c finds changed, and nothing at all when none did. Sparkplug B is
+ * stateful (births, always by exception) and lives in sparkplug.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "telemetry.h"
+#include "cJSON.h"
+#include "mqtt.h"
+#include "dataq.h"
+#include "spool.h"
+#include "jsonw.h"
+#include "binw.h"
+#include "dtoa.h"
+#include "sparkplug.h"
+#include "rbe.h"
+#include "bitpack.h"
+#include "regdecode.h"
+#include "pollsched.h"
+
+/*
+ * telemetry_render - print root straight into a pool buffer. Payloads too
+ * big for a pooled buffer are printed by cJSON and copied into a heap one.
+ */
+static struct msg_buf *telemetry_render(cJSON *root)
+{
+	struct msg_buf *m;
+	char *s;
+
+	m = msg_alloc(MSG_BUF_SIZE);
+	if (m && cJSON_PrintPreallocated(root, m->data, (int)m->cap, 0)) {
+		m->len = strlen(m->data);
+		return m;
+	}
+	msg_put(m);
+
+	s = cJSON_PrintUnformatted(root);
+	if (!s)
+		return NULL;
+
+	m = msg_alloc(strlen(s) + 1);
+	if (m) {
+		m->len = strlen(s);
+		memcpy(m->data, s, m->len + 1);
+	}
+	free(s);
+	return m;
+}
+
+/*
+ * Constant parts of a device's telemetry message in the configured
+ * encoding, rendered once by telemetry_init() so a poll cycle only writes
+ * the values. Binary parameter templates leave out the map header, whose
+ * size depends on whether the read succeeded.
+ */
+struct param_tmpl {
+	char *head;		/* {"name":"...","type":"..." */
+	size_t head_len;
+	char **bit_name;	/* bit_names split up, "" = unnamed */
+	int bit_name_count;
+};
+
+struct dev_tmpl {
+	const struct io_device *dev;
+	char *head;		/* {"edge_id":"...","io_device_id":"...","timestamp": */
+	size_t head_len;
+	char topic[MSG_TOPIC_LEN];
+	struct param_tmpl params[MAX_PARAMETERS];
+	struct rbe_shadow shadow;	/* report_by_exception devices only */
+};
+
+typedef size_t (*telemetry_writer)(const struct dev_tmpl *t,
+				   const struct read_plan *plan, uint32_t mask,
+				   time_t now, char *buf, size_t cap);
+
+static struct dev_tmpl dev_tmpls[MAX_IO_DEVICES];
+static int raw_mode;
+static int bit_fmt;		/* enum bit_fmt */
+static int tel_fmt;		/* enum msg_fmt */
+static telemetry_writer tel_write;
+
+/*
+ * tmpl_write - "k1": "v1", "k2": "v2" and, for the document head, the
+ * "timestamp" key. Returns the bytes needed.
+ */
+static size_t tmpl_write(char *buf, size_t cap, const char *k1,
+			 const char *v1, const char *k2, const char *v2,
+			 int doc_head)
+{
+	struct jw w;
+	struct bw b;
+
+	if (tel_fmt == MSG_FMT_JSON) {
+		jw_init(&w, buf, cap);
+		jw_char(&w, '{');
+		jw_str(&w, k1);
+		jw_char(&w, ':');
+		jw_str(&w, v1);
+		jw_char(&w, ',');
+		jw_str(&w, k2);
+		jw_char(&w, ':');
+		jw_str(&w, v2);
+		if (doc_head)
+			jw_lit(&w, ",\"timestamp\":");
+		jw_finish(&w);
+		return w.len;
+	}
+
+	bw_init(&b, buf, cap, tel_fmt);
+	if (doc_head)
+		bw_map(&b, 4);	/* edge_id, io_device_id, timestamp, data */
+	bw_str(&b, k1);
+	bw_str(&b, v1);
+	bw_str(&b, k2);
+	bw_str(&b, v2);
+	if (doc_head)
+		bw_str(&b, "timestamp");
+	return b.len;
+}
+
+/* tmpl_render - run the same writes twice: once to size, once to fill */
+static char *tmpl_render(size_t *len, const char *k1, const char *v1,
+			 const char *k2, const char *v2, int doc_head)
+{
+	char *buf;
+
+	*len = tmpl_write(NULL, 0, k1, v1, k2, v2, doc_head);
+	buf = malloc(*len + 1);
+	if (buf)
+		tmpl_write(buf, *len + 1, k1, v1, k2, v2, doc_head);
+	return buf;
+}
+
+/* split_bit_names - one string per named bit, in a single allocation */
+static int split_bit_names(struct param_tmpl *pt, const struct parameter *p)
+{
+	size_t len = strlen(p->bit_names);
+	int n = 1;
+	char *s;
+
+	if (!len || p->count <= 1)
+		return 0;
+	for (s = (char *)p->bit_names; (s = strchr(s, ',')); s++)
+		n++;
+
+	pt->bit_name = malloc(n * sizeof(char *) + len + 1);
+	if (!pt->bit_name)
+		return -1;
+	s = memcpy(pt->bit_name + n, p->bit_names, len + 1);
+
+	for (;;) {
+		pt->bit_name[pt->bit_name_count++] = s;
+		s = strchr(s, ',');
+		if (!s)
+			break;
+		*s++ = '\0';
+	}
+	if (pt->bit_name_count > p->count)
+		pt->bit_name_count = p->count;
+	return 0;
+}
+
+/* bits_on - how many named bits are set */
+static uint32_t bits_on(const struct param_tmpl *pt, const uint8_t *bits,
+			int off)
+{
+	uint32_t n = 0;
+	int k;
+
+	for (k = 0; k < pt->bit_name_count; k++)
+		if (pt->bit_name[k][0] && BITS_TEST(bits, off + k))
+			n++;
+	return n;
+}
+
+/*
+ * json_values - the count values of a register parameter, comma
+ * separated. raw leaves out scale, offset and decimals.
+ */
+static void json_values(struct jw *w, const struct parameter *p,
+			const struct param_slot *slot, const uint16_t *regs,
+			int raw)
+{
+	double v[REGS_DECODE_BATCH];
+	int words = data_type_words(slot->dtype);
+	double scale = raw ? 1.0 : p->scale;
+	double offset = raw ? 0.0 : p->offset;
+	int decimals = raw ? DTOA_CJSON : p->decimals;
+	int single = slot->dtype == DTYPE_FLOAT32 && scale == 1.0 &&
+		     offset == 0 && decimals < 0;
+	int done, n, k;
+
+	for (done = 0; done < p->count; done += n) {
+		n = p->count - done < REGS_DECODE_BATCH ?
+		    p->count - done : REGS_DECODE_BATCH;
+		regs_decode(v, regs + done * words, n, slot->dtype, slot->order,
+			    scale, offset);
+		for (k = 0; k < n; k++) {
+			if (done + k)
+				jw_char(w, ',');
+			if (single)
+				jw_float(w, (float)v[k]);
+			else
+				jw_fixed(w, v[k], decimals);
+		}
+	}
+}
+
+/* bin_values - json_values() for telemetry_write_bin(), never raw */
+static void bin_values(struct bw *w, const struct parameter *p,
+		       const struct param_slot *slot, const uint16_t *regs)
+{
+	double v[REGS_DECODE_BATCH];
+	int words = data_type_words(slot->dtype);
+	int done, n, k;
+
+	for (done = 0; done < p->count; done += n) {
+		n = p->count - done < REGS_DECODE_BATCH ?
+		    p->count - done : REGS_DECODE_BATCH;
+		regs_decode(v, regs + done * words, n, slot->dtype, slot->order,
+			    p->scale, p->offset);
+		for (k = 0; k < n; k++)
+			bw_number(w, dtoa_round(v[k], p->decimals));
+	}
+}
+
+/* tmpl_find - templates are kept at the device's index in the config */
+static struct dev_tmpl *tmpl_find(const struct config *cfg,
+				  const struct io_device *dev)
+{
+	ptrdiff_t i = dev - cfg->io_devices;
+
+	if (i < 0 || i >= cfg->io_device_count ||
+	    i >= (ptrdiff_t)MAX_IO_DEVICES || !dev_tmpls[i].head)
+		return NULL;
+	return &dev_tmpls[i];
+}
+
+/*
+ * telemetry_write - the telemetry message for the parameters in mask, in
+ * the layout cJSON_PrintUnformatted() gave the old object tree. Returns
+ * the payload length, which may exceed cap (nothing is written past it).
+ */
+static size_t telemetry_write(const struct dev_tmpl *t,
+			      const struct read_plan *plan, uint32_t mask,
+			      time_t now, char *buf, size_t cap)
+{
+	const struct io_device *dev = t->dev;
+	struct jw w;
+	int first = 1;
+
+	jw_init(&w, buf, cap);
+	jw_raw(&w, t->head, t->head_len);
+	jw_number(&w, (double)now);
+	jw_lit(&w, ",\"data\":[");
+
+	for (int i = 0; i < dev->parameter_count; i++) {
+		const struct parameter *p = &dev->parameters[i];
+		const struct param_slot *slot = &plan->slots[i];
+
+		/* not due this cycle, or unchanged */
+		if (!(mask & (1u << i)))
+			continue;
+
+		if (!first)
+			jw_char(&w, ',');
+		first = 0;
+		jw_raw(&w, t->params[i].head, t->params[i].head_len);
+
+		if (!read_plan_param_ok(plan, i)) {
+			/* unknown type or failed read: name/type only */
+		} else if (REG_IS_BIT(slot->type)) {
+			const struct param_tmpl *pt = &t->params[i];
+			int off = slot->offset;
+
+			if (p->count == 1) {
+				jw_lit(&w, ",\"raw\":");
+				jw_int(&w, BITS_TEST(plan->bits, off));
+			} else if (bit_fmt == BIT_FMT_ARRAY) {
+				jw_lit(&w, ",\"raw\":[");
+				for (int k = 0; k < p->count; k++) {
+					if (k)
+						jw_char(&w, ',');
+					jw_int(&w, BITS_TEST(plan->bits, off + k));
+				}
+				jw_char(&w, ']');
+			} else {
+				size_t n = bits_text_len(bit_fmt, p->count);
+				char *s;
+
+				jw_lit(&w, ",\"bits\":\"");
+				s = jw_room(&w, n);
+				if (s)
+					bits_text(s, bit_fmt, plan->bits, off,
+						  p->count);
+				jw_char(&w, '"');
+			}
+
+			if (pt->bit_name_count) {
+				int first = 1;
+
+				jw_lit(&w, ",\"on\":[");
+				for (int k = 0; k < pt->bit_name_count; k++) {
+					if (!pt->bit_name[k][0] ||
+					    !BITS_TEST(plan->bits, off + k))
+						continue;
+					if (!first)
+						jw_char(&w, ',');
+					first = 0;
+					jw_str(&w, pt->bit_name[k]);
+				}
+				jw_char(&w, ']');
+			}
+		} else {
+			const uint16_t *regs = plan->regs + slot->offset;
+
+			if (p->count == 1 && raw_mode) {
+				jw_lit(&w, ",\"raw\":");
+				json_values(&w, p, slot, regs, 1);
+			} else if (p->count == 1) {
+				jw_lit(&w, ",\"value\":");
+				json_values(&w, p, slot, regs, 0);
+			} else {
+				jw_lit(&w, ",\"value\":[");
+				json_values(&w, p, slot, regs, 0);
+				jw_char(&w, ']');
+			}
+		}
+		jw_char(&w, '}');
+	}
+
+	jw_lit(&w, "]}");
+	jw_finish(&w);
+	return w.len;
+}
+
+/*
+ * telemetry_write_bin - the same document as telemetry_write() in CBOR or
+ * MessagePack. Containers carry their size up front, so the parameters
+ * in mask are counted first.
+ */
+static size_t telemetry_write_bin(const struct dev_tmpl *t,
+				  const struct read_plan *plan, uint32_t mask,
+				  time_t now, char *buf, size_t cap)
+{
+	const struct io_device *dev = t->dev;
+	struct bw w;
+	uint32_t due = 0;
+
+	for (int i = 0; i < dev->parameter_count; i++)
+		if (mask & (1u << i))
+			due++;
+
+	bw_init(&w, buf, cap, tel_fmt);
+	bw_raw(&w, t->head, t->head_len);
+	bw_int(&w, (int64_t)now);
+	bw_str(&w, "data");
+	bw_array(&w, due);
+
+	for (int i = 0; i < dev->parameter_count; i++) {
+		const struct parameter *p = &dev->parameters[i];
+		const struct param_slot *slot = &plan->slots[i];
+		const struct param_tmpl *pt = &t->params[i];
+		int ok, named;
+
+		if (!(mask & (1u << i)))
+			continue;
+
+		ok = read_plan_param_ok(plan, i);
+		named = ok && REG_IS_BIT(slot->type) && pt->bit_name_count;
+		bw_map(&w, !ok ? 2 : named ? 4 : 3);
+		bw_raw(&w, pt->head, pt->head_len);
+		if (!ok)
+			continue;
+
+		if (REG_IS_BIT(slot->type)) {
+			int off = slot->offset;
+
+			if (p->count == 1) {
+				bw_str(&w, "raw");
+				bw_uint(&w, BITS_TEST(plan->bits, off));
+			} else if (bit_fmt == BIT_FMT_ARRAY) {
+				bw_str(&w, "raw");
+				bw_array(&w, p->count);
+				for (int k = 0; k < p->count; k++)
+					bw_uint(&w, BITS_TEST(plan->bits, off + k));
+			} else {
+				uint8_t *s;
+
+				bw_str(&w, "bits");
+				s = bw_bin(&w, BITS_BYTES(p->count));
+				if (s)
+					bits_extract(s, plan->bits, off, p->count);
+			}
+
+			if (named) {
+				bw_str(&w, "on");
+				bw_array(&w, bits_on(pt, plan->bits, off));
+				for (int k = 0; k < pt->bit_name_count; k++)
+					if (pt->bit_name[k][0] &&
+					    BITS_TEST(plan->bits, off + k))
+						bw_str(&w, pt->bit_name[k]);
+			}
+		} else {
+			const uint16_t *regs = plan->regs + slot->offset;
+
+			bw_str(&w, "value");
+			if (p->count != 1)
+				bw_array(&w, p->count);
+			bin_values(&w, p, slot, regs);
+		}
+	}
+	return w.len;
+}
+
+/*
+ * telemetry_init - pre-render the constant parts of every device's
+ * telemetry message. Call once the configuration is loaded.
+ */
+int telemetry_init(const struct config *cfg)
+{
+	int i, k;
+
+	telemetry_cleanup();
+	raw_mode = strcmp(cfg->data_mode, "raw") == 0;
+	bit_fmt = bit_fmt_from_str(cfg->bit_format);
+	tel_fmt = msg_fmt_from_mode(cfg->data_mode);
+	if (tel_fmt == MSG_FMT_SPARKPLUG)
+		return sparkplug_init(cfg);
+	tel_write = tel_fmt == MSG_FMT_JSON ? telemetry_write : telemetry_write_bin;
+
+	for (i = 0; i < cfg->io_device_count && i < (int)MAX_IO_DEVICES; i++) {
+		const struct io_device *dev = &cfg->io_devices[i];
+		struct dev_tmpl *t = &dev_tmpls[i];
+
+		t->dev = dev;
+		if (snprintf(t->topic, sizeof(t->topic), "forgeedge/%s/%s/data",
+			     cfg->forge_edge_id, dev->io_device_id) >=
+		    (int)sizeof(t->topic)) {
+			fprintf(stderr, "[TELEMETRY] topic of %s is longer than %d\n",
+				dev->io_device_id, MSG_TOPIC_LEN - 1);
+			telemetry_cleanup();
+			return -1;
+		}
+		t->head = tmpl_render(&t->head_len, "edge_id", cfg->forge_edge_id,
+				      "io_device_id", dev->io_device_id, 1);
+		if (!t->head)
+			goto nomem;
+
+		for (k = 0; k < dev->parameter_count; k++) {
+			struct param_tmpl *pt = &t->params[k];
+
+			pt->head = tmpl_render(&pt->head_len,
+					       "name", dev->parameters[k].name,
+					       "type", dev->parameters[k].type, 0);
+			if (!pt->head ||
+			    split_bit_names(pt, &dev->parameters[k]) < 0)
+				goto nomem;
+		}
+
+		if (dev->report_by_exception && rbe_init(&t->shadow, dev) < 0)
+			goto nomem;
+	}
+	return 0;
+
+nomem:
+	telemetry_cleanup();
+	return -1;
+}
+
+void telemetry_cleanup(void)
+{
+	int i, k;
+
+	for (i = 0; i < (int)MAX_IO_DEVICES; i++) {
+		struct dev_tmpl *t = &dev_tmpls[i];
+
+		free(t->head);
+		for (k = 0; k < (int)MAX_PARAMETERS; k++) {
+			free(t->params[k].head);
+			free(t->params[k].bit_name);
+		}
+		rbe_free(&t->shadow);
+		memset(t, 0, sizeof(*t));
+	}
+	sparkplug_cleanup();
+}
+
+/*
+ * telemetry_publish - decode the parameters of a poll cycle out of the
+ * images it filled and publish one telemetry message for the device. The
+ * payload is written straight into a pool buffer; only a message too big
+ * for one is written a second time into a heap buffer of the exact size.
+ */
+void telemetry_publish(const struct config *cfg, const struct io_device *dev,
+		       const struct read_plan *plan)
+{
+	struct dev_tmpl *t = tmpl_find(cfg, dev);
+	time_t now = time(NULL);
+	uint32_t mask = plan->mask;
+	struct msg_buf *m;
+	size_t len;
+
+	if (tel_fmt == MSG_FMT_SPARKPLUG) {
+		sparkplug_publish(cfg, dev, plan);
+		return;
+	}
+	if (!t)
+		return;
+
+	if (t->shadow.vals) {
+		mask = rbe_update(&t->shadow, dev, plan, sched_now_ns());
+		if (!mask)
+			return;
+	}
+
+	m = msg_alloc(MSG_BUF_SIZE);
+	if (!m)
+		return;
+
+	len = tel_write(t, plan, mask, now, m->data, m->cap);
+	if (len >= m->cap) {
+		msg_put(m);
+		m = msg_alloc(len + 1);
+		if (!m)
+			return;
+		tel_write(t, plan, mask, now, m->data, m->cap);
+	}
+	m->len = len;
+	m->fmt = tel_fmt;
+	memcpy(m->topic, t->topic, sizeof(m->topic));
+	mqtt_publish_buf(m, Q_PRIO_TELEMETRY);
+}
+
+/*
+ * telemetry_publish_stats - per-device poll health on
+ * forgeedge/<edge>/<device>/stats.
+ */
+void telemetry_publish_stats(const struct config *cfg,
+			     const struct io_device *dev,
+			     const struct device_stats *st)
+{
+	cJSON *root, *q;
+	struct queue_stats qs;
+	struct msg_buf *m;
+
+	root = cJSON_CreateObject();
+	if (!root)
+		return;
+
+	cJSON_AddStringToObject(root, "edge_id", cfg->forge_edge_id);
+	cJSON_AddStringToObject(root, "io_device_id", dev->io_device_id);
+	cJSON_AddNumberToObject(root, "timestamp", (double)time(NULL));
+	cJSON_AddNumberToObject(root, "cycles", (double)st->sched.cycles);
+	cJSON_AddNumberToObject(root, "overruns", (double)st->sched.overruns);
+	cJSON_AddNumberToObject(root, "skipped", (double)st->sched.skipped);
+	cJSON_AddNumberToObject(root, "lateness_ms",
+				st->sched.lateness_ns / 1e6);
+	cJSON_AddNumberToObject(root, "max_lateness_ms",
+				st->sched.max_lateness_ns / 1e6);
+	cJSON_AddBoolToObject(root, "connected", st->connected);
+	cJSON_AddNumberToObject(root, "connect_failures",
+				(double)st->connect_failures);
+	if (st->rtt.samples)
+		cJSON_AddNumberToObject(root, "srtt_ms", st->rtt.srtt_ns / 1e6);
+	cJSON_AddNumberToObject(root, "response_timeout_ms",
+				st->rtt.rto_ns / 1e6);
+	cJSON_AddNumberToObject(root, "timeouts", (double)st->rtt.timeouts);
+	cJSON_AddStringToObject(root, "state",
+				breaker_state_str(st->breaker.state));
+	cJSON_AddNumberToObject(root, "quarantines", (double)st->breaker.trips);
+	if (st->serial)
+		cJSON_AddNumberToObject(root, "bus_utilization",
+					dtoa_round(st->bus_utilization, 3));
+
+	/* the publish queue is shared, every device reports the same totals */
+	data_queue_get_stats(&qs);
+	q = cJSON_CreateObject();
+	cJSON_AddStringToObject(q, "overflow", q_overflow_str(data_queue_policy()));
+	cJSON_AddNumberToObject(q, "enqueued", (double)qs.enqueued);
+	cJSON_AddNumberToObject(q, "dropped_oldest", (double)qs.dropped_oldest);
+	cJSON_AddNumberToObject(q, "dropped_newest", (double)qs.dropped_newest);
+	cJSON_AddNumberToObject(q, "conflated", (double)qs.conflated);
+	cJSON_AddNumberToObject(q, "starved", (double)qs.starved);
+	cJSON_AddItemToObject(root, "queue", q);
+
+	if (cfg->mqtt.spool_dir[0]) {
+		struct spool_stats ss;
+		cJSON *sp = cJSON_CreateObject();
+
+		spool_get_stats(&ss);
+		cJSON_AddNumberToObject(sp, "spooled", (double)ss.spooled);
+		cJSON_AddNumberToObject(sp, "drained", (double)ss.drained);
+		cJSON_AddNumberToObject(sp, "dropped", (double)ss.dropped);
+		cJSON_AddNumberToObject(sp, "corrupt", (double)ss.corrupt);
+		cJSON_AddNumberToObject(sp, "pending_bytes",
+					(double)ss.pending_bytes);
+		cJSON_AddItemToObject(root, "spool", sp);
+	}
+
+	m = telemetry_render(root);
+	cJSON_Delete(root);
+	if (!m)
+		return;
+	if (snprintf(m->topic, sizeof(m->topic), "forgeedge/%s/%s/stats",
+		     cfg->forge_edge_id, dev->io_device_id) >=
+	    (int)sizeof(m->topic)) {
+		fprintf(stderr, "[TELEMETRY] stats topic of %s is longer than %d\n",
+			dev->io_device_id, MSG_TOPIC_LEN - 1);
+		msg_put(m);
+		return;
+	}
+	mqtt_publish_buf(m, Q_PRIO_BULK);
+}
+
+/*
+ * telemetry_publish_state - a device was quarantined or restored (see
+ * struct breaker), on forgeedge/<edge>/<device>/state.
+ */
+void telemetry_publish_state(const struct config *cfg,
+			     const struct io_device *dev,
+			     const struct breaker *b, uint64_t now)
+{
+	cJSON *root;
+	struct msg_buf *m;
+
+	root = cJSON_CreateObject();
+	if (!root)
+		return;
+
+	cJSON_AddStringToObject(root, "edge_id", cfg->forge_edge_id);
+	cJSON_AddStringToObject(root, "io_device_id", dev->io_device_id);
+	cJSON_AddNumberToObject(root, "timestamp", (double)time(NULL));
+	cJSON_AddStringToObject(root, "state", breaker_state_str(b->state));
+	cJSON_AddNumberToObject(root, "quarantines", (double)b->trips);
+	if (b->state == BRK_OPEN) {
+		cJSON_AddNumberToObject(root, "failures", (double)b->failures);
+		cJSON_AddNumberToObject(root, "next_probe_ms",
+					b->backoff.retry_ns > now ?
+					(b->backoff.retry_ns - now) / 1e6 : 0);
+	}
+
+	m = telemetry_render(root);
+	cJSON_Delete(root);
+	if (!m)
+		return;
+	if (snprintf(m->topic, sizeof(m->topic), "forgeedge/%s/%s/state",
+		     cfg->forge_edge_id, dev->io_device_id) >=
+	    (int)sizeof(m->topic)) {
+		fprintf(stderr, "[TELEMETRY] state topic of %s is longer than %d\n",
+			dev->io_device_id, MSG_TOPIC_LEN - 1);
+		msg_put(m);
+		return;
+	}
+	mqtt_publish_buf(m, Q_PRIO_CONTROL);
+}
@@ -0,0 +1,91 @@
+/*
+ * twheel.c - hierarchical timing wheel.
+ *
+ * Adding a timer and expiring a tick are O(1); timers on the upper levels
+ * are cascaded down one level each time the level below wraps, the same
+ * scheme the Linux kernel used for its timer wheel.
+ */
+
+#include <string.h>
+
+#include "twheel.h"
+
+void tw_init(struct twheel *w, uint64_t now)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = now;
+}
+
+static void tw_insert(struct twheel *w, struct tw_timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta = expires - w->now;
+	int level;
+
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1ull << (TW_BITS * (level + 1))))
+			break;
+
+	if (delta >= (1ull << (TW_BITS * TW_LEVELS)))
+		expires = w->now + (1ull << (TW_BITS * TW_LEVELS)) - 1;
+
+	level = level * TW_BITS;
+	t->next = w->slots[level / TW_BITS][(expires >> level) & TW_MASK];
+	w->slots[level / TW_BITS][(expires >> level) & TW_MASK] = t;
+}
+
+/*
+ * tw_add - timers must expire after the current tick; anything earlier is
+ * treated as due on the next one.
+ */
+void tw_add(struct twheel *w, struct tw_timer *t)
+{
+	if (t->expires <= w->now)
+		t->expires = w->now + 1;
+	tw_insert(w, t);
+}
+
+static int tw_cascade(struct twheel *w, int level)
+{
+	int idx = (w->now >> (TW_BITS * level)) & TW_MASK;
+	struct tw_timer *t = w->slots[level][idx];
+
+	w->slots[level][idx] = NULL;
+	while (t) {
+		struct tw_timer *next = t->next;
+
+		tw_insert(w, t);
+		t = next;
+	}
+	return idx;
+}
+
+/*
+ * tw_advance - run the wheel up to tick "to", calling fn for every timer
+ * that expires on the way. fn may re-add the timer.
+ */
+void tw_advance(struct twheel *w, uint64_t to, tw_expire_fn fn, void *arg)
+{
+	while (w->now < to) {
+		struct tw_timer *t;
+		int level;
+
+		w->now++;
+		for (level = 1; level < TW_LEVELS; level++)
+			if ((w->now & ((1ull << (TW_BITS * level)) - 1)) ||
+			    tw_cascade(w, level))
+				break;
+
+		t = w->slots[0][w->now & TW_MASK];
+		w->slots[0][w->now & TW_MASK] = NULL;
+		while (t) {
+			struct tw_timer *next = t->next;
+
+			if (t->expires <= w->now)
+				fn(t, arg);
+			else
+				tw_add(w, t);	/* parked beyond the top level */
+			t = next;
+		}
+	}
+}